@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+class DefragState;
+
+/// State of a volume, taken from its change journal. Every change to a file on the volume moves next_usn_, so a
+/// snapshot is only valid for exactly the same key.
+struct SnapshotKey {
+    uint32_t volume_serial_;
+    uint64_t journal_id_;
+    int64_t next_usn_;
+};
+
+/// Saves the result of the analysis of a volume to a file, so a later run can load it instead of reading the MFT
+/// again. The file is a header followed by flat arrays of items, fragments and name characters, which are used in
+/// place through a mapping of the file. The header also has the zones and a summary of the cluster bitmap of the
+/// volume when the snapshot was saved. Only volumes with a change journal have a key, on other volumes all the
+/// functions do nothing. If the volume changed since the snapshot, the change journal tells which Inodes have to be
+/// read again.
+class AnalysisSnapshot {
+public:
+    /// Read the key of the volume and decide the name of its snapshot file. Does nothing if data.snapshot_dir_ is
+    /// empty.
+    static void prepare(DefragState &data);
+
+    /// Check the snapshot file against the volume and show the result, without loading or changing it. This is
+    /// OptimizeMode::ValidateSnapshot.
+    static void check(DefragState &data);
+
+    /// Build the item tree from the snapshot file. The items of the Inodes that changed since the snapshot are
+    /// read from the MFT again. If that is not possible (the journal has wrapped, or too much changed) the snapshot
+    /// is deleted and false is returned, the volume then has to be analyzed.
+    static bool load(DefragState &data);
+
+    /// Write the item tree to the snapshot file, unless the file already matches the tree
+    static bool save(DefragState &data);
+
+    /// Delete the snapshot file, the items are about to be moved and it will no longer match the volume
+    static void discard(DefragState &data);
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/// A change to an Inode, taken from a record of the change journal
+struct JournalChange {
+    uint64_t inode_;
+    // The parent directory, its index may have changed as well
+    uint64_t parent_inode_;
+    // USN_REASON_* flags
+    uint32_t reason_;
+};
+
+/// Reads the change journal of an NTFS volume. The journal of the volume itself is read with FSCTL_READ_USN_JOURNAL,
+/// a recorded journal file drives the same incremental analysis without asking the volume, so a saved snapshot can
+/// be brought up to date with a known set of changes.
+class ChangeJournalReader {
+public:
+    virtual ~ChangeJournalReader() = default;
+
+    /// Return the id of the journal, the oldest USN that is still in the journal, and the USN of the next record
+    virtual bool query(PARAM_OUT uint64_t &journal_id, PARAM_OUT int64_t &first_usn, PARAM_OUT int64_t &next_usn) = 0;
+
+    /// Read the changes from start_usn up to the end of the journal. Return false if the journal does not go back
+    /// to start_usn any more (it has wrapped), the volume then has to be analyzed completely.
+    virtual bool read_changes(int64_t start_usn, PARAM_OUT std::vector<JournalChange> &changes) = 0;
+
+    /// Read the journal of the volume, or the recorded journal file if journal_file is not empty. Return nullptr if
+    /// there is no journal.
+    static std::unique_ptr<ChangeJournalReader> create(HANDLE volume_handle, const std::wstring &journal_file);
+};
+
+/// Reads the change journal of a volume through the volume handle
+class VolumeJournalReader : public ChangeJournalReader {
+public:
+    explicit VolumeJournalReader(HANDLE volume_handle) : volume_handle_(volume_handle) {}
+
+    bool query(PARAM_OUT uint64_t &journal_id, PARAM_OUT int64_t &first_usn, PARAM_OUT int64_t &next_usn) override;
+
+    bool read_changes(int64_t start_usn, PARAM_OUT std::vector<JournalChange> &changes) override;
+
+private:
+    // Non-owning
+    HANDLE volume_handle_;
+};
+
+/// Reads a journal that was recorded to a file: a USN_JOURNAL_DATA_V0 struct, followed by USN_RECORD_V2 records
+/// as FSCTL_READ_USN_JOURNAL returns them (without the USN in front of every buffer).
+class RecordedJournalReader : public ChangeJournalReader {
+public:
+    bool open(const wchar_t *path);
+
+    bool query(PARAM_OUT uint64_t &journal_id, PARAM_OUT int64_t &first_usn, PARAM_OUT int64_t &next_usn) override;
+
+    bool read_changes(int64_t start_usn, PARAM_OUT std::vector<JournalChange> &changes) override;
+
+private:
+    USN_JOURNAL_DATA_V0 journal_{};
+    std::vector<BYTE> records_;
+};
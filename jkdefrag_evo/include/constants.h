@@ -51,7 +51,8 @@ enum class OptimizeMode {
     AnalyzeSortByChanged = 9,
     // Analyze and sort files by creation time(oldest first).
     AnalyzeSortByCreated = 10,
-    // 11 (unused?) - move to beginning of disk
+    // Only check the analysis snapshot of an earlier run against the volume, nothing is analyzed or moved.
+    ValidateSnapshot = 11,
     Max
 };
 
@@ -146,6 +146,9 @@ private:
     // Mutex to make the display single-threaded.
     std::mutex display_mutex_{};
 
+    // Mutex for show_debug(), which can be called from the analyze threads.
+    std::mutex debug_mutex_{};
+
     // Handle to graphics device context; TODO: Do not store it here, store in local variable
     HDC dc_{};
 
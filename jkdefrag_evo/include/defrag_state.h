@@ -1,9 +1,13 @@
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "runner.h"
+#include "analysis_snapshot.h"
+#include "move_executor.h"
+#include "move_journal.h"
 #include "extent.h"
 #include "../src/tech/defrag/volume_bitmap.h"
 
@@ -54,7 +58,7 @@ public:
 
     /// Tree in memory with information about all the files.
     FileNode *item_tree_{};
-    int balance_count_{};
+    Tree::Statistics tree_statistics_{};
 
     /// Array with exclude masks
     Wstrings excludes_{};
@@ -65,6 +69,24 @@ public:
     /// Array with SpaceHog masks
     std::vector<std::wstring> space_hogs_{};
 
+    /// Directory for the analysis snapshots, empty if they are not used
+    std::wstring snapshot_dir_;
+    /// Recorded change journal to use instead of the journal of the volume, empty to use the volume
+    std::wstring journal_file_;
+    /// Key and file name of the snapshot of this volume, only set if the volume has a change journal
+    std::optional<SnapshotKey> snapshot_key_;
+    std::wstring snapshot_path_;
+    /// True while the snapshot file matches the item tree. Before the first move it is deleted, or kept together
+    /// with the journal of the moves.
+    bool snapshot_saved_{};
+    /// The moves since the snapshot file was saved
+    MoveJournal move_journal_;
+    /// Where the sort of a run that was stopped left off, taken from the journal when the snapshot was loaded
+    std::optional<MoveCursor> resume_cursor_;
+
+    /// Performs the moves, on the volume unless a simulated volume was put in its place
+    std::unique_ptr<MoveExecutor> move_executor_;
+
     /// Begin (LCN) of the zones
     lcn64_t zones_[4] = {};
 
@@ -129,6 +151,11 @@ public:
     // Variables used to throttle the speed; Speed as a percentage 1..100
     uint64_t speed_{};
 
+    /// Number of moves that run at the same time on a disk without seek penalty, 0 to tune the number while running
+    size_t move_concurrency_{};
+    /// Do the moves of whole items in the order they were planned, also on a rotating disk
+    bool keep_move_order_{};
+
     Clock::time_point start_time_{};
     Clock::duration running_time_{};
     Clock::time_point last_checkpoint_{};
@@ -21,6 +21,8 @@ struct FileFragment {
         return lcn_ == VIRTUALFRAGMENT;
     }
 
+    bool operator==(const FileFragment &) const = default;
+
 private:
     static constexpr vcn64_t VIRTUALFRAGMENT = std::numeric_limits<vcn64_t>::max();
 };
@@ -33,6 +35,9 @@ public:
     void set_names(const wchar_t *long_path, const wchar_t *long_filename, const wchar_t *short_path,
                    const wchar_t *short_filename);
 
+    // Set the long and short filename, without a path
+    void set_filenames(std::wstring &&long_filename, std::wstring &&short_filename);
+
     FileNode() = default;
 
     virtual ~FileNode();
@@ -73,6 +78,8 @@ public:
     FileNode *smaller_ = nullptr;
     // Next bigger item
     FileNode *bigger_ = nullptr;
+    // Height of the subtree of this item, to keep the tree balanced
+    int tree_height_{};
 
     uint64_t bytes_;
     cluster_count64_t clusters_count_;
@@ -84,6 +91,8 @@ public:
     // TODO: Owning pointer
     std::list<FileFragment> fragments_;
 
+    // The Inode number of the item, 0 on volumes without Inodes
+    inode_t inode_{};
     // The Inode number of the parent directory
     inode_t parent_inode_;
 
@@ -94,6 +103,10 @@ public:
     bool is_excluded_;
     // file to be moved to the end of disk
     bool is_hog_;
+    // A move of the item is in flight, the planner must not pick it again
+    bool is_moving_{};
+    // The fragments were predicted after a move and not yet read back from the volume
+    bool fragments_predicted_{};
 
     void set_long_path(const wchar_t *value) {
         long_path_ = value;
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include "types.h"
+#include "str_util.h"
+
+class DefragState;
+
+/// Verdicts of the include, exclude and spacehog masks, valid for all the items inside one directory.
+struct DirectoryMaskVerdicts {
+    Str::MaskVerdict include_ = Str::MaskVerdict::Depends;
+    // One verdict per mask, same order as DefragState::excludes_
+    std::vector<Str::MaskVerdict> excludes_;
+    // One verdict per mask, same order as DefragState::space_hogs_
+    std::vector<Str::MaskVerdict> space_hogs_;
+};
+
+/// Remembers for every directory which masks match all of its items, none of them, or have to be tested for
+/// each item. Subdirectories inherit the Always and Never verdicts of their parent, so a mask such as
+/// "?:\WINDOWS\Fonts\*" is compared with the top directories once instead of with every file on the volume.
+class MaskCache {
+public:
+    explicit MaskCache(const DefragState &data) : data_(data) {}
+
+    /// Return the verdicts for the directory that holds the item. The item must have its paths set. Items in
+    /// the root of the volume have no parent directory and get nullptr, they must be matched the regular way.
+    const DirectoryMaskVerdicts *verdicts_for(const FileNode *item);
+
+    /// Match the long and the short path of the item with the mask, unless the verdict already decides it.
+    [[nodiscard]] static bool match(Str::MaskVerdict verdict, const FileNode *item, const wchar_t *mask);
+
+    [[nodiscard]] size_t size() const { return cache_.size(); }
+
+private:
+    const DefragState &data_;
+    std::unordered_map<const FileNode *, DirectoryMaskVerdicts> cache_;
+};
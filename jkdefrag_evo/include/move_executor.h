@@ -0,0 +1,242 @@
+#pragma once
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "types.h"
+#include "file_node.h"
+#include "str_util.h"
+#include "time_util.h"
+
+class DefragState;
+
+// Number of item handles that are kept open for the next move of the same item
+constexpr size_t MOVE_HANDLE_CACHE_SIZE = 16;
+
+// Limits of the size of the block that is moved in one FSCTL_MOVE_FILE call, and the size it starts at
+constexpr uint64_t MOVE_CHUNK_MIN_BYTES = megabytes(16ULL);
+constexpr uint64_t MOVE_CHUNK_MAX_BYTES = gigabytes(1ULL);
+constexpr uint64_t MOVE_CHUNK_INITIAL_BYTES = megabytes(64ULL);
+// A move that takes longer makes the chunk smaller, so the screen and the stop button stay responsive
+constexpr auto MOVE_CHUNK_LATENCY_TARGET = std::chrono::milliseconds(500);
+// Most clusters that the learned alignment of partial moves goes up to
+constexpr cluster_count64_t MOVE_MAX_PARTIAL_ALIGNMENT = 64;
+// Every this many predicted fragment lists one is checked against the volume, and after a wrong one this many are
+constexpr uint64_t MOVE_VERIFY_INTERVAL = 16;
+
+/// Counters of the moves that an executor has done
+struct MoveStatistics {
+    uint64_t moves_ = 0;
+    uint64_t failed_moves_ = 0;
+    uint64_t clusters_moved_ = 0;
+    uint64_t bytes_moved_ = 0;
+    // Clusters the disk head travels: from where it was to the data, and from the data to the destination
+    uint64_t seek_distance_ = 0;
+    // Where the disk head is after the last move
+    lcn64_t head_ = 0;
+    // Handles that were asked for, and the ones of them that had to be opened
+    uint64_t open_requests_ = 0;
+    uint64_t opens_ = 0;
+    // Moves after which the new fragments of the item were predicted, the ones that were read back from the volume
+    // to check them, and the ones of those that were wrong
+    uint64_t predictions_ = 0;
+    uint64_t verified_predictions_ = 0;
+    uint64_t mispredictions_ = 0;
+};
+
+/// Clusters that a move took from from_lcn_ to to_lcn_
+struct RelocatedExtent {
+    lcn64_t from_lcn_;
+    lcn64_t to_lcn_;
+    cluster_count64_t count_;
+};
+
+/// Change the fragments like a move of count clusters from virtual cluster vcn to lcn does: the block is cut out of
+/// the fragments, its real parts go to lcn, and the parts are joined again where they are contiguous. The clusters
+/// that moved are added to relocated. Return false if the block is not inside the fragments, they are unchanged.
+bool relocate_fragments(std::list<FileFragment> &fragments, vcn64_t vcn, lcn64_t lcn, cluster_count64_t count,
+                        std::vector<RelocatedExtent> *relocated = nullptr);
+
+/// Performs the moves of the defragger. The volume executor asks Windows to move the clusters, the simulated
+/// executor applies them to a volume in memory, so a strategy can be run and measured without a disk. Moves of
+/// different items can be done from several threads at the same time.
+///
+/// Closed handles stay open in a small cache, so the next chunk or retry of the same item does not open it again. A
+/// handle that a move failed with is closed for real. The cache is emptied at the end of every phase.
+class MoveExecutor {
+public:
+    virtual ~MoveExecutor() = default;
+
+    /// Open the item for moving, and for reading its clustermap. Return nullptr if it could not be opened.
+    HANDLE open(const DefragState &data, const FileNode *item);
+
+    /// Give the handle back, it is kept in the cache unless a move with it failed
+    void close(HANDLE file_handle);
+
+    /// Close the cached handles at the end of a phase, and log how many handles the phase opened
+    void release_handles();
+
+    /// Move count clusters of the item, starting at virtual cluster vcn, to lcn. from_lcn is where the clusters are
+    /// now, it is only used for the statistics. Return NO_ERROR or the Windows error code.
+    DWORD move(const DefragState &data, HANDLE file_handle, const FileNode *item, vcn64_t vcn, lcn64_t from_lcn,
+               lcn64_t lcn, cluster_count64_t count);
+
+    /// Read the fragments of the item again, after it was moved
+    virtual bool read_fragments(const DefragState &data, FileNode *item, HANDLE file_handle) = 0;
+
+    /// Count a move after which the new fragments of the item were predicted, and decide whether they have to be
+    /// read from the volume to check the prediction: when required, every MOVE_VERIFY_INTERVAL predictions, and for
+    /// the next MOVE_VERIFY_INTERVAL predictions after a wrong one.
+    bool verify_prediction(bool required);
+
+    /// Count a prediction that was checked against the fragments on the volume
+    void observe_prediction(bool correct);
+
+    /// Only valid while no moves are running
+    [[nodiscard]] const MoveStatistics &statistics() const { return statistics_; }
+
+    /// The biggest block to move in one call. It grows while the throughput of full chunks rises, and is halved when
+    /// a chunk takes longer than MOVE_CHUNK_LATENCY_TARGET.
+    [[nodiscard]] cluster_count64_t chunk_clusters(const DefragState &data) const;
+
+    /// Start again for a new volume: the statistics at zero and the chunk size at MOVE_CHUNK_INITIAL_BYTES
+    void reset();
+
+    /// The analysis of the volume is done, the tree of data has all the items
+    virtual void volume_analyzed(DefragState &) {}
+
+protected:
+    virtual HANDLE open_item(const DefragState &data, const FileNode *item) = 0;
+
+    virtual void close_item(HANDLE file_handle) = 0;
+
+    virtual DWORD move_clusters(const DefragState &data, HANDLE file_handle, const FileNode *item, vcn64_t vcn,
+                                lcn64_t lcn, cluster_count64_t count) = 0;
+
+    /// Close the handles in the cache that are not in use, return how many handles were asked for and opened since
+    /// the last call
+    void close_cached_handles(PARAM_OUT uint64_t &requests, PARAM_OUT uint64_t &opens);
+
+private:
+    struct CachedHandle {
+        const FileNode *item_;
+        HANDLE handle_;
+        bool in_use_;
+        // A move with the handle failed, close it when it is given back
+        bool stale_;
+    };
+
+    // Adapt the chunk size to a move of bytes that took latency
+    void observe_chunk(uint64_t bytes, Clock::duration latency);
+
+    // Also guards the chunk size
+    mutable std::mutex statistics_mutex_;
+    MoveStatistics statistics_;
+
+    // Predictions that are still checked since the last wrong one
+    uint64_t verify_countdown_ = 0;
+
+    uint64_t chunk_bytes_ = MOVE_CHUNK_INITIAL_BYTES;
+    // Bytes per second of the last full chunk
+    double chunk_throughput_ = 0;
+
+    // Most recently used first
+    std::mutex handles_mutex_;
+    std::list<CachedHandle> handles_;
+    uint64_t phase_requests_ = 0;
+    uint64_t phase_opens_ = 0;
+};
+
+/// Moves the clusters of the volume with FSCTL_MOVE_FILE
+class VolumeMoveExecutor : public MoveExecutor {
+public:
+    ~VolumeMoveExecutor() override;
+
+    bool read_fragments(const DefragState &data, FileNode *item, HANDLE file_handle) override;
+
+protected:
+    HANDLE open_item(const DefragState &data, const FileNode *item) override;
+
+    void close_item(HANDLE file_handle) override;
+
+    DWORD move_clusters(const DefragState &data, HANDLE file_handle, const FileNode *item, vcn64_t vcn,
+                        lcn64_t lcn, cluster_count64_t count) override;
+};
+
+/// A volume in memory: the fragments of every item and the state of every cluster. It is filled from the tree of the
+/// analysis, simulate_image_sync() runs the stages against it. Moves change the fragments and
+/// the clusters like Windows would, and fail like Windows would when the destination is not free. Failures can be
+/// added: items that cannot be opened (another program has them locked), and clusters that stay allocated after a
+/// move until the next checkpoint, like NTFS does. A latency model makes every move take time, so the effect of
+/// running several moves at the same time can be measured.
+class SimulatedMoveExecutor : public MoveExecutor {
+public:
+    /// Take the items in the tree of data as the contents of the volume, and fill the cluster bitmap of data
+    void load(DefragState &data);
+
+    /// Opening the item fails with ERROR_SHARING_VIOLATION
+    void lock_item(const FileNode *item) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        locked_.insert(item);
+    }
+
+    /// The clusters that a move frees can be used again after this many more moves. Zero frees them at once.
+    void set_checkpoint_interval(const uint64_t moves) { checkpoint_interval_ = moves; }
+
+    /// Every move takes per_move plus per_cluster for every cluster it moves. The device works on at most channels
+    /// moves at the same time, more moves wait for a free channel.
+    void set_latency(Clock::duration per_move, Clock::duration per_cluster, size_t channels);
+
+    /// Load the volume from the items that the analysis found
+    void volume_analyzed(DefragState &data) override { load(data); }
+
+    bool read_fragments(const DefragState &data, FileNode *item, HANDLE file_handle) override;
+
+protected:
+    HANDLE open_item(const DefragState &data, const FileNode *item) override;
+
+    void close_item(HANDLE) override {}
+
+    DWORD move_clusters(const DefragState &data, HANDLE file_handle, const FileNode *item, vcn64_t vcn,
+                        lcn64_t lcn, cluster_count64_t count) override;
+
+private:
+    enum class SimulatedCluster : uint8_t {
+        Free,
+        InUse,
+        // Freed by a move, but not yet written to disk by a checkpoint
+        Held,
+    };
+
+    // Clusters that are held until the number of moves reaches release_at_
+    struct HeldExtent {
+        uint64_t release_at_;
+        lcn64_t lcn_;
+        cluster_count64_t count_;
+    };
+
+    void release_held();
+
+    // Wait as long as the device would take for the move
+    void wait_for_device(cluster_count64_t count);
+
+    // Guards the volume, moves of different items only take it to apply their result
+    std::mutex mutex_;
+    std::unordered_map<const FileNode *, std::list<FileFragment>> files_;
+    std::vector<SimulatedCluster> clusters_;
+    std::vector<HeldExtent> held_;
+    std::unordered_set<const FileNode *> locked_;
+    uint64_t checkpoint_interval_ = 0;
+    uint64_t moves_ = 0;
+
+    Clock::duration latency_per_move_{};
+    Clock::duration latency_per_cluster_{};
+    size_t channels_ = 1;
+    size_t busy_channels_ = 0;
+    std::mutex device_mutex_;
+    std::condition_variable device_free_;
+};
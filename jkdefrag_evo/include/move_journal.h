@@ -0,0 +1,144 @@
+#pragma once
+
+#include <Windows.h>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "types.h"
+#include "constants.h"
+#include "time_util.h"
+
+class DefragState;
+
+// Number of records of finished moves and cursors that are kept in memory and then written and flushed to disk
+// together, and the longest time a record waits for the others
+constexpr size_t MOVE_JOURNAL_BATCH_SIZE = 64;
+constexpr auto MOVE_JOURNAL_FLUSH_INTERVAL = std::chrono::seconds(2);
+
+// Value of MoveCursor::previous_inode_ when no item of the zone was placed yet
+constexpr inode_t MOVE_CURSOR_NO_ITEM = UINT64_MAX;
+
+/// Where optimize_sort() was: the next item of zone_ goes to lcn_, and is the first in sort order after the item with
+/// Inode previous_inode_. The streams of a file share its Inode, previous_name_hash_ tells which of them it was.
+struct MoveCursor {
+    int sort_field_;
+    Zone zone_;
+    lcn64_t lcn_;
+    inode_t previous_inode_;
+    uint64_t previous_name_hash_;
+
+    /// Hash of the long name of an item, which has the name of the stream
+    static uint64_t name_hash(const FileNode *item);
+};
+
+/// Append-only journal of the moves since the snapshot of the analysis was saved, in a file next to the snapshot. If
+/// the run is stopped, or the machine goes down, before the snapshot is saved again, the next run loads the snapshot
+/// and only reads the items in the journal from the MFT again, instead of analyzing the volume. The cursor of
+/// optimize_sort() is recorded as well, so the next run continues sorting where this one was.
+///
+/// The journal is write-ahead: the record of a planned move is flushed to disk before the move is done, alone by
+/// plan(), or together with the other moves of a batch by plan_ahead() and flush(). The records of finished moves
+/// and of the cursor are flushed in batches, so the last of them can be missing after a crash; the items of the
+/// planned moves are read again anyway. The journal is only used from the planner thread.
+class MoveJournal {
+public:
+    MoveJournal() = default;
+
+    ~MoveJournal();
+
+    MoveJournal(const MoveJournal &) = delete;
+
+    MoveJournal &operator=(const MoveJournal &) = delete;
+
+    /// Start a run on a volume: close the journal of the previous volume, and start the clock of the time to the
+    /// first move
+    void start();
+
+    /// Read the journal of the snapshot of the volume: the Inodes of all the items that were moved, and the last
+    /// cursor. Return false if there is no journal, or it is of another volume.
+    static bool recover(const DefragState &data, PARAM_OUT std::vector<inode_t> &inodes,
+                        PARAM_OUT std::optional<MoveCursor> &cursor);
+
+    /// A move is about to be done: write its record and flush it to disk, unless plan_ahead() already did. The first
+    /// move opens the journal, the snapshot file stays valid together with the journal. If the volume has no
+    /// snapshot, or the journal cannot be written, the snapshot is discarded instead.
+    void plan(DefragState &data, const MoveTask &task);
+
+    /// A move of a batch will be done. The records of the batch are written by the flush() that the caller does
+    /// before the first move of the batch, plan() of the move then writes nothing.
+    void plan_ahead(DefragState &data, const MoveTask &task);
+
+    /// A move of a batch will not be done after all, plan() is not called for it. Its record stays in the journal,
+    /// the item is only read again by the next run.
+    void cancel(const MoveTask &task);
+
+    /// The move that plan() was called for is done
+    void done(const MoveTask &task, bool succeeded);
+
+    /// Record where optimize_sort() is. Does nothing until the first move opened the journal.
+    void record_cursor(const MoveCursor &cursor);
+
+    /// Write the records that are waiting and flush them to disk
+    void flush();
+
+    /// Flush and close the journal. The file stays, for the next run.
+    void close();
+
+    /// The snapshot file was saved and contains all the moves: delete the journal
+    void remove(const DefragState &data);
+
+private:
+    enum class RecordType : uint32_t {
+        Planned = 1,
+        Done,
+        Cursor,
+    };
+
+    /// A record of the file. Planned: lcn_ and count_ are the destination and value_ is the first cluster of the
+    /// block. Done: value_ is 1 if the move succeeded. Cursor: inode_ is the previous item, count_ the hash of its
+    /// name and value_ the sort field.
+    /// check_ is a checksum of the other fields, the records after a torn write are ignored.
+    struct Record {
+        RecordType type_;
+        Zone zone_;
+        inode_t inode_;
+        lcn64_t lcn_;
+        cluster_count64_t count_;
+        uint64_t value_;
+        uint64_t check_;
+    };
+
+    // Read the header and the complete records of a journal file. end is the offset after the last complete
+    // record. Return false if it is not a journal of the volume.
+    static bool read_records(HANDLE file, uint32_t volume_serial, PARAM_OUT std::vector<Record> &records,
+                             PARAM_OUT uint64_t &end);
+
+    bool open(const DefragState &data);
+
+    // Open the journal at the first move. Return false if the snapshot was discarded instead.
+    bool prepare(DefragState &data);
+
+    void append(const Record &record);
+
+    void append_planned(const MoveTask &task);
+
+    // Flush the waiting records if there are enough of them, or the oldest waited long enough
+    void flush_when_due();
+
+    HANDLE file_ = nullptr;
+    std::wstring path_;
+    std::wstring snapshot_path_;
+    // Opening the journal failed, it is not tried again on this volume
+    bool failed_ = false;
+    std::vector<Record> pending_;
+    // The moves that plan_ahead() wrote the record for, and plan() was not called for yet
+    std::vector<std::pair<inode_t, lcn64_t>> planned_ahead_;
+    Clock::time_point last_flush_;
+
+    Clock::time_point started_;
+    bool moved_ = false;
+    uint64_t planned_ = 0;
+    uint64_t flushes_ = 0;
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "types.h"
+#include "constants.h"
+#include "file_node.h"
+#include "time_util.h"
+#include "work_queue.h"
+
+class DefragRunner;
+class DefragState;
+
+// Most moves that run at the same time on a disk without seek penalty
+constexpr size_t MOVE_MAX_CONCURRENCY = 8;
+
+/// A move that was handed to the executor threads. The executor only fills in error_, result_, refreshed_ and
+/// latency_, the planner thread owns everything else.
+struct PipelinedMove {
+    MoveTask task_;
+    MoveDirection direction_;
+    // Where the item was before the move
+    lcn64_t old_lcn_;
+    // Where the block is now, and its virtual cluster number
+    lcn64_t from_lcn_;
+    vcn64_t starting_vcn_;
+    // The executor reads the new fragments into this item. It only has the fields of the item that the executor
+    // needs, the item itself stays in the tree, and the planner keeps using it, until the move is applied.
+    std::unique_ptr<FileNode> result_;
+    DWORD error_ = NO_ERROR;
+    bool refreshed_ = false;
+    // How long the executor took for the move, and when it was done
+    Clock::duration latency_{};
+    Clock::time_point done_at_;
+};
+
+/// The result of a move, for the planner to commit the gap it was planned into or to plan it again
+struct MoveOutcome {
+    MoveTask task_;
+    bool succeeded_;
+};
+
+/// Runs the moves of the planner on executor threads, so the planner can look for the next gap and item while the
+/// previous moves are in flight. The destination of a move is reserved in the cluster bitmap until the move is
+/// applied, so find_gap() never returns it to another move; the source stays in use. Items in flight are not
+/// planned again, so the moves that run at the same time are of different items and never overlap. The tree, the
+/// bitmap and the screen are only changed on the planner thread, when poll() or drain() apply the finished moves.
+///
+/// On a disk without seek penalty several moves can run at the same time, the number is tuned while running: if a
+/// window of moves gave more clusters per second than the window before then the number keeps going in the same
+/// direction, otherwise it turns around. If the number is not tuned then max_concurrency moves run from the start.
+class MovePipeline {
+public:
+    /// depth is the number of moves that are planned ahead of the running ones. max_concurrency is the most moves
+    /// that run at the same time, 1 on a rotating disk. tuned is false to always run max_concurrency moves.
+    MovePipeline(DefragRunner &runner, DefragState &data, size_t depth, size_t max_concurrency, bool tuned = true);
+
+    /// Applies the moves that are still in flight and stops the executor threads
+    ~MovePipeline();
+
+    MovePipeline(const MovePipeline &) = delete;
+
+    MovePipeline &operator=(const MovePipeline &) = delete;
+
+    /// Hand a move to the executor, waits while the pipeline is full. Moves that cannot be pipelined (directories
+    /// on a volume that refuses them, blocks bigger than a single FSCTL_MOVE_FILE) are done at once by
+    /// DefragRunner::move_item(). Every submitted move gives one outcome.
+    void submit(const MoveTask &task, MoveDirection direction);
+
+    /// Apply the moves that the executor has finished, without waiting
+    void poll();
+
+    /// Wait for all the moves in flight and apply them
+    void drain();
+
+    /// True if no move is in flight or waiting to be applied
+    [[nodiscard]] bool idle() const { return in_flight_.empty() && alternatives_.empty(); }
+
+    /// The outcome of every move that was applied since the last call
+    std::vector<MoveOutcome> take_outcomes();
+
+private:
+    void run_executor();
+
+    // Apply a move that the executor has finished
+    void apply(PipelinedMove *finished);
+
+    // Change the number of moves that run at the same time, from the throughput of the last window of moves
+    void tune(const PipelinedMove &move);
+
+    // Moves that Windows left fragmented are moved again with the alternative strategy, that needs an idle executor
+    void run_alternatives();
+
+    void finish(const MoveTask &task, bool succeeded);
+
+    DefragRunner &runner_;
+    DefragState &data_;
+    size_t depth_;
+    size_t max_concurrency_;
+    bool tuned_;
+
+    // The executor threads take the gate before a move, so no more than concurrency_ moves run at the same time
+    std::mutex gate_mutex_;
+    std::condition_variable gate_;
+    size_t concurrency_;
+    size_t running_moves_ = 0;
+
+    // The window of finished moves that the throughput is measured over
+    int tune_step_ = 1;
+    size_t window_moves_ = 0;
+    cluster_count64_t window_clusters_ = 0;
+    Clock::duration window_latency_{};
+    Clock::time_point window_start_;
+    double last_throughput_ = 0;
+
+    WorkQueue<PipelinedMove *> todo_;
+    WorkQueue<PipelinedMove *> done_;
+    std::deque<std::unique_ptr<PipelinedMove>> in_flight_;
+    std::vector<std::unique_ptr<PipelinedMove>> alternatives_;
+    std::vector<MoveOutcome> outcomes_;
+    std::vector<std::thread> executors_;
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include "types.h"
+#include "constants.h"
+
+class DefragRunner;
+class DefragState;
+
+// Number of planned moves that are put in elevator order together, on a rotating disk
+constexpr size_t MOVE_SCHEDULER_BATCH_SIZE = 64;
+
+/// A move that was planned but not yet done. Its destination is reserved in the cluster bitmap.
+struct ScheduledMove {
+    MoveTask task_;
+    MoveDirection direction_;
+    // Where the item is now
+    lcn64_t from_lcn_;
+};
+
+/// Collects moves of whole items that were planned one after the other, and does them in elevator order: sweeping
+/// up from the disk head by source LCN, and then by destination LCN. On a rotating disk this saves the head from
+/// jumping between the source and destination regions in tree order. The moves of a batch must be independent,
+/// every item at most once; their destinations do not overlap because they are reserved while the batch is
+/// planned. On a disk without seek penalty, or when the planned order is kept, every move is done at once.
+class MoveScheduler {
+public:
+    MoveScheduler(DefragRunner &runner, DefragState &data);
+
+    /// Does the moves that are left, and logs the seek distance that the elevator order saved
+    ~MoveScheduler();
+
+    MoveScheduler(const MoveScheduler &) = delete;
+
+    MoveScheduler &operator=(const MoveScheduler &) = delete;
+
+    /// Plan a move of a whole item. The destination is reserved until the move is done, when the batch is full.
+    void add(const MoveTask &task, MoveDirection direction);
+
+    /// Do the planned moves in elevator order
+    void flush();
+
+    /// True if a move failed since the last call. The destination of the move is free again, and can be behind the
+    /// gap that the caller is filling.
+    [[nodiscard]] bool take_failed() { return std::exchange(failed_, false); }
+
+private:
+    DefragRunner &runner_;
+    DefragState &data_;
+    size_t batch_size_;
+    std::vector<ScheduledMove> batch_;
+    bool failed_ = false;
+
+    // Estimated seek distance of the moves in the order they were planned, and in the order they were done
+    uint64_t planned_distance_ = 0;
+    uint64_t scheduled_distance_ = 0;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <span>
+
+#include "types.h"
+
+// Number of runs the run list consumers decode at a time
+constexpr size_t NTFS_RUN_BATCH = 32;
+
+/// One run of a non-resident attribute: length clusters starting at vcn, stored at lcn. Virtual runs (holes in
+/// sparse and compressed files) have no clusters on disk, their lcn is the lcn of the previous run.
+struct NtfsRun {
+    vcn64_t vcn_;
+    lcn64_t lcn_;
+    cluster_count64_t length_;
+    bool is_virtual_;
+};
+
+/// Decodes the mapping pairs (the "RunData") of a non-resident attribute. Every pair starts with a header byte,
+/// the low nibble is the size of the length field and the high nibble is the size of the signed lcn delta. The
+/// sizes come from a table, the fields are read with one unaligned 8-byte load each and cut to size with a mask
+/// and a shift, so there is no loop over the bytes of a field.
+class NtfsRunDecoder {
+public:
+    NtfsRunDecoder(const BYTE *run_data, uint32_t run_data_length, vcn64_t starting_vcn);
+
+    /// Decode the next runs into the span. Return the number of runs, 0 when the list is done or corrupt.
+    size_t decode(std::span<NtfsRun> runs);
+
+    /// True if a pair was longer than the buffer, or had a field larger than 8 bytes
+    [[nodiscard]] bool is_corrupt() const { return corrupt_; }
+
+private:
+    const BYTE *run_data_;
+    uint32_t run_data_length_;
+    uint32_t index_ = 0;
+    vcn64_t vcn_;
+    lcn64_t lcn_ = 0;
+    bool corrupt_ = false;
+};
@@ -13,11 +13,19 @@
 using namespace Gdiplus;
 
 #include <TlHelp32.h>                  // CreateToolhelp32Snapshot()
+#include <Psapi.h>                     // GetProcessMemoryInfo()
 #include <string>
 #include <memory>
 #include <optional>
 #include <cwctype>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <bit>
+#include <map>
+#include <iterator>
+#include <span>
 
 #ifdef _DEBUG
 
@@ -25,18 +33,28 @@ using namespace Gdiplus;
 
 #endif
 
+#include "analysis_snapshot.h"
 #include "diskmap.h"
 #include "constants.h"
+#include "change_journal.h"
 #include "defrag_gui.h"
 #include "runner.h"
 #include "defrag_log.h"
 #include "defrag_state.h"
 #include "file_node.h"
+#include "mask_cache.h"
 #include "mem_util.h"
+#include "move_executor.h"
+#include "move_journal.h"
+#include "move_pipeline.h"
+#include "move_scheduler.h"
+#include "ntfs_run_decoder.h"
 #include "str_util.h"
+#include "volume_reader.h"
 #include "scan_fat.h"
 #include "scan_ntfs.h"
 #include "time_util.h"
 #include "tree.h"
 #include "types.h"
+#include "work_queue.h"
 #include "app.h"
@@ -37,6 +37,10 @@ http://www.kessels.com/
 #include "file_node.h"
 #include "extent.h"
 
+class MaskCache;
+
+struct ScannedItem;
+
 // The three running states.
 enum class RunningState {
     RUNNING = 0,
@@ -67,6 +71,12 @@ struct DiskStruct {
     DiskType type_;
 
     cluster_count64_t mft_locked_clusters_; // Number of clusters at begin of MFT that cannot be moved
+
+    bool is_image_ = false; // True if volume_name_ is an image file of a volume, which can only be analyzed
+    bool incurs_seek_penalty_ = true; // False on SSD and NVMe, where moves can run at the same time
+    // Partial moves are rounded down to a multiple of this, it is learned from moves that Windows refuses
+    cluster_count64_t partial_move_alignment_ = 1;
+    uint64_t bytes_read_ = 0; // Number of bytes read by the FAT and NTFS scanners
 };
 
 // List of clusters used by the MFT
@@ -104,10 +114,27 @@ public:
     ///     directory) matches one of the strings in this array then it will be marked as a space hog and moved to the
     ///     set_end of the disk. A build-in list of spacehogs will be added to this list, except if one of the strings in
     ///     the array is "DisableDefaults".
+    /// \param snapshot_dir Directory for the analysis snapshots of the volumes. A later run loads the snapshot instead
+    ///     of analyzing the volume again, and only reads the files that changed since then. Empty to not use
+    ///     snapshots.
+    /// \param journal_file A recorded change journal that is used instead of the journal of the volume, to bring the
+    ///     snapshot up to date. Empty to use the volume.
     /// \param run_state It is used by the stop_defrag() subroutine to stop_and_log the defragger. If the pointer is nullptr
     ///     then this feature is disabled.
     void start_defrag_sync(const wchar_t *path, OptimizeMode optimize_mode, int speed, double free_space,
-                           const Wstrings &excludes, const Wstrings &space_hogs, RunningState *run_state);
+                           const Wstrings &excludes, const Wstrings &space_hogs, const std::wstring &snapshot_dir,
+                           const std::wstring &journal_file, RunningState *run_state);
+
+    /// \brief Only analyze an image file of an NTFS or FAT volume, and show the number of items, the items per
+    ///     second, the bytes read and the peak memory use.
+    /// \param run_state Same as for start_defrag_sync().
+    void analyze_image_sync(const wchar_t *image_path, RunningState *run_state);
+
+    /// \brief Run the stages of optimize_mode on an image file of an NTFS or FAT volume, with the moves done by a
+    ///     SimulatedMoveExecutor instead of Windows. The image is only read. Shows the moves, the failed moves,
+    ///     the clusters moved, the seek distance and the time of the run.
+    /// \param run_state Same as for start_defrag_sync().
+    void simulate_image_sync(const wchar_t *image_path, OptimizeMode optimize_mode, RunningState *run_state);
 
     // Stop the defragger. Wait for a maximum of time_out milliseconds for the defragger to stop. If time_out is zero
     // then wait indefinitely. If time_out is negative then immediately return without waiting.
@@ -125,6 +152,10 @@ public:
 
     static void slow_down(DefragState &data);
 
+    static HANDLE open_item_handle(const DefragState &data, const FileNode *item);
+
+    static bool get_fragments(const DefragState &data, FileNode *item, HANDLE file_handle);
+
     static int get_fragment_count(const FileNode *item);
 
     static bool is_fragmented(const FileNode *item, uint64_t offset, uint64_t size);
@@ -145,6 +176,9 @@ public:
     static void call_show_status(DefragState &defrag_state, DefragPhase phase, Zone zone);
 
 private:
+    // The pipeline runs the moves of the strategies on a thread of its own
+    friend class MovePipeline;
+
     /// \brief Try to change our permissions, so we can access special files and directories
     /// such as "C:\\System Volume Information". If this does not succeed then quietly
     /// continue, we'll just have to do with whatever permissions we have.
@@ -155,6 +189,8 @@ private:
 
     bool defrag_one_path_count_clusters(DefragState &defrag_state);
 
+    static void defrag_one_path_query_seek_penalty(DefragState &defrag_state);
+
     void defrag_one_path_fixup_input_mask(DefragState &data, const wchar_t *target_path);
 
     void defrag_one_path_stages(DefragState &data, OptimizeMode opt_mode);
@@ -169,10 +205,6 @@ private:
 
     [[maybe_unused]] static FileNode *find_item_at_lcn(const DefragState &data, uint64_t lcn);
 
-    static HANDLE open_item_handle(const DefragState &data, const FileNode *item);
-
-    static bool get_fragments(const DefragState &data, FileNode *item, HANDLE file_handle);
-
     /**
      * \brief Look for a gap, a block of empty clusters on the volume.
      * \param minimum_lcn Start scanning for gaps at this location. If there is a gap at this location then return it. Zero is the set_begin of the disk.
@@ -193,12 +225,43 @@ private:
 
     static void calculate_zones(DefragState &data);
 
-    DWORD move_item_whole(DefragState &data, MoveTask &task) const;
+    /**
+     * \brief Translate the number of the first cluster of a block, counted in absolute clusters of the item, into the
+     * virtual cluster number used by Windows and the location of the cluster on disk.
+     * \param offset Number of first cluster of the block
+     * \param vcn out: Virtual cluster number of the first cluster
+     * \param lcn out: Location on disk of the first cluster, zero if the item has no clusters there
+     */
+    static void locate_block(const FileNode *item, vcn64_t offset, PARAM_OUT vcn64_t &vcn, PARAM_OUT lcn64_t &lcn);
+
+    /// The biggest block that is moved in a single FSCTL_MOVE_FILE call, bigger moves are done in parts
+    static cluster_count64_t max_clusters_per_move(const DefragState &data);
+
+    /**
+     * \brief A partial move of the item failed with error, the error_ of its task. If Windows refused the number of
+     * clusters then double the alignment of partial moves on the volume, and make the item movable again so the
+     * caller can retry it.
+     * \return true if the alignment was raised and the move should be tried again
+     */
+    bool learn_partial_move_alignment(DefragState &data, FileNode *item, cluster_count64_t clusters,
+                                      DWORD error) const;
 
-    DWORD move_item_in_fragments(DefragState &data, MoveTask &task) const;
+    // The strategies apply every move that succeeds to predicted, the fragments the item will have after the move.
+    // predicted is reset when a move cannot be predicted.
+    DWORD move_item_whole(DefragState &data, MoveTask &task, std::optional<std::list<FileFragment>> &predicted) const;
+
+    DWORD move_item_in_fragments(DefragState &data, MoveTask &task,
+                                 std::optional<std::list<FileFragment>> &predicted) const;
 
     bool move_item_with_strat(DefragState &data, MoveTask &task, MoveStrategy strategy) const;
 
+    /**
+     * \brief Read the fragments of the items that were predicted after a move from the volume, and count the wrong
+     * predictions. Done before the tree is saved to the snapshot file, which must match the volume.
+     * \return false if an item could not be read and still has predicted fragments
+     */
+    bool verify_predicted_fragments(DefragState &data) const;
+
     /**
      * \brief Subfunction for MoveItem(), see below. Move the item with strategy 0. If this results in fragmentation then try again using strategy 1.
      * Note: The Windows defragmentation API does not report an error if it only moves part of the file and has fragmented the file. This can for example
@@ -212,6 +275,14 @@ private:
      */
     bool move_item_try_strategies(DefragState &data, MoveTask &task, MoveDirection direction) const;
 
+    /**
+     * \brief The second half of move_item_try_strategies(): the block was moved but is fragmented. Move it to another
+     * gap one fragment at a time, and if that gives an unfragmented block then move it back to where it was asked.
+     * \param old_lcn Where the item was before the first move
+     * \return true if success, false if failed to move without fragmenting the item
+     */
+    bool move_item_alternative(DefragState &data, MoveTask &task, MoveDirection direction, lcn64_t old_lcn) const;
+
     /**
      * \brief Move (part of) an item to a new location on disk. Moving the Item will automatically defragment it. If unsuccesful then set the Unmovable
      * flag of the item and return false, otherwise return true. Note: the item will move to a different location in the tree.
@@ -236,11 +307,18 @@ private:
 
     void scan_dir(DefragState &data, const wchar_t *mask, FileNode *parent_directory);
 
+    static void scan_dir_entries(const DefragState &data, const wchar_t *mask, FileNode *parent_directory,
+                                 PARAM_OUT std::vector<ScannedItem> &items);
+
     void analyze_volume(DefragState &data);
 
     void analyze_volume_read_fs(DefragState &data);
 
-    void analyze_volume_process_file(DefragState &data, FileNode *item, filetime64_t time_now);
+    /// \brief Build the paths of the item, apply the include/exclude masks, and decide whether it is a spacehog or
+    /// unmovable. Only touches the item itself, so it can run on several threads at once.
+    /// \return true if the item has to be redrawn in a different color
+    bool analyze_volume_process_file(const DefragState &data, FileNode *item, filetime64_t time_now,
+                                     MaskCache &mask_cache);
 
     void fixup(DefragState &data);
 
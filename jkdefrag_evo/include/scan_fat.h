@@ -1,8 +1,12 @@
 #pragma once
 
+#include "time_util.h"
+
 #pragma pack(push, 1) // Align to bytes
 
+#include <deque>
 #include <memory>
+#include <vector>
 
 struct FatBootSectorStruct {
     UCHAR bs_jmp_boot_[3]; // 0
@@ -80,6 +84,13 @@ struct FatLongNameDirStruct {
 
 #pragma pack(pop) // Reset byte alignment
 
+// Number of directory reads that are in flight at the same time
+constexpr size_t FAT_READ_SLOTS = 4;
+// Clusters of directories that are next to each other on disk are read together, up to this size
+constexpr uint64_t FAT_MAX_READ_SIZE = kilobytes(256);
+// Directories are loaded a batch at a time, a batch holds at most this many bytes of directories
+constexpr uint64_t FAT_DIRECTORY_BATCH_SIZE = megabytes(16);
+
 // The attribute flags
 enum {
     ATTR_READ_ONLY = 0x01,
@@ -92,6 +103,62 @@ enum {
     ATTR_LONG_NAME_MASK = (ATTR_LONG_NAME | ATTR_DIRECTORY | ATTR_ARCHIVE)
 };
 
+/// A run of contiguous clusters in a FAT chain
+struct FatRun {
+    uint64_t first_cluster_;
+    uint64_t count_;
+};
+
+enum class FatChainStatus {
+    Ok, // The chain ends with an EOC mark
+    Broken, // The chain runs into a free, bad or out of range cluster
+    Loops, // The chain never ends
+};
+
+/// The FAT decoded once into a flat array of next cluster numbers, the same for FAT12, FAT16 and FAT32. The next
+/// sweeps note which clusters more than one chain leads to (cross-links), and where the run of contiguous clusters
+/// of every cluster ends. Another pass over the array marks the chains that never end. A chain is then followed
+/// run by run instead of cluster by cluster.
+class FatChains {
+public:
+    /// Decode the raw FAT of fat_bytes bytes. The valid cluster numbers are 2...max_cluster.
+    void decode(DiskType type, const BYTE *fat, uint64_t fat_bytes, uint64_t max_cluster);
+
+    /// Collect the runs of the chain that starts at the cluster. cross_linked is set if the chain leads into a
+    /// cluster that another chain also leads to.
+    FatChainStatus walk(uint64_t cluster, PARAM_OUT std::vector<FatRun> &runs, PARAM_OUT bool &cross_linked) const;
+
+    /// A directory entry, or the boot sector, names the cluster as the first cluster of a chain. Return true if
+    /// another entry or chain already leads to the cluster, it is then cross-linked and walk() reports it.
+    bool claim_head(uint64_t cluster);
+
+    /// Number of clusters that more than one chain or directory entry leads to
+    [[nodiscard]] uint64_t cross_link_count() const { return cross_link_count_; }
+
+private:
+    void find_loops();
+
+    // Values in next_ that are not a cluster number
+    static constexpr uint32_t CHAIN_END = 0xFFFFFFFF;
+    static constexpr uint32_t CHAIN_BROKEN = 0xFFFFFFFE;
+
+    // Bits in flags_
+    static constexpr uint8_t CLUSTER_REFERENCED = 1;
+    static constexpr uint8_t CLUSTER_CROSS_LINKED = 2;
+    static constexpr uint8_t CLUSTER_VISITING = 4;
+    static constexpr uint8_t CLUSTER_DONE = 8;
+    static constexpr uint8_t CLUSTER_LOOPS = 16;
+    // The cluster, or a later cluster of its run, is cross-linked
+    static constexpr uint8_t CLUSTER_RUN_CROSS_LINKED = 32;
+
+    std::vector<uint32_t> next_;
+    // Last cluster of the run of contiguous clusters that the cluster is in
+    std::vector<uint32_t> run_end_;
+    std::vector<uint8_t> flags_;
+    uint64_t max_cluster_ = 0;
+    uint64_t cross_link_count_ = 0;
+};
+
 // Struct used by the scanner to store disk information from the bootblock
 struct FatDiskInfoStruct {
     uint64_t bytes_per_sector_;
@@ -103,11 +170,14 @@ struct FatDiskInfoStruct {
     uint64_t data_sec_;
     uint64_t countof_clusters_;
 
-    union {
-        BYTE *fat12;
-        USHORT *fat16;
-        ULONG *fat32;
-    } fat_data_;
+    FatChains chains_;
+};
+
+// A directory that was found in its parent directory, and has yet to be loaded and analyzed
+struct FatPendingDirectory {
+    // The item of the directory, nullptr for the root directory
+    FileNode *item_;
+    uint64_t start_cluster_;
 };
 
 class ScanFAT {
@@ -121,23 +191,36 @@ public:
 
     bool analyze_fat_volume(DefragState &defrag_state);
 
+    /// Number of directories that the last analysis loaded from their cluster chains, and the time that took. Shown
+    /// by the analysis of an image, to measure load_directories().
+    [[nodiscard]] uint64_t directories_loaded() const { return directories_loaded_; }
+
+    [[nodiscard]] Clock::duration directories_time() const { return directories_time_; }
+
 private:
+    // The part of analyze_fat_volume() that reads through reader_
+    bool analyze_fat_volume_read_items(DefragState &defrag_state);
+
     static uint8_t calculate_short_name_check_sum(const UCHAR *name);
 
     static filetime64_t convert_time(const USHORT date, const USHORT time, const USHORT time10);
 
-    static void make_fragment_list(const DefragState &data, const FatDiskInfoStruct *disk_info, FileNode *item,
-                                   uint64_t cluster);
+    static void make_fragment_list(const FatDiskInfoStruct *disk_info, FileNode *item, uint64_t cluster);
 
-    static BYTE *load_directory(
-            const DefragState &data, const FatDiskInfoStruct *disk_info, uint64_t start_cluster,
-            uint64_t *out_length);
+    void load_directories(DefragState &data, FatDiskInfoStruct *disk_info, std::deque<FatPendingDirectory> &pending);
 
     void analyze_fat_directory(DefragState &data, FatDiskInfoStruct *disk_info, BYTE *buffer, uint64_t length,
-                               FileNode *parent_directory);
+                               FileNode *parent_directory, PARAM_OUT std::deque<FatPendingDirectory> &pending);
 
     // static member that is an instance of itself
     inline static std::unique_ptr<ScanFAT> instance_;
 
     DefragRunner *defrag_lib_;
+
+    // Reader of the volume that is being analyzed, only valid during analyze_fat_volume(),
+    // nullptr otherwise
+    VolumeReader *reader_{};
+
+    uint64_t directories_loaded_ = 0;
+    Clock::duration directories_time_{};
 };
\ No newline at end of file
@@ -1,8 +1,17 @@
 #pragma once
 
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 constexpr size_t MFT_BUFFER_SIZE = kilobytes(256); // 256 KB seems to be the optimum
+// Upper limit for the size of a block of MFT records, the block size grows from MFT_BUFFER_SIZE when reads are fast
+constexpr size_t MFT_MAX_BLOCK_SIZE = megabytes(4);
+// Number of blocks of the MFT that are read at the same time
+constexpr size_t MFT_READ_SLOTS = 3;
+// Ranges of records in use that are separated by less than this are read together, reading the free records in
+// between is cheaper than an extra read
+constexpr size_t MFT_MAX_READ_GAP = kilobytes(64);
 
 struct INODE_REFERENCE {
     ULONG inode_number_low_part_;
@@ -302,6 +311,15 @@ struct StreamStruct {
     uint64_t bytes_; // Total number of bytes
 };
 
+/// Where the MFT is on disk. Filled by analyze_ntfs_volume_extract_mft() while the $MFT itself (Inode 0) is
+/// interpreted, after that it is shared read-only by all the records.
+struct MftLayout {
+    std::list<FileFragment> data_fragments_; // The Fragments of the $MFT::$DATA stream
+    uint64_t data_bytes_; // Length of the $MFT::$DATA
+    std::list<FileFragment> bitmap_fragments_; // The Fragments of the $MFT::$BITMAP stream
+    uint64_t bitmap_bytes_; // Length of the $MFT::$BITMAP
+};
+
 struct InodeDataStruct {
     uint64_t inode_; // The Inode number
     uint64_t parent_inode_; // The Inode number of the parent directory
@@ -319,13 +337,87 @@ struct InodeDataStruct {
     micro64_t last_access_time_;
 
     std::list<StreamStruct> streams_; // List of StreamStruct
-    std::list<FileFragment> mft_data_fragments_; // The Fragments of the $MFT::$DATA stream
 
-    uint64_t mft_data_bytes_; // Length of the $MFT::$DATA
+    // Shared, read-only
+    const MftLayout *mft_layout_;
+    // The layout that is being built, only set while analyze_ntfs_volume_extract_mft() interprets the $MFT
+    MftLayout *mft_layout_builder_;
+};
+
+/// The items that interpret_mft_record() created for one Inode, plus what they add to the counters. Creating
+/// the items can be done on any thread, add_inode_items() then adds them to the tree on a single thread.
+struct InodeItems {
+    uint64_t inode_; // The Inode number
+    std::vector<std::unique_ptr<FileNode>> items_;
+
+    uint64_t count_directories_;
+    uint64_t count_all_files_;
+    uint64_t count_all_bytes_;
+    uint64_t count_all_clusters_;
+    uint64_t count_fragmented_items_;
+    uint64_t count_fragmented_bytes_;
+    uint64_t count_fragmented_clusters_;
+};
+
+/// A copy of a fixed-up MFT record, taken from a block that was read by read_mft_records()
+struct MftRecordCopy {
+    uint64_t inode_;
+    std::vector<BYTE> record_;
+};
+
+/// Fixed-up extension records of the MFT, by Inode number. Inodes with an AttributeList have some of their
+/// attributes in extension records. Those that were in the blocks read by read_mft_records() are kept here,
+/// the others are read from disk in batches by read_extension_records().
+class MftRecordCache {
+public:
+    void clear() {
+        records_.clear();
+        lookups_ = 0;
+        records_read_ = 0;
+        reads_ = 0;
+    }
+
+    [[nodiscard]] bool contains(const uint64_t inode) const { return records_.contains(inode); }
+
+    BYTE *find(const uint64_t inode) {
+        const auto found = records_.find(inode);
+
+        return found == records_.end() ? nullptr : found->second.data();
+    }
+
+    void insert(const uint64_t inode, std::vector<BYTE> &&record) {
+        records_.insert_or_assign(inode, std::move(record));
+    }
+
+    // Number of extension records that were looked up, one random read each without the cache
+    uint64_t lookups_{};
+    // Number of extension records that were not in the blocks, and had to be read
+    uint64_t records_read_{};
+    // Number of reads that were done for them
+    uint64_t reads_{};
+
+private:
+    std::unordered_map<uint64_t, std::vector<BYTE>> records_;
+};
 
-    std::list<FileFragment> mft_bitmap_fragments_; // The Fragments of the $MFT::$BITMAP stream
+/// A range of records in the MFT that are in use according to the $MFT::$BITMAP, possibly with some free
+/// records in between
+struct MftRange {
+    uint64_t first_inode_;
+    uint64_t end_inode_; // One past the last Inode
+};
 
-    uint64_t mft_bitmap_bytes_; // Length of the $MFT::$BITMAP
+/// The result of interpreting one block of MFT records on a worker thread
+struct MftBatch {
+    // Sequence number of the block, batches are merged in the order they were read
+    uint64_t sequence_;
+    // Number of records in the block that are in use according to the $MFT::$BITMAP
+    uint64_t records_in_use_;
+    std::vector<InodeItems> inodes_;
+    // Records with an AttributeList, they are interpreted after all the blocks are done, on the calling thread
+    std::vector<MftRecordCopy> deferred_;
+    // Extension records, they go into the MftRecordCache
+    std::vector<MftRecordCopy> extensions_;
 };
 
 struct NtfsDiskInfoStruct {
@@ -355,24 +447,37 @@ public:
 
     bool analyze_ntfs_volume(DefragState &data);
 
+    /// Bring the items of a loaded snapshot up to date. The items of the Inodes have already been removed from
+    /// the tree, their MFT records are read and interpreted again, and the parent directories of all the items
+    /// are linked again. Return false if the MFT cannot be read, the volume then has to be analyzed completely.
+    bool update_ntfs_inodes(DefragState &data, std::vector<uint64_t> &inodes);
+
 private:
-    bool analyze_ntfs_volume_read_bootblock(DefragState &data, MemReader<uint8_t> &buff);
+    // The part of analyze_ntfs_volume() that reads through the reader
+    bool analyze_ntfs_volume_read_items(DefragState &data, VolumeReader &reader);
 
-    bool analyze_ntfs_volume_read_mft(DefragState &data, NtfsDiskInfoStruct &disk_info, MemReader<uint8_t> &buff);
+    // The part of update_ntfs_inodes() that reads through the reader
+    bool update_ntfs_inodes_read_items(DefragState &data, VolumeReader &reader, std::vector<uint64_t> &inodes);
+
+    bool analyze_ntfs_volume_read_bootblock(DefragState &data, VolumeReader &reader, MemReader<uint8_t> &buff);
+
+    bool analyze_ntfs_volume_read_mft(DefragState &data, VolumeReader &reader, NtfsDiskInfoStruct &disk_info,
+                                      MemReader<uint8_t> &buff);
 
     bool analyze_ntfs_volume_extract_mft(DefragState &data, NtfsDiskInfoStruct &disk_info, MemReader<uint8_t> &buff,
-                                         PARAM_OUT std::list<FileFragment> &mft_bitmap_fragments,
-                                         PARAM_OUT uint64_t &bitmap_bytes, PARAM_OUT uint64_t &mft_data_bytes,
-                                         PARAM_OUT std::list<FileFragment> &mft_data_fragments);
+                                         PARAM_OUT MftLayout &mft_layout);
 
     static const wchar_t *stream_type_names(ATTRIBUTE_TYPE stream_type);
 
     bool fixup_raw_mftdata(DefragState &data, const NtfsDiskInfoStruct *disk_info, BYTE *buffer,
                            uint64_t buf_length) const;
 
-    static BYTE *read_non_resident_data(
+    static void fixup_mft_block(const NtfsDiskInfoStruct &disk_info, BYTE *buffer, uint64_t record_count,
+                                PARAM_OUT std::vector<uint64_t> &valid);
+
+    BYTE *read_non_resident_data(
             const DefragState &data, const NtfsDiskInfoStruct *disk_info, const BYTE *run_data,
-            uint32_t run_data_length, uint64_t offset, uint64_t wanted_length);
+            uint32_t run_data_length, uint64_t offset, uint64_t wanted_length) const;
 
     static bool translate_rundata_to_fragmentlist(
             const DefragState &data, InodeDataStruct *inode_data,
@@ -393,16 +498,57 @@ private:
             DefragState &data, NtfsDiskInfoStruct *disk_info, InodeDataStruct *inode_data, BYTE *buffer,
             uint64_t buf_length, int depth);
 
+    /// Interpret one fixed-up MFT record and create an item for every stream. The items are returned in
+    /// inode_items and are not yet in the tree, so this can run on several threads at once as long as the
+    /// record has no AttributeList (see has_attribute_list) and is not the $MFT itself. mft_layout_builder is only
+    /// given for the $MFT, it is filled with the layout of the MFT.
     bool interpret_mft_record(
-            DefragState &data, NtfsDiskInfoStruct *disk_info, FileNode **inode_array, uint64_t inode_number,
-            uint64_t max_inode, PARAM_OUT std::list<FileFragment> &mft_data_fragments, PARAM_OUT
-            uint64_t &mft_data_bytes, PARAM_OUT std::list<FileFragment> &mft_bitmap_fragments, PARAM_OUT
-            uint64_t &mft_bitmap_bytes, BYTE *buffer, uint64_t buf_length
+            DefragState &data, NtfsDiskInfoStruct *disk_info, uint64_t inode_number, const MftLayout &mft_layout,
+            BYTE *buffer, uint64_t buf_length, PARAM_OUT InodeItems &inode_items,
+            PARAM_OUT MftLayout *mft_layout_builder = nullptr
     );
 
+    /// Add the items of an Inode to the tree, the counters, and the inode array. Single thread only.
+    void add_inode_items(DefragState &data, FileNode **inode_array, uint64_t max_inode,
+                         InodeItems &inode_items) const;
+
+    static bool has_attribute_list(const BYTE *buffer, uint64_t buf_length);
+
+    /// Read all the records of the MFT and interpret them. One thread reads blocks from disk, a pool of
+    /// workers fixes up and interprets the records, and one thread merges the items into the tree.
+    bool read_mft_records(
+            DefragState &data, VolumeReader &reader, NtfsDiskInfoStruct &disk_info, const BYTE *mft_bitmap,
+            const std::vector<MftRange> &ranges, FileNode **inode_array, uint64_t max_inode,
+            const MftLayout &mft_layout);
+
+    /// Walk the $MFT::$BITMAP a word at a time and collect the ranges of records that are in use. Ranges that
+    /// are at most max_gap records apart are merged. Return the number of records in use.
+    static uint64_t find_mft_ranges(const BYTE *mft_bitmap, uint64_t max_inode, uint64_t max_gap,
+                                    PARAM_OUT std::vector<MftRange> &ranges);
+
+    void interpret_mft_block(
+            DefragState &data, NtfsDiskInfoStruct &disk_info, const BYTE *mft_bitmap, uint64_t max_inode,
+            const MftLayout &mft_layout, uint64_t first_inode, uint64_t inode_count, BYTE *buffer,
+            PARAM_OUT MftBatch &batch);
+
+    static bool mft_record_offset(const NtfsDiskInfoStruct *disk_info,
+                                  const std::list<FileFragment> &mft_data_fragments, uint64_t inode,
+                                  PARAM_OUT uint64_t &offset);
+
+    /// Read the extension records that are not in the record cache yet. Records that are next to each other on
+    /// disk are read together, and a number of reads are kept in flight.
+    void read_extension_records(DefragState &data, NtfsDiskInfoStruct *disk_info,
+                                const std::list<FileFragment> &mft_data_fragments, std::vector<uint64_t> &inodes);
+
     // static member that is an instance of itself
     inline static std::unique_ptr<ScanNTFS> instance_;
 
     // Non-owning
     DefragRunner *defrag_lib_{};
+
+    // Non-owning, the reader of the volume. Only valid during analyze_ntfs_volume() and
+    // update_ntfs_inodes(), nullptr otherwise.
+    VolumeReader *reader_{};
+
+    MftRecordCache record_cache_;
 };
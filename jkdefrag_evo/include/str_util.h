@@ -3,15 +3,28 @@
 template<typename NUM>
 constexpr NUM kilobytes(NUM val) { return val * NUM{1024}; }
 
+template<typename NUM>
+constexpr NUM megabytes(NUM val) { return val * NUM{1024} * NUM{1024}; }
+
 template<typename NUM>
 constexpr NUM gigabytes(NUM val) { return val * NUM{1024} * NUM{1024} * NUM{1024}; }
 
 namespace Str {
+    /// Result of comparing a mask with a directory: the mask matches every item inside the directory, none of
+    /// them, or it depends on the rest of the item's name.
+    enum class MaskVerdict {
+        Never = 0,
+        Depends = 1,
+        Always = 2,
+    };
+
     [[nodiscard]] std::wstring from_char(const char *input);
 
     // static wchar_t lower_case(wchar_t c);
 
     [[nodiscard]] bool match_mask(const wchar_t *string, const wchar_t *mask);
 
+    [[nodiscard]] MaskVerdict match_mask_prefix(const wchar_t *prefix, const wchar_t *mask);
+
     [[nodiscard]] std::wstring system_error(DWORD error_code);
 }
\ No newline at end of file
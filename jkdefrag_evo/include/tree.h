@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 
 namespace Tree {
@@ -90,9 +91,117 @@ namespace Tree {
         return step_direction == StepForward ? next(here) : prev(here);
     }
 
+    /// Work done on a tree, to measure what it costs to keep it sorted while items move
+    struct Statistics {
+        uint64_t inserts_ = 0;
+        uint64_t detaches_ = 0;
+        // Items whose LCN changed, and the ones of them that were out of order and had to be inserted again
+        uint64_t repositions_ = 0;
+        uint64_t relinks_ = 0;
+        uint64_t rotations_ = 0;
+    };
+
+    template<class NODE>
+    int height(const NODE *node) {
+        return node == nullptr ? 0 : node->tree_height_;
+    }
+
+    template<class NODE>
+    void update_height(NODE *node) {
+        node->tree_height_ = 1 + std::max(height(node->smaller_), height(node->bigger_));
+    }
+
+    // Put new_child in the place of old_child, under parent or at the root
+    template<class NODE>
+    void replace_child(NODE *&root, NODE *parent, const NODE *old_child, NODE *new_child) {
+        if (parent == nullptr) {
+            root = new_child;
+        } else if (parent->smaller_ == old_child) {
+            parent->smaller_ = new_child;
+        } else {
+            parent->bigger_ = new_child;
+        }
+
+        if (new_child != nullptr) new_child->parent_ = parent;
+    }
+
+    // Rotate left at A, its Bigger child takes its place. Return the Bigger child.
+    template<class NODE>
+    NODE *rotate_left(NODE *&root, NODE *a) {
+        NODE *b = a->bigger_;
+
+        replace_child(root, a->parent_, a, b);
+
+        a->bigger_ = b->smaller_;
+
+        if (a->bigger_ != nullptr) a->bigger_->parent_ = a;
+
+        b->smaller_ = a;
+        a->parent_ = b;
+
+        update_height(a);
+        update_height(b);
+
+        return b;
+    }
+
+    // Rotate right at A, its Smaller child takes its place. Return the Smaller child.
+    template<class NODE>
+    NODE *rotate_right(NODE *&root, NODE *a) {
+        NODE *b = a->smaller_;
+
+        replace_child(root, a->parent_, a, b);
+
+        a->smaller_ = b->bigger_;
+
+        if (a->smaller_ != nullptr) a->smaller_->parent_ = a;
+
+        b->bigger_ = a;
+        a->parent_ = b;
+
+        update_height(a);
+        update_height(b);
+
+        return b;
+    }
+
+    /* Walk up from the node to the root, and restore the height of every node on the way. Where the heights of the
+    two subtrees differ by more than one, rotate the node (AVL). The tree is never deeper than about 1.44 * log2(N),
+    and an insert or detach does at most one rotation per level. For an excellent tutorial see:
+    http://www.stanford.edu/~blp/avl/libavl.html/AVL-Trees.html
+    */
+    template<class NODE>
+    void rebalance(NODE *&root, Statistics &statistics, NODE *node) {
+        while (node != nullptr) {
+            update_height(node);
+
+            const int balance = height(node->bigger_) - height(node->smaller_);
+
+            if (balance > 1) {
+                if (height(node->bigger_->smaller_) > height(node->bigger_->bigger_)) {
+                    rotate_right(root, node->bigger_);
+                    statistics.rotations_++;
+                }
+
+                node = rotate_left(root, node);
+                statistics.rotations_++;
+            } else if (balance < -1) {
+                if (height(node->smaller_->bigger_) > height(node->smaller_->smaller_)) {
+                    rotate_left(root, node->smaller_);
+                    statistics.rotations_++;
+                }
+
+                node = rotate_right(root, node);
+                statistics.rotations_++;
+            }
+
+            node = node->parent_;
+        }
+    }
+
     // Insert a record into the tree. The tree is sorted by LCN (Logical Cluster Number)
     template<class NODE>
-    void insert(NODE *&root, int &balance_count, NODE *new_item) {
+    void insert(NODE *&root, Statistics &statistics, NODE *new_item) {
         if (new_item == nullptr) return;
 
         const auto new_lcn = new_item->get_item_lcn();
@@ -120,6 +229,7 @@ namespace Tree {
         new_item->parent_ = ins;
         new_item->smaller_ = nullptr;
         new_item->bigger_ = nullptr;
+        new_item->tree_height_ = 1;
 
         if (ins == nullptr) {
             root = new_item;
@@ -131,147 +241,35 @@ namespace Tree {
             }
         }
 
-        // If there have been less than 1000 inserts then return
-        balance_count++;
-
-        if (balance_count < 1000) return;
-
-        /* Balance the tree.
-        It's difficult to explain what exactly happens here. For an excellent
-        tutorial see:
-        http://www.stanford.edu/~blp/avl/libavl.html/Balancing-a-BST.html
-        */
-
-        balance_count = 0;
-
-        // Convert the tree into a vine
-        NODE *a = root;
-        NODE *b;
-        NODE *c = a;
-        long count = 0;
-
-        while (a != nullptr) {
-            // If A has no Bigger child then move down the tree
-            if (a->bigger_ == nullptr) {
-                count = count + 1;
-                c = a;
-                a = a->smaller_;
-
-                continue;
-            }
+        statistics.inserts_++;
 
-            // Rotate left at A
-            b = a->bigger_;
-
-            if (root == a) root = b;
-
-            a->bigger_ = b->smaller_;
-
-            if (a->bigger_ != nullptr) a->bigger_->parent_ = a;
-
-            b->parent_ = a->parent_;
-
-            if (b->parent_ != nullptr) {
-                if (b->parent_->smaller_ == a) {
-                    b->parent_->smaller_ = b;
-                } else {
-                    a->parent_->bigger_ = b;
-                }
-            }
-
-            b->smaller_ = a;
-            a->parent_ = b;
-
-            // Do again
-            a = b;
-        }
-
-        // Calculate the number of skips
-        long skip = 1;
-
-        while (skip < count + 2) skip = skip << 1;
-
-        skip = count + 1 - (skip >> 1);
-
-        // Compress the tree
-        while (c != nullptr) {
-            if (skip <= 0) c = c->parent_;
-
-            a = c;
-
-            while (a != nullptr) {
-                b = a;
-                a = a->parent_;
-
-                if (a == nullptr) break;
-
-                // Rotate right at A
-                if (root == a) root = b;
-
-                a->smaller_ = b->bigger_;
-
-                if (a->smaller_ != nullptr) a->smaller_->parent_ = a;
-
-                b->parent_ = a->parent_;
-
-                if (b->parent_ != nullptr) {
-                    if (b->parent_->smaller_ == a) {
-                        b->parent_->smaller_ = b;
-                    } else {
-                        b->parent_->bigger_ = b;
-                    }
-                }
-
-                a->parent_ = b;
-                b->bigger_ = a;
-
-                // Next item
-                a = b->parent_;
-
-                // If there were skips then leave if all done
-                skip = skip - 1;
-                if (skip == 0) break;
-            }
-        }
+        rebalance(root, statistics, ins);
     }
 
     // Detach (unlink) a record from the tree. The record is not freed().
     // See: http://www.stanford.edu/~blp/avl/libavl.html/Deleting-from-a-BST.html
     template<class NODE>
-    void detach(NODE *&root, const NODE *item) {
+    void detach(NODE *&root, Statistics &statistics, const NODE *item) {
         // Sanity check
         if (root == nullptr || item == nullptr) return;
 
+        // The lowest node whose subtree changed, the heights are restored from there up
+        NODE *changed;
+
         if (item->bigger_ == nullptr) {
             /* It is trivial to delete a node with no Bigger child. We replace
             the pointer leading to the node by it's Smaller child. In
             other words, we replace the deleted node by its Smaller child. */
-            if (item->parent_ != nullptr) {
-                if (item->parent_->smaller_ == item) {
-                    item->parent_->smaller_ = item->smaller_;
-                } else {
-                    item->parent_->bigger_ = item->smaller_;
-                }
-            } else {
-                root = item->smaller_;
-            }
+            changed = item->parent_;
 
-            if (item->smaller_ != nullptr) item->smaller_->parent_ = item->parent_;
+            replace_child(root, item->parent_, item, item->smaller_);
         } else if (item->bigger_->smaller_ == nullptr) {
             // The Bigger child has no Smaller child. In this case, we move Bigger
             // into the node's place, attaching the node's Smaller subtree as the
             // new Smaller.
-            if (item->parent_ != nullptr) {
-                if (item->parent_->smaller_ == item) {
-                    item->parent_->smaller_ = item->bigger_;
-                } else {
-                    item->parent_->bigger_ = item->bigger_;
-                }
-            } else {
-                root = item->bigger_;
-            }
+            changed = item->bigger_;
 
-            item->bigger_->parent_ = item->parent_;
+            replace_child(root, item->parent_, item, item->bigger_);
             item->bigger_->smaller_ = item->smaller_;
 
             if (item->smaller_ != nullptr) item->smaller_->parent_ = item->bigger_;
@@ -286,29 +284,15 @@ namespace Tree {
             NODE *b = item->bigger_;
             while (b->smaller_ != nullptr) b = b->smaller_;
 
-            // Detach the successor
-            if (b->parent_ != nullptr) {
-                if (b->parent_->bigger_ == b) {
-                    b->parent_->bigger_ = b->bigger_;
-                } else {
-                    b->parent_->smaller_ = b->bigger_;
-                }
-            }
+            // Detach the successor, it is the Smaller child of its parent
+            changed = b->parent_;
+            changed->smaller_ = b->bigger_;
 
-            if (b->bigger_ != nullptr) b->bigger_->parent_ = b->parent_;
+            if (b->bigger_ != nullptr) b->bigger_->parent_ = changed;
 
             // Replace the node with the successor
-            if (item->parent_ != nullptr) {
-                if (item->parent_->smaller_ == item) {
-                    item->parent_->smaller_ = b;
-                } else {
-                    item->parent_->bigger_ = b;
-                }
-            } else {
-                root = b;
-            }
+            replace_child(root, item->parent_, item, b);
 
-            b->parent_ = item->parent_;
             b->smaller_ = item->smaller_;
 
             if (b->smaller_ != nullptr) b->smaller_->parent_ = b;
@@ -317,6 +301,31 @@ namespace Tree {
 
             if (b->bigger_ != nullptr) b->bigger_->parent_ = b;
         }
+
+        statistics.detaches_++;
+
+        rebalance(root, statistics, changed);
+    }
+
+    /// The LCN of the item changed. If it is still between its neighbours then the tree is still sorted and the item
+    /// stays where it is, otherwise it is detached and inserted again.
+    template<class NODE>
+    void reposition(NODE *&root, Statistics &statistics, NODE *item) {
+        statistics.repositions_++;
+
+        const auto lcn = item->get_item_lcn();
+        const NODE *before = prev(item);
+        const NODE *after = next(item);
+
+        if ((before == nullptr || before->get_item_lcn() <= lcn) &&
+            (after == nullptr || lcn <= after->get_item_lcn())) {
+            return;
+        }
+
+        statistics.relinks_++;
+
+        detach(root, statistics, item);
+        insert(root, statistics, item);
     }
 
     template<class NODE>
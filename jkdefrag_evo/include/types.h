@@ -34,4 +34,7 @@ struct MoveTask {
 
     FileNode *file_ = nullptr;
     HANDLE file_handle_ = nullptr;
+
+    // Windows error of the move of the task that failed, NO_ERROR if no move failed or none was tried
+    DWORD error_ = NO_ERROR;
 };
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+/// Reads raw data from a volume, or from an image file of a volume. A read is started in a slot and finished
+/// later, so a number of reads can be in flight while the data of an earlier read is being processed.
+class VolumeReader {
+public:
+    virtual ~VolumeReader() = default;
+
+    /// Number of reads that can be in flight at the same time
+    [[nodiscard]] virtual size_t slot_count() const = 0;
+
+    /// Start reading length bytes at the byte offset into the buffer. The slot must not be busy, the buffer must
+    /// stay valid until finish_read(). Return false if the read could not be started.
+    virtual bool begin_read(size_t slot, uint64_t offset, BYTE *buffer, size_t length) = 0;
+
+    /// Wait until the read in the slot is done. Return false if it failed or returned less than was asked.
+    virtual bool finish_read(size_t slot) = 0;
+
+    /// Read and wait. Must not be used while there are reads in flight.
+    bool read(const uint64_t offset, BYTE *buffer, const size_t length) {
+        return begin_read(0, offset, buffer, length) && finish_read(0);
+    }
+
+    /// Open a volume with overlapped reads, or an image file through a mapping of the file. Return nullptr if it
+    /// could not be opened, GetLastError() has the reason.
+    static std::unique_ptr<VolumeReader> create(const wchar_t *path, bool is_image, size_t slots);
+
+    /// Number of bytes of all the reads that finished successfully
+    [[nodiscard]] uint64_t bytes_read() const { return bytes_read_; }
+
+    /// Number of reads that finished successfully
+    [[nodiscard]] uint64_t read_count() const { return read_count_; }
+
+protected:
+    uint64_t bytes_read_ = 0;
+    uint64_t read_count_ = 0;
+};
+
+/// Overlapped reads with the Win32 API. The path can be a volume name or the name of an image file.
+class Win32VolumeReader : public VolumeReader {
+public:
+    explicit Win32VolumeReader(size_t slots);
+
+    ~Win32VolumeReader() override;
+
+    Win32VolumeReader(const Win32VolumeReader &) = delete;
+
+    Win32VolumeReader &operator=(const Win32VolumeReader &) = delete;
+
+    bool open(const wchar_t *path);
+
+    [[nodiscard]] size_t slot_count() const override { return slots_.size(); }
+
+    bool begin_read(size_t slot, uint64_t offset, BYTE *buffer, size_t length) override;
+
+    bool finish_read(size_t slot) override;
+
+private:
+    struct Slot {
+        OVERLAPPED overlapped_;
+        DWORD length_;
+    };
+
+    HANDLE handle_ = INVALID_HANDLE_VALUE;
+    std::vector<Slot> slots_;
+};
+
+/// Reads an image file through a read-only mapping of the whole file, so a read is a copy without a system call.
+/// The copy is done in begin_read(), the slots only hold the result until finish_read().
+class MappedImageReader : public VolumeReader {
+public:
+    explicit MappedImageReader(size_t slots);
+
+    ~MappedImageReader() override;
+
+    MappedImageReader(const MappedImageReader &) = delete;
+
+    MappedImageReader &operator=(const MappedImageReader &) = delete;
+
+    bool open(const wchar_t *path);
+
+    [[nodiscard]] size_t slot_count() const override { return slots_.size(); }
+
+    bool begin_read(size_t slot, uint64_t offset, BYTE *buffer, size_t length) override;
+
+    bool finish_read(size_t slot) override;
+
+private:
+    struct Slot {
+        DWORD error_;
+        size_t length_;
+    };
+
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+    const BYTE *view_ = nullptr;
+    uint64_t size_ = 0;
+    std::vector<Slot> slots_;
+};
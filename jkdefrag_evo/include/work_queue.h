@@ -0,0 +1,69 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+/// A bounded queue to hand work from one thread to another. push() waits while the queue is full, pop() waits
+/// while it is empty. After close() nothing more can be pushed, and pop() returns std::nullopt as soon as the
+/// queue is empty.
+template<typename T>
+class WorkQueue {
+public:
+    explicit WorkQueue(size_t capacity) : capacity_(capacity) {}
+
+    /// Add an item at the end, wait for room if the queue is full. Return false if the queue was closed.
+    bool push(T &&item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+
+        if (closed_) return false;
+
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /// Take the first item, wait for one if the queue is empty. Return std::nullopt if the queue was closed and
+    /// there is nothing left.
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+
+        if (items_.empty()) return std::nullopt;
+
+        T item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return item;
+    }
+
+    /// Take the first item if there is one, without waiting
+    std::optional<T> try_pop() {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (items_.empty()) return std::nullopt;
+
+        T item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return item;
+    }
+
+    /// Signal that no more items will be pushed, and wake up all the waiting threads.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<T> items_;
+    size_t capacity_;
+    bool closed_ = false;
+};
@@ -143,6 +143,8 @@ void DefragApp::defrag_thread() {
     double free_space = 1;
     Wstrings excludes;
     Wstrings space_hogs;
+    std::wstring snapshot_dir;
+    std::wstring journal_file;
     bool quit_on_finish = false;
 
     // Fetch the commandline
@@ -289,6 +291,39 @@ void DefragApp::defrag_thread() {
                         Log::log_always(L"Error: you have not specified a mask after the \"-u\" "
                                         L"commandline argument.");
                     });
+            match_argument_with_space(
+                    i, argc, argv, L"-c",
+                    [&](const wchar_t *arg) {
+                        snapshot_dir = arg;
+
+                        Log::log_always(std::format(
+                                L"Commandline argument '-c' accepted, analysis snapshots are kept in '{}'",
+                                arg));
+                    },
+                    [&]() {
+                        Log::log_always(L"Error: you have not specified a directory after the \"-c\" "
+                                        L"commandline argument.");
+                    });
+            match_argument_with_space(
+                    i, argc, argv, L"-j",
+                    [&](const wchar_t *arg) {
+                        journal_file = arg;
+
+                        Log::log_always(std::format(
+                                L"Commandline argument '-j' accepted, the snapshots are updated from the "
+                                L"recorded change journal '{}'", arg));
+                    },
+                    [&]() {
+                        Log::log_always(L"Error: you have not specified a filename after the \"-j\" "
+                                        L"commandline argument.");
+                    });
+            // "-v" only checks the analysis snapshots of "-c" against the volumes
+            if (wcscmp(argv[i], L"-v") == 0) {
+                optimize_mode = OptimizeMode::ValidateSnapshot;
+
+                Log::log_always(L"Commandline argument '-v' accepted, only the snapshots are checked");
+            }
+
             match_argument_with_space(
                     i, argc, argv, L"-q",
                     [&](const wchar_t *arg) {
@@ -310,10 +345,43 @@ void DefragApp::defrag_thread() {
         for (i = 1; i < argc; i++) {
             if (instance_->i_am_running_ != RunningState::RUNNING) break;
 
+            // "-i imagefile" only analyzes an image file of a volume
+            if (wcscmp(argv[i], L"-i") == 0) {
+                i++;
+
+                if (i >= argc) {
+                    Log::log_always(L"Error: you have not specified a filename after the \"-i\" "
+                                    L"commandline argument.");
+                    break;
+                }
+
+                defrag_lib->analyze_image_sync(argv[i], &instance_->running_state_);
+
+                do_all_volumes = false;
+                continue;
+            }
+
+            // "-m imagefile" runs the optimize mode on an image file of a volume, the moves are only simulated
+            if (wcscmp(argv[i], L"-m") == 0) {
+                i++;
+
+                if (i >= argc) {
+                    Log::log_always(L"Error: you have not specified a filename after the \"-m\" "
+                                    L"commandline argument.");
+                    break;
+                }
+
+                defrag_lib->simulate_image_sync(argv[i], optimize_mode, &instance_->running_state_);
+
+                do_all_volumes = false;
+                continue;
+            }
+
             if (wcscmp(argv[i], L"-a") == 0 || wcscmp(argv[i], L"-e") == 0 ||
                 wcscmp(argv[i], L"-u") == 0 || wcscmp(argv[i], L"-s") == 0 ||
                 wcscmp(argv[i], L"-f") == 0 || wcscmp(argv[i], L"-d") == 0 ||
-                wcscmp(argv[i], L"-l") == 0) {
+                wcscmp(argv[i], L"-l") == 0 || wcscmp(argv[i], L"-c") == 0 ||
+                wcscmp(argv[i], L"-j") == 0) {
                 i++;
                 continue;
             }
@@ -322,7 +390,7 @@ void DefragApp::defrag_thread() {
             if (*argv[i] == '\0') continue;
 
             defrag_lib->start_defrag_sync(argv[i], optimize_mode, speed, free_space, excludes,
-                                          space_hogs, &instance_->running_state_);
+                                          space_hogs, snapshot_dir, journal_file, &instance_->running_state_);
 
             do_all_volumes = false;
         }
@@ -331,7 +399,7 @@ void DefragApp::defrag_thread() {
     // If no paths are specified on the commandline then defrag all fixed harddisks
     if (do_all_volumes && instance_->i_am_running_ == RunningState::RUNNING) {
         defrag_lib->start_defrag_sync(nullptr, optimize_mode, speed, free_space, excludes,
-                                      space_hogs, &instance_->running_state_);
+                                      space_hogs, snapshot_dir, journal_file, &instance_->running_state_);
     }
 
     // If the "-q" command line argument was specified then exit the program
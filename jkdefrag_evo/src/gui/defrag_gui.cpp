@@ -251,6 +251,9 @@ void DefragGui::show_analyze(const DefragState &data, const FileNode *item) {
 
 // Callback: show filename in the slot 4, show the message in the debug slot 5 + log the message
 void DefragGui::show_debug(const DebugLevel level, const FileNode *item, std::wstring &&text) {
+    // The MFT and the items are analyzed on several threads, all of which can log
+    std::lock_guard<std::mutex> debug_lock(debug_mutex_);
+
     // Avoid extra data motions below log level
     if (level <= DefragLog::debug_level_) {
         // Save the name of the file in messages[4]
@@ -0,0 +1,168 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+// Size of the buffer for FSCTL_READ_USN_JOURNAL
+constexpr size_t JOURNAL_BUFFER_SIZE = 64 * 1024;
+
+// Inode numbers are the low 48 bits of a file reference, the high 16 bits are the sequence number
+constexpr uint64_t FILE_REFERENCE_INODE_MASK = 0x0000FFFFFFFFFFFF;
+
+// Collect the changes from the records in the buffer, up to (not including) end_usn. Records of another version
+// than 2 and damaged records are skipped.
+static void parse_usn_records(const BYTE *buffer, const size_t length, const int64_t start_usn,
+                              const int64_t end_usn, PARAM_OUT std::vector<JournalChange> &changes) {
+    size_t offset = 0;
+
+    while (offset + sizeof(USN_RECORD_V2) <= length) {
+        const auto record = (const USN_RECORD_V2 *) &buffer[offset];
+
+        if (record->RecordLength < sizeof(USN_RECORD_V2) || record->RecordLength > length - offset) break;
+
+        if (record->MajorVersion == 2 && record->Usn >= start_usn && record->Usn < end_usn) {
+            changes.push_back({
+                    .inode_ = record->FileReferenceNumber & FILE_REFERENCE_INODE_MASK,
+                    .parent_inode_ = record->ParentFileReferenceNumber & FILE_REFERENCE_INODE_MASK,
+                    .reason_ = record->Reason,
+            });
+        }
+
+        offset += record->RecordLength;
+    }
+}
+
+std::unique_ptr<ChangeJournalReader> ChangeJournalReader::create(HANDLE volume_handle,
+                                                                 const std::wstring &journal_file) {
+    if (!journal_file.empty()) {
+        auto reader = std::make_unique<RecordedJournalReader>();
+
+        if (!reader->open(journal_file.c_str())) return nullptr;
+
+        return reader;
+    }
+
+    if (volume_handle == nullptr || volume_handle == INVALID_HANDLE_VALUE) return nullptr;
+
+    return std::make_unique<VolumeJournalReader>(volume_handle);
+}
+
+bool VolumeJournalReader::query(PARAM_OUT uint64_t &journal_id, PARAM_OUT int64_t &first_usn,
+                                PARAM_OUT int64_t &next_usn) {
+    USN_JOURNAL_DATA_V0 journal{};
+    DWORD bytes_returned = 0;
+
+    if (DeviceIoControl(volume_handle_, FSCTL_QUERY_USN_JOURNAL, nullptr, 0, &journal, sizeof(journal),
+                        &bytes_returned, nullptr) == FALSE) {
+        return false;
+    }
+
+    journal_id = journal.UsnJournalID;
+    first_usn = journal.FirstUsn;
+    next_usn = journal.NextUsn;
+
+    return true;
+}
+
+bool VolumeJournalReader::read_changes(const int64_t start_usn, PARAM_OUT std::vector<JournalChange> &changes) {
+    uint64_t journal_id;
+    int64_t first_usn;
+    int64_t end_usn;
+
+    if (!query(journal_id, first_usn, end_usn) || start_usn < first_usn) return false;
+
+    // Only read up to the end of the journal as it is now, the records that are written while reading (for
+    // example by the log file) are for the next run.
+    auto buffer = std::make_unique<BYTE[]>(JOURNAL_BUFFER_SIZE);
+
+    READ_USN_JOURNAL_DATA_V0 read_data{
+            .StartUsn = start_usn,
+            .ReasonMask = 0xFFFFFFFF,
+            .ReturnOnlyOnClose = FALSE,
+            .Timeout = 0,
+            .BytesToWaitFor = 0,
+            .UsnJournalID = journal_id,
+    };
+
+    while (read_data.StartUsn < end_usn) {
+        DWORD bytes_returned = 0;
+
+        if (DeviceIoControl(volume_handle_, FSCTL_READ_USN_JOURNAL, &read_data, sizeof(read_data), buffer.get(),
+                            JOURNAL_BUFFER_SIZE, &bytes_returned, nullptr) == FALSE) {
+            // ERROR_JOURNAL_ENTRY_DELETED if the journal wrapped since the query
+            return false;
+        }
+
+        // The buffer starts with the USN to continue from, followed by the records
+        if (bytes_returned < sizeof(USN)) return false;
+
+        const USN continue_usn = *(const USN *) buffer.get();
+
+        parse_usn_records(buffer.get() + sizeof(USN), bytes_returned - sizeof(USN), start_usn, end_usn,
+                          PARAM_OUT changes);
+
+        if (continue_usn <= read_data.StartUsn) break;
+
+        read_data.StartUsn = continue_usn;
+    }
+
+    return true;
+}
+
+bool RecordedJournalReader::open(const wchar_t *path) {
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER file_size{};
+    DWORD bytes_read = 0;
+    bool result = GetFileSizeEx(file, &file_size) != FALSE &&
+                  (uint64_t) file_size.QuadPart >= sizeof(journal_) &&
+                  (uint64_t) file_size.QuadPart - sizeof(journal_) < 0x80000000 &&
+                  ReadFile(file, &journal_, sizeof(journal_), &bytes_read, nullptr) != FALSE &&
+                  bytes_read == sizeof(journal_);
+
+    if (result) {
+        records_.resize((size_t) file_size.QuadPart - sizeof(journal_));
+
+        result = records_.empty() ||
+                 (ReadFile(file, records_.data(), (DWORD) records_.size(), &bytes_read, nullptr) != FALSE &&
+                  bytes_read == records_.size());
+    }
+
+    CloseHandle(file);
+
+    return result;
+}
+
+bool RecordedJournalReader::query(PARAM_OUT uint64_t &journal_id, PARAM_OUT int64_t &first_usn,
+                                  PARAM_OUT int64_t &next_usn) {
+    journal_id = journal_.UsnJournalID;
+    first_usn = journal_.FirstUsn;
+    next_usn = journal_.NextUsn;
+
+    return true;
+}
+
+bool RecordedJournalReader::read_changes(const int64_t start_usn, PARAM_OUT std::vector<JournalChange> &changes) {
+    if (start_usn < journal_.FirstUsn) return false;
+
+    parse_usn_records(records_.data(), records_.size(), start_usn, journal_.NextUsn, PARAM_OUT changes);
+
+    return true;
+}
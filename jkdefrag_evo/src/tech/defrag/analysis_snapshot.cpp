@@ -0,0 +1,683 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+#include <unordered_map>
+
+// First bytes of a snapshot file, and the version of the layout below. Change the version when the layout changes,
+// older files are then ignored.
+constexpr char SNAPSHOT_MAGIC[8] = "JKDSNAP";
+constexpr uint32_t SNAPSHOT_VERSION = 3;
+
+// The volume is cut into this many equal regions, the header has the number of free clusters of every region
+constexpr size_t SNAPSHOT_BITMAP_REGIONS = 64;
+
+// Value of SnapshotItem::parent_index_ for items without a parent directory
+constexpr uint64_t SNAPSHOT_NO_PARENT = UINT64_MAX;
+
+// A snapshot is only brought up to date if at most 1 in this many of its items changed, otherwise reading the
+// whole MFT in big blocks is faster than reading the changed records one by one
+constexpr uint64_t SNAPSHOT_MAX_CHANGED_PART = 4;
+
+// The header of a snapshot file. The arrays follow directly: item_count_ items, fragment_count_ fragments and
+// name_chars_ characters of names.
+struct SnapshotHeader {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t disk_type_;
+    SnapshotKey key_;
+    uint64_t count_free_clusters_;
+    uint64_t total_clusters_;
+    uint64_t bytes_per_cluster_;
+    uint64_t mft_locked_clusters_;
+    uint64_t item_count_;
+    uint64_t fragment_count_;
+    uint64_t name_chars_;
+    // The zones of the run that saved the snapshot, they depend on the options of the run and are calculated again
+    lcn64_t zones_[4];
+    // Free clusters in every region of the volume. Moves do not show in the change journal, this tells if another
+    // program moved items since the snapshot.
+    uint64_t region_free_clusters_[SNAPSHOT_BITMAP_REGIONS];
+};
+
+// How the header of a snapshot file compares to the volume
+enum class SnapshotMatch {
+    Matches,
+    // Another volume, or the change journal was created again
+    OtherVolume,
+    // Files were written since the snapshot, the change journal tells which
+    Changed,
+    // Nothing was written, but the clusters in use are not where they were
+    ClustersMoved,
+};
+
+// One item of the tree. The fragments and the names are ranges in the arrays after the items.
+struct SnapshotItem {
+    uint64_t bytes_;
+    uint64_t clusters_count_;
+    uint64_t creation_time_;
+    uint64_t mft_change_time_;
+    uint64_t last_access_time_;
+    uint64_t inode_;
+    uint64_t parent_inode_;
+    uint64_t parent_index_;
+    uint64_t first_fragment_;
+    uint64_t first_name_char_;
+    uint32_t fragment_count_;
+    // The short name follows the long name, its length is 0 if the item has no separate short name
+    uint32_t long_name_length_;
+    uint32_t short_name_length_;
+    uint32_t is_dir_;
+};
+
+static_assert(sizeof(SnapshotHeader) % 8 == 0 && sizeof(SnapshotItem) % 8 == 0);
+static_assert(std::is_trivially_copyable_v<FileFragment> && sizeof(FileFragment) % 8 == 0);
+
+// Expected size of a snapshot file with the counts in the header
+static uint64_t snapshot_file_size(const SnapshotHeader &header) {
+    return sizeof(SnapshotHeader) + header.item_count_ * sizeof(SnapshotItem) +
+           header.fragment_count_ * sizeof(FileFragment) + header.name_chars_ * sizeof(wchar_t);
+}
+
+// Count the free clusters in every region of the volume
+static void summarize_bitmap(DefragState &data, PARAM_OUT uint64_t (&region_free_clusters)[SNAPSHOT_BITMAP_REGIONS]) {
+    const auto total_clusters = (lcn64_t) data.total_clusters();
+    const lcn64_t region_size = (total_clusters + (lcn64_t) SNAPSHOT_BITMAP_REGIONS - 1) /
+                                (lcn64_t) SNAPSHOT_BITMAP_REGIONS;
+
+    for (size_t region = 0; region < SNAPSHOT_BITMAP_REGIONS; region++) {
+        const lcn64_t begin = std::min(total_clusters, (lcn64_t) region * region_size);
+        const lcn64_t count = std::min(total_clusters - begin, region_size);
+
+        region_free_clusters[region] = 0;
+
+        if (count == 0) continue;
+
+        if (data.bitmap_.ensure_extent_loaded(data.disk_.volume_handle_, begin, count) == NO_ERROR) {
+            region_free_clusters[region] = data.bitmap_.count_free(begin, count);
+        } else {
+            // The bitmap of the region cannot be read, no real count is this high
+            region_free_clusters[region] = UINT64_MAX;
+        }
+    }
+}
+
+// Compare the header of a snapshot with the key and the cluster bitmap of the volume
+static SnapshotMatch compare_header(DefragState &data, const SnapshotHeader &header) {
+    const SnapshotKey &key = data.snapshot_key_.value();
+
+    if (header.key_.volume_serial_ != key.volume_serial_ || header.key_.journal_id_ != key.journal_id_) {
+        return SnapshotMatch::OtherVolume;
+    }
+
+    // Anything written to the volume after the snapshot moves the journal on, and the free space has to be the
+    // same as well, so the items of the snapshot are exactly the items on the volume
+    if (header.key_.next_usn_ != key.next_usn_ || header.count_free_clusters_ != data.count_free_clusters_) {
+        return SnapshotMatch::Changed;
+    }
+
+    uint64_t region_free_clusters[SNAPSHOT_BITMAP_REGIONS];
+
+    summarize_bitmap(data, PARAM_OUT region_free_clusters);
+
+    if (memcmp(region_free_clusters, header.region_free_clusters_, sizeof(region_free_clusters)) != 0) {
+        return SnapshotMatch::ClustersMoved;
+    }
+
+    return SnapshotMatch::Matches;
+}
+
+// Clear the counters that the items of a snapshot were added to
+static void reset_counters(DefragState &data) {
+    data.count_directories_ = 0;
+    data.count_all_files_ = 0;
+    data.count_fragmented_items_ = 0;
+    data.count_all_bytes_ = 0;
+    data.count_fragmented_bytes_ = 0;
+    data.count_all_clusters_ = 0;
+    data.count_fragmented_clusters_ = 0;
+}
+
+// WriteFile() takes a 32-bit length, write big arrays in pieces
+static bool write_all(HANDLE file, const void *buffer, const uint64_t length) {
+    auto bytes = (const BYTE *) buffer;
+    uint64_t done = 0;
+
+    while (done < length) {
+        const DWORD todo = (DWORD) std::min<uint64_t>(length - done, 0x40000000);
+        DWORD written = 0;
+
+        if (WriteFile(file, bytes + done, todo, &written, nullptr) == FALSE || written != todo) return false;
+
+        done += written;
+    }
+
+    return true;
+}
+
+// Read the header of a snapshot file, and check that it is a snapshot of this version with the size it claims
+static bool read_header(const std::wstring &path, PARAM_OUT SnapshotHeader &header) {
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    DWORD bytes_read = 0;
+    LARGE_INTEGER file_size{};
+
+    bool result = ReadFile(file, &header, sizeof(header), &bytes_read, nullptr) != FALSE &&
+                  bytes_read == sizeof(header) &&
+                  GetFileSizeEx(file, &file_size) != FALSE;
+
+    CloseHandle(file);
+
+    return result &&
+           memcmp(header.magic_, SNAPSHOT_MAGIC, sizeof(header.magic_)) == 0 &&
+           header.version_ == SNAPSHOT_VERSION &&
+           header.item_count_ < UINT32_MAX && header.fragment_count_ < UINT32_MAX &&
+           header.name_chars_ < UINT32_MAX &&
+           snapshot_file_size(header) == (uint64_t) file_size.QuadPart;
+}
+
+// Delete the snapshot file of the volume, and the journal of the moves since it was saved
+static void delete_snapshot(DefragState &data) {
+    DeleteFileW(data.snapshot_path_.c_str());
+    data.move_journal_.remove(data);
+}
+
+// Check that every cluster of the items belongs to one item, and is in use on the volume. Every move is in the journal
+// before it is done, this catches a snapshot that does not match the volume anyway, for example after a torn write of
+// the journal: an item that still has its old clusters, which are free on the volume since the move, or belong to
+// another item that moved there. The extents are checked whole, against the bitmap of the volume.
+static bool check_clusters(DefragState &data) {
+    std::vector<lcn_extent_t> extents;
+
+    for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
+        vcn64_t vcn = 0;
+
+        for (auto &fragment: item->fragments_) {
+            if (!fragment.is_virtual()) {
+                extents.push_back(lcn_extent_t::with_length(fragment.lcn_, fragment.next_vcn_ - vcn));
+            }
+
+            vcn = fragment.next_vcn_;
+        }
+    }
+
+    std::sort(extents.begin(), extents.end(), [](const lcn_extent_t &a, const lcn_extent_t &b) {
+        return a.begin() < b.begin();
+    });
+
+    lcn64_t previous_end = 0;
+
+    for (auto &extent: extents) {
+        if (extent.begin() < previous_end || extent.end() > (lcn64_t) data.total_clusters()) return false;
+
+        if (data.bitmap_.ensure_extent_loaded(data.disk_.volume_handle_, extent.begin(), extent.length()) != NO_ERROR ||
+            !data.bitmap_.all_in_use(extent.begin(), extent.length())) {
+            return false;
+        }
+
+        previous_end = extent.end();
+    }
+
+    return true;
+}
+
+// Collect the Inodes that changed since start_usn, plus their parent directories and the $MFT itself. Return
+// false if the journal does not go back that far any more.
+static bool read_changed_inodes(const DefragState &data, const int64_t start_usn,
+                                PARAM_OUT std::vector<uint64_t> &inodes) {
+    auto journal = ChangeJournalReader::create(data.disk_.volume_handle_, data.journal_file_);
+    std::vector<JournalChange> changes;
+
+    if (journal == nullptr || !journal->read_changes(start_usn, PARAM_OUT changes)) return false;
+
+    inodes.clear();
+    inodes.reserve(changes.size() * 2 + 1);
+    inodes.push_back(0);
+
+    for (auto &change: changes) {
+        inodes.push_back(change.inode_);
+        inodes.push_back(change.parent_inode_);
+    }
+
+    std::sort(inodes.begin(), inodes.end());
+    inodes.erase(std::unique(inodes.begin(), inodes.end()), inodes.end());
+
+    return true;
+}
+
+void AnalysisSnapshot::prepare(DefragState &data) {
+    DefragGui *gui = DefragGui::get_instance();
+
+    data.snapshot_key_ = std::nullopt;
+    data.snapshot_path_.clear();
+    data.snapshot_saved_ = false;
+
+    if (data.snapshot_dir_.empty() || data.disk_.is_image_) return;
+
+    // The serial number tells the volumes apart, the journal tells what changed since the snapshot
+    DWORD volume_serial = 0;
+
+    if (GetVolumeInformationByHandleW(data.disk_.volume_handle_, nullptr, 0, &volume_serial, nullptr, nullptr,
+                                      nullptr, 0) == FALSE) {
+        return;
+    }
+
+    auto journal = ChangeJournalReader::create(data.disk_.volume_handle_, data.journal_file_);
+    uint64_t journal_id;
+    int64_t first_usn;
+    int64_t next_usn;
+
+    if (journal == nullptr || !journal->query(PARAM_OUT journal_id, PARAM_OUT first_usn, PARAM_OUT next_usn)) {
+        gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                        L"Snapshot: the volume has no change journal, the snapshot is not used");
+        return;
+    }
+
+    data.snapshot_key_ = SnapshotKey{
+            .volume_serial_ = volume_serial,
+            .journal_id_ = journal_id,
+            .next_usn_ = next_usn,
+    };
+
+    data.snapshot_path_ = data.snapshot_dir_;
+
+    if (!data.snapshot_path_.ends_with(L'\\')) data.snapshot_path_ += L'\\';
+
+    data.snapshot_path_ += std::format(L"jkdefrag-{:08X}.snapshot", volume_serial);
+}
+
+void AnalysisSnapshot::check(DefragState &data) {
+    DefragGui *gui = DefragGui::get_instance();
+    SnapshotHeader header{};
+
+    if (!data.snapshot_key_.has_value()) {
+        gui->show_always(L"Snapshot: no snapshot directory was given, or the volume has no change journal");
+        return;
+    }
+
+    if (!read_header(data.snapshot_path_, PARAM_OUT header)) {
+        gui->show_always(std::format(L"Snapshot: {} does not exist, or is of another version", data.snapshot_path_));
+        return;
+    }
+
+    std::vector<inode_t> moved_inodes;
+    std::optional<MoveCursor> cursor;
+    const bool resumed = MoveJournal::recover(data, PARAM_OUT moved_inodes, PARAM_OUT cursor);
+
+    const wchar_t *result = L"matches the volume";
+
+    switch (compare_header(data, header)) {
+        case SnapshotMatch::Matches:
+            break;
+        case SnapshotMatch::OtherVolume:
+            result = L"is of another volume or change journal";
+            break;
+        case SnapshotMatch::Changed:
+            result = L"is older than the volume, the changed items are read again";
+            break;
+        case SnapshotMatch::ClustersMoved:
+            result = resumed ? L"is older than the volume, the moved items are read again"
+                             : L"does not match the clusters of the volume, items were moved by another program";
+            break;
+    }
+
+    gui->show_always(std::format(L"Snapshot: {} {}. " NUM_FMT " items, " NUM_FMT " moved by a stopped run, zones at "
+                                 NUM_FMT ", " NUM_FMT ", " NUM_FMT, data.snapshot_path_, result, header.item_count_,
+                                 moved_inodes.size(), header.zones_[1], header.zones_[2], header.zones_[3]));
+}
+
+bool AnalysisSnapshot::load(DefragState &data) {
+    DefragGui *gui = DefragGui::get_instance();
+    DefragRunner *defrag_lib = DefragRunner::get_instance();
+
+    if (!data.snapshot_key_.has_value()) return false;
+
+    SnapshotHeader check{};
+
+    // A snapshot of another volume or journal is of no use anymore
+    if (!read_header(data.snapshot_path_, PARAM_OUT check)) {
+        delete_snapshot(data);
+        return false;
+    }
+
+    const SnapshotMatch match = compare_header(data, check);
+
+    if (match == SnapshotMatch::OtherVolume) {
+        delete_snapshot(data);
+        return false;
+    }
+
+    // The items that a run moved after it saved the snapshot are in the journal of the moves, if the run was stopped
+    // before it could save the snapshot again. They are read again like the changed Inodes.
+    std::vector<inode_t> moved_inodes;
+    std::optional<MoveCursor> cursor;
+    const bool resumed = MoveJournal::recover(data, PARAM_OUT moved_inodes, PARAM_OUT cursor);
+
+    // Without a journal of the moves there is no telling which items another program moved
+    if (match == SnapshotMatch::ClustersMoved && !resumed) {
+        gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                        L"Snapshot: the clusters in use moved since the snapshot, analyzing the volume");
+        delete_snapshot(data);
+        return false;
+    }
+
+    // If the volume changed since the snapshot then only the Inodes that changed are read again. When the
+    // journal has wrapped, or too much changed, the volume is analyzed completely.
+    const bool is_unchanged = match == SnapshotMatch::Matches;
+    const bool is_current = is_unchanged && moved_inodes.empty();
+    std::vector<uint64_t> changed_inodes;
+
+    if (!is_current) {
+        if ((!is_unchanged && !read_changed_inodes(data, check.key_.next_usn_, PARAM_OUT changed_inodes)) ||
+            changed_inodes.size() + moved_inodes.size() > check.item_count_ / SNAPSHOT_MAX_CHANGED_PART) {
+            gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                            L"Snapshot: the change journal does not go back far enough, or too much changed, "
+                            L"analyzing the volume");
+            delete_snapshot(data);
+            return false;
+        }
+
+        // update_ntfs_inodes() always reads the $MFT again and adds its items, so the items of the $MFT in the
+        // snapshot are skipped, also when only the moves of a stopped run are read again
+        changed_inodes.insert(changed_inodes.end(), moved_inodes.begin(), moved_inodes.end());
+        changed_inodes.push_back(0);
+        std::sort(changed_inodes.begin(), changed_inodes.end());
+        changed_inodes.erase(std::unique(changed_inodes.begin(), changed_inodes.end()), changed_inodes.end());
+    }
+
+    HANDLE file = CreateFileW(data.snapshot_path_.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    auto view = mapping != nullptr ? (const BYTE *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+
+    if (view == nullptr) {
+        if (mapping != nullptr) CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    const auto header = (const SnapshotHeader *) view;
+    const auto records = (const SnapshotItem *) (view + sizeof(SnapshotHeader));
+    const auto fragments = (const FileFragment *) (records + header->item_count_);
+    const auto names = (const wchar_t *) (fragments + header->fragment_count_);
+
+    // Build all the items before anything is added to the tree, so a damaged file leaves the state untouched.
+    // The items of the changed Inodes are skipped, they are read from the MFT again.
+    std::vector<FileNode *> items(header->item_count_, nullptr);
+
+    bool valid = true;
+
+    for (uint64_t i = 0; i < header->item_count_; i++) {
+        const SnapshotItem &record = records[i];
+
+        if (record.first_fragment_ > header->fragment_count_ ||
+            record.fragment_count_ > header->fragment_count_ - record.first_fragment_ ||
+            record.first_name_char_ > header->name_chars_ ||
+            (uint64_t) record.long_name_length_ + record.short_name_length_ >
+            header->name_chars_ - record.first_name_char_ ||
+            (record.parent_index_ != SNAPSHOT_NO_PARENT && record.parent_index_ >= header->item_count_)) {
+            valid = false;
+            break;
+        }
+
+        if (std::binary_search(changed_inodes.begin(), changed_inodes.end(), record.inode_)) continue;
+
+        auto item = new FileNode();
+
+        item->bytes_ = record.bytes_;
+        item->clusters_count_ = record.clusters_count_;
+        item->creation_time_ = filetime64_t(record.creation_time_);
+        item->mft_change_time_ = filetime64_t(record.mft_change_time_);
+        item->last_access_time_ = filetime64_t(record.last_access_time_);
+        item->inode_ = record.inode_;
+        item->parent_inode_ = record.parent_inode_;
+        item->parent_directory_ = nullptr;
+        item->is_dir_ = record.is_dir_ != 0;
+        item->is_unmovable_ = false;
+        item->is_excluded_ = false;
+        item->is_hog_ = false;
+
+        item->fragments_.assign(fragments + record.first_fragment_,
+                                fragments + record.first_fragment_ + record.fragment_count_);
+
+        const wchar_t *long_name = names + record.first_name_char_;
+        std::wstring long_filename(long_name, record.long_name_length_);
+        std::wstring short_filename = record.short_name_length_ == 0
+                                      ? long_filename
+                                      : std::wstring(long_name + record.long_name_length_,
+                                                     record.short_name_length_);
+
+        item->set_filenames(std::move(long_filename), std::move(short_filename));
+
+        items[i] = item;
+    }
+
+    uint64_t loaded = 0;
+
+    if (valid) {
+        data.disk_.type_ = (DiskType) header->disk_type_;
+        data.disk_.mft_locked_clusters_ = header->mft_locked_clusters_;
+        data.bytes_per_cluster_ = header->bytes_per_cluster_;
+
+        if (data.total_clusters() != header->total_clusters_) data.set_total_clusters(header->total_clusters_);
+
+        for (uint64_t i = 0; i < header->item_count_; i++) {
+            FileNode *item = items[i];
+
+            if (item == nullptr) continue;
+
+            const uint64_t parent_index = records[i].parent_index_;
+
+            if (parent_index != SNAPSHOT_NO_PARENT) item->parent_directory_ = items[parent_index];
+
+            // Add the item to the tree and count it, the same as the scanners do
+            Tree::insert(data.item_tree_, data.tree_statistics_, item);
+
+            gui->show_analyze(data, item);
+            defrag_lib->colorize_disk_item(data, item, 0, 0, false);
+
+            if (item->is_dir_) data.count_directories_ += 1;
+
+            data.count_all_files_ += 1;
+            data.count_all_bytes_ += item->bytes_;
+            data.count_all_clusters_ += item->clusters_count_;
+
+            if (DefragRunner::get_fragment_count(item) > 1) {
+                data.count_fragmented_items_ += 1;
+                data.count_fragmented_bytes_ += item->bytes_;
+                data.count_fragmented_clusters_ += item->clusters_count_;
+            }
+
+            loaded++;
+        }
+    } else {
+        for (auto item: items) delete item;
+
+        gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                        std::format(L"Snapshot: {} is damaged, analyzing the volume", data.snapshot_path_));
+    }
+
+    UnmapViewOfFile(view);
+    CloseHandle(mapping);
+    CloseHandle(file);
+
+    // Read the changed Inodes from the MFT and add their items to the tree
+    if (valid && !is_current && !ScanNTFS::get_instance()->update_ntfs_inodes(data, changed_inodes)) {
+        gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                        L"Snapshot: cannot read the changed Inodes, analyzing the volume");
+
+        Tree::delete_tree(data.item_tree_);
+        data.item_tree_ = nullptr;
+        reset_counters(data);
+        valid = false;
+    }
+
+    if (valid && resumed && !check_clusters(data)) {
+        gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                        L"Snapshot: moves of the stopped run are missing from the journal, analyzing the volume");
+
+        Tree::delete_tree(data.item_tree_);
+        data.item_tree_ = nullptr;
+        reset_counters(data);
+        valid = false;
+    }
+
+    if (!valid) {
+        delete_snapshot(data);
+        return false;
+    }
+
+    // An updated tree no longer matches the file, it is saved again after the analysis
+    data.snapshot_saved_ = is_current;
+    data.resume_cursor_ = cursor;
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"Snapshot: loaded " NUM_FMT " items from {}, read " NUM_FMT " changed Inodes again",
+                                loaded, data.snapshot_path_, changed_inodes.size()));
+
+    return true;
+}
+
+bool AnalysisSnapshot::save(DefragState &data) {
+    DefragGui *gui = DefragGui::get_instance();
+
+    if (!data.snapshot_key_.has_value() || data.snapshot_saved_ || !data.is_still_running()) return false;
+
+    // Number the items in tree order, the parent directories are stored as such a number
+    std::unordered_map<const FileNode *, uint64_t> index_of;
+
+    for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
+        index_of.emplace(item, index_of.size());
+    }
+
+    std::vector<SnapshotItem> records;
+    std::vector<FileFragment> fragments;
+    std::wstring names;
+
+    records.reserve(index_of.size());
+
+    for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
+        SnapshotItem record{};
+
+        record.bytes_ = item->bytes_;
+        record.clusters_count_ = item->clusters_count_;
+        record.creation_time_ = item->creation_time_.count();
+        record.mft_change_time_ = item->mft_change_time_.count();
+        record.last_access_time_ = item->last_access_time_.count();
+        record.inode_ = item->inode_;
+        record.parent_inode_ = item->parent_inode_;
+        record.parent_index_ = SNAPSHOT_NO_PARENT;
+        record.is_dir_ = item->is_dir_ ? 1 : 0;
+
+        if (item->parent_directory_ != nullptr) {
+            if (auto found = index_of.find(item->parent_directory_); found != index_of.end()) {
+                record.parent_index_ = found->second;
+            }
+        }
+
+        record.first_fragment_ = fragments.size();
+        record.fragment_count_ = (uint32_t) item->fragments_.size();
+        fragments.insert(fragments.end(), item->fragments_.begin(), item->fragments_.end());
+
+        const size_t long_name_length = wcslen(item->get_long_fn());
+
+        record.first_name_char_ = names.size();
+        record.long_name_length_ = (uint32_t) long_name_length;
+        names.append(item->get_long_fn(), long_name_length);
+
+        if (wcscmp(item->get_short_fn(), item->get_long_fn()) != 0) {
+            const size_t short_name_length = wcslen(item->get_short_fn());
+
+            record.short_name_length_ = (uint32_t) short_name_length;
+            names.append(item->get_short_fn(), short_name_length);
+        }
+
+        records.push_back(record);
+    }
+
+    SnapshotHeader header{};
+
+    memcpy(header.magic_, SNAPSHOT_MAGIC, sizeof(header.magic_));
+    header.version_ = SNAPSHOT_VERSION;
+    header.disk_type_ = (uint32_t) data.disk_.type_;
+    header.key_ = data.snapshot_key_.value();
+    header.count_free_clusters_ = data.count_free_clusters_;
+    header.total_clusters_ = data.total_clusters();
+    header.bytes_per_cluster_ = data.bytes_per_cluster_;
+    header.mft_locked_clusters_ = data.disk_.mft_locked_clusters_;
+    header.item_count_ = records.size();
+    header.fragment_count_ = fragments.size();
+    header.name_chars_ = names.size();
+    std::copy(std::begin(data.zones_), std::end(data.zones_), std::begin(header.zones_));
+
+    // The bitmap in memory follows the moves of this run, the next run compares against the bitmap of the volume.
+    // Drop it, so summarize_bitmap loads every extent again from the volume.
+    data.bitmap_.reset(data.total_clusters());
+    summarize_bitmap(data, PARAM_OUT header.region_free_clusters_);
+
+    // Write to a temporary file first, so a crash never leaves half a snapshot under the real name
+    const std::wstring temp_path = data.snapshot_path_ + L".tmp";
+
+    HANDLE file = CreateFileW(temp_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                              nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                        std::format(L"Snapshot: cannot create {}: {}", temp_path, Str::system_error(GetLastError())));
+        return false;
+    }
+
+    bool result = write_all(file, &header, sizeof(header)) &&
+                  write_all(file, records.data(), records.size() * sizeof(SnapshotItem)) &&
+                  write_all(file, fragments.data(), fragments.size() * sizeof(FileFragment)) &&
+                  write_all(file, names.data(), names.size() * sizeof(wchar_t));
+
+    CloseHandle(file);
+
+    if (result) {
+        result = MoveFileExW(temp_path.c_str(), data.snapshot_path_.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+    }
+
+    if (!result) {
+        DeleteFileW(temp_path.c_str());
+        return false;
+    }
+
+    data.snapshot_saved_ = true;
+
+    // The snapshot contains the moves of the journal now
+    data.move_journal_.remove(data);
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"Snapshot: saved " NUM_FMT " items to {}", records.size(), data.snapshot_path_));
+
+    return true;
+}
+
+void AnalysisSnapshot::discard(DefragState &data) {
+    if (!data.snapshot_saved_) return;
+
+    DeleteFileW(data.snapshot_path_.c_str());
+    data.snapshot_saved_ = false;
+}
@@ -17,10 +17,35 @@
 
 #include "precompiled_header.h"
 
+// Upper limit for the number of threads in the analyze_volume() loop
+constexpr size_t ANALYZE_MAX_THREADS = 16;
+// Number of items a thread takes from the list at a time
+constexpr size_t ANALYZE_BATCH_SIZE = 512;
+
+// Results of one thread of the analyze_volume() loop
+struct AnalyzeWorkerResult {
+    // Items that have to be redrawn because they were excluded or marked as spacehog
+    std::vector<const FileNode *> colorize_;
+    // Number of items excluded by the masks
+    uint64_t excluded_ = 0;
+    // Number of items marked as spacehog
+    uint64_t hogs_ = 0;
+    // Number of directories in the mask cache of the thread
+    size_t cached_directories_ = 0;
+};
+
 void DefragRunner::analyze_volume_read_fs(DefragState &data) {
     DefragGui *gui = DefragGui::get_instance();
     ScanNTFS *scan_ntfs = ScanNTFS::get_instance();
 
+    // Use the snapshot of an earlier run instead, if nothing on the volume changed since then
+    AnalysisSnapshot::prepare(data);
+
+    if (AnalysisSnapshot::load(data)) {
+        gui->log_detailed_progress(L"Analyzing volume: Loaded the snapshot of an earlier run");
+        return;
+    }
+
     // Scan NTFS disks
     // Expensive call (can reach 1 minute runtime or more)
     bool result = scan_ntfs->analyze_ntfs_volume(data);
@@ -36,8 +61,8 @@ void DefragRunner::analyze_volume_read_fs(DefragState &data) {
         gui->log_detailed_progress(L"Analyzing volume: Done analyzing FAT volume");
     }
 
-    // Scan all other filesystems
-    if (!result && data.is_still_running()) {
+    // Scan all other filesystems. An image file has no filesystem to scan.
+    if (!result && data.is_still_running() && !data.disk_.is_image_) {
         gui->log_detailed_progress(L"This is not a FAT or NTFS disk, using the slow scanner.");
 
         // Set up the width of the progress bar
@@ -83,37 +108,102 @@ void DefragRunner::analyze_volume(DefragState &data) {
     data.clusters_done_ = data.phase_todo_;
     gui->draw_cluster(data, 0, 0, DrawColor::Empty);
 
-    // Set up the progress counter and the file/dir counters
+    // Set up the progress counter and the file/dir counters.
+    // Collect all the items in a flat list, which also gives the number of items to do.
     data.clusters_done_ = 0;
     data.phase_todo_ = 0;
 
+    std::vector<FileNode *> items;
+
     {
-        StopWatch watch_cf(L"analyze_volume: count files");
+        StopWatch watch_cf(L"analyze_volume: collect files");
         for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
-            data.phase_todo_ += 1;
+            items.push_back(item);
         }
+        data.phase_todo_ = items.size();
     }
 
     gui->show_analyze(data, nullptr);
 
-    // Walk through all the items one by one
-    const auto update_every_n_clusters = std::max<uint64_t>(10'000UL, data.total_clusters() / 100'000UL);
+    // Walk through all the items. Every item only looks at itself and the names of its parent directories,
+    // so the list is cut into batches which are processed by a pool of threads. Each thread has its own
+    // mask cache and counters, they are merged when all threads are done.
+    const size_t thread_count =
+            std::clamp<size_t>(std::thread::hardware_concurrency(), 1, ANALYZE_MAX_THREADS);
+    std::vector<AnalyzeWorkerResult> results(thread_count);
+    std::atomic<size_t> next_batch = 0;
+    std::atomic<size_t> items_done = 0;
+
+    auto worker = [&](AnalyzeWorkerResult &result) {
+        MaskCache mask_cache(data);
+
+        while (data.is_still_running()) {
+            const size_t begin = next_batch.fetch_add(ANALYZE_BATCH_SIZE);
+            if (begin >= items.size()) break;
+
+            const size_t end = std::min<size_t>(begin + ANALYZE_BATCH_SIZE, items.size());
+
+            for (size_t i = begin; i < end; i++) {
+                FileNode *item = items[i];
+
+                if (analyze_volume_process_file(data, item, time_now, mask_cache)) {
+                    result.colorize_.push_back(item);
+                }
+
+                if (item->is_excluded_) result.excluded_++;
+                if (item->is_hog_) result.hogs_++;
+            }
+
+            items_done += end - begin;
+        }
+
+        result.cached_directories_ = mask_cache.size();
+    };
 
     {
         StopWatch watch1(L"analyze_volume: all files loop");
-        for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
-            if (*data.running_ != RunningState::RUNNING) break;
+        std::vector<std::thread> workers;
 
-            analyze_volume_process_file(data, item, time_now);
+        for (auto &result: results) {
+            workers.emplace_back(worker, std::ref(result));
+        }
 
-            // Update the progress percentage
-            data.clusters_done_ += 1;
+        // Update the progress percentage while the threads are working
+        while (items_done < items.size() && data.is_still_running()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
-            if (data.clusters_done_ % update_every_n_clusters == 0) {
-                gui->draw_cluster(data, 0, 0, DrawColor::Empty);
+            data.clusters_done_ = items_done;
+            gui->draw_cluster(data, 0, 0, DrawColor::Empty);
+        }
+
+        for (auto &each_worker: workers) {
+            each_worker.join();
+        }
+    }
+
+    // Merge the counters of the threads and draw the items that have a different color now. This is done
+    // in one pass from this thread, so the threads do not have to wait for the display.
+    {
+        StopWatch watch_draw(L"analyze_volume: colorize");
+        AnalyzeWorkerResult total;
+
+        for (auto &result: results) {
+            for (auto item: result.colorize_) {
+                colorize_disk_item(data, item, 0, 0, false);
             }
+
+            total.excluded_ += result.excluded_;
+            total.hogs_ += result.hogs_;
+            total.cached_directories_ += result.cached_directories_;
         }
+
+        gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                        std::format(L"Analyze: " NUM_FMT " items on {} threads, " NUM_FMT " excluded, "
+                                    NUM_FMT " spacehogs, mask verdicts cached for " NUM_FMT " directories",
+                                    items.size(), thread_count, total.excluded_, total.hogs_,
+                                    total.cached_directories_));
     }
+
     // Force the percentage to 100%
     data.clusters_done_ = data.phase_todo_;
     gui->draw_cluster(data, 0, 0, DrawColor::Empty);
@@ -121,31 +211,43 @@ void DefragRunner::analyze_volume(DefragState &data) {
     // Calculate the begin of the zone's
     calculate_zones(data);
 
+    // Keep the result for the next run
+    AnalysisSnapshot::save(data);
+
     // Call the ShowAnalyze() callback one last time
     gui->show_analyze(data, nullptr);
 }
 
-void DefragRunner::analyze_volume_process_file(DefragState &data, FileNode *item, filetime64_t time_now) {
+bool DefragRunner::analyze_volume_process_file(const DefragState &data, FileNode *item, filetime64_t time_now,
+                                               MaskCache &mask_cache) {
+    bool redraw = false;
+
     // Construct the full path's of the item.
     // The MFT contains only the filename, plus a pointer to the directory.
     // We have to construct the full paths by joining all the names of the directories, and the name of the file.
     if (!item->have_long_path()) item->set_long_path(get_long_path(data, item).c_str());
     if (!item->have_short_path()) item->set_short_path(get_short_path(data, item).c_str());
 
+    // The masks that were already decided for the parent directory do not have to be matched again.
+    // Items in the root have no parent directory, for them every mask depends on the name.
+    const DirectoryMaskVerdicts *verdicts = mask_cache.verdicts_for(item);
+
     // Apply the Mask and set the Exclude flag of all items that do not match
-    if (!Str::match_mask(item->get_long_path(), data.include_mask_.c_str()) &&
-        !Str::match_mask(item->get_short_path(), data.include_mask_.c_str())) {
+    auto verdict = verdicts != nullptr ? verdicts->include_ : Str::MaskVerdict::Depends;
+
+    if (!MaskCache::match(verdict, item, data.include_mask_.c_str())) {
         item->is_excluded_ = true;
-        colorize_disk_item(data, item, 0, 0, false);
+        redraw = true;
     }
 
     // Determine if the item is to be excluded by comparing its name with the Exclude masks.
     if (!item->is_excluded_) {
-        for (auto &each_exclude: data.excludes_) {
-            if (Str::match_mask(item->get_long_path(), each_exclude.c_str()) ||
-                Str::match_mask(item->get_short_path(), each_exclude.c_str())) {
+        for (size_t i = 0; i < data.excludes_.size(); i++) {
+            verdict = verdicts != nullptr ? verdicts->excludes_[i] : Str::MaskVerdict::Depends;
+
+            if (MaskCache::match(verdict, item, data.excludes_[i].c_str())) {
                 item->is_excluded_ = true;
-                colorize_disk_item(data, item, 0, 0, false);
+                redraw = true;
                 break;
             }
         }
@@ -157,7 +259,7 @@ void DefragRunner::analyze_volume_process_file(DefragState &data, FileNode *item
          _wcsicmp(item->get_long_fn(), L"jkdefragcmd.log") == 0 ||
          _wcsicmp(item->get_long_fn(), L"jkdefragscreensaver.log") == 0)) {
         item->is_excluded_ = true;
-        colorize_disk_item(data, item, 0, 0, false);
+        redraw = true;
     }
 
     // The item is a SpaceHog if it's larger than 50 megabytes, or last access time
@@ -170,18 +272,17 @@ void DefragRunner::analyze_volume_process_file(DefragState &data, FileNode *item
                    item->last_access_time_ + std::chrono::months(1) < time_now) {
             item->is_hog_ = true;
         } else {
-            for (const auto &each_spacehog_mask: data.space_hogs_) {
-                if (Str::match_mask(item->get_long_path(), each_spacehog_mask.c_str()) ||
-                    Str::match_mask(item->get_short_path(), each_spacehog_mask.c_str())) {
+            for (size_t i = 0; i < data.space_hogs_.size(); i++) {
+                verdict = verdicts != nullptr ? verdicts->space_hogs_[i] : Str::MaskVerdict::Depends;
+
+                if (MaskCache::match(verdict, item, data.space_hogs_[i].c_str())) {
                     item->is_hog_ = true;
                     break;
                 }
             }
         }
 
-        if (item->is_hog_) {
-            colorize_disk_item(data, item, 0, 0, false);
-        }
+        if (item->is_hog_) redraw = true;
     }
 
     // Special exception for "http://www.safeboot.com/"
@@ -203,4 +304,5 @@ void DefragRunner::analyze_volume_process_file(DefragState &data, FileNode *item
          _wcsicmp(item->get_long_fn(), L"$BadClus:$Bad:$DATA") == 0)) {
         item->is_unmovable_ = true;
     }
-}
\ No newline at end of file
+    return redraw;
+}
@@ -17,7 +17,7 @@
 
 #include "precompiled_header.h"
 
-DefragState::DefragState() {
+DefragState::DefragState() : move_executor_(std::make_unique<VolumeMoveExecutor>()) {
     last_checkpoint_ = start_time_ = Clock::now();
 }
 
@@ -174,6 +174,7 @@ FileNode *DefragRunner::find_highest_item(const DefragState &data, lcn_extent_t
 
         if (item->is_unmovable_) continue;
         if (item->is_excluded_) continue;
+        if (item->is_moving_) continue;
 
         if (zone != Zone::ZoneAll_MaxValue) {
             auto preferred_zone = item->get_preferred_zone();
@@ -265,6 +266,7 @@ FileNode *DefragRunner::find_best_item(const DefragState &data, lcn_extent_t gap
         // Ignore all unsuitable items
         if (item->is_unmovable_) continue;
         if (item->is_excluded_) continue;
+        if (item->is_moving_) continue;
 
         if (zone != Zone::ZoneAll_MaxValue) {
             auto preferred_zone = item->get_preferred_zone();
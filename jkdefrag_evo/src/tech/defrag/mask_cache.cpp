@@ -0,0 +1,85 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+// Combine the verdicts for the long and the short path. An item matches if either of its paths matches.
+static Str::MaskVerdict either_path(Str::MaskVerdict long_verdict, Str::MaskVerdict short_verdict) {
+    return long_verdict > short_verdict ? long_verdict : short_verdict;
+}
+
+// Return the path up to and including the last backslash, which is the same for all items in a directory
+static std::wstring directory_prefix(const wchar_t *path) {
+    const wchar_t *last_slash = wcsrchr(path, L'\\');
+
+    if (last_slash == nullptr) return {};
+
+    return {path, (size_t) (last_slash - path + 1)};
+}
+
+const DirectoryMaskVerdicts *MaskCache::verdicts_for(const FileNode *item) {
+    const FileNode *directory = item->parent_directory_;
+
+    if (directory == nullptr) return nullptr;
+
+    if (auto found = cache_.find(directory); found != cache_.end()) return &found->second;
+
+    // Start with the verdicts of the parent directory if it was seen before, whatever is decided there holds
+    // for us too. Otherwise everything has to be matched against our own path.
+    DirectoryMaskVerdicts verdicts;
+    auto parent = cache_.find(directory->parent_directory_);
+
+    if (directory->parent_directory_ != nullptr && parent != cache_.end()) {
+        verdicts = parent->second;
+    } else {
+        verdicts.excludes_.assign(data_.excludes_.size(), Str::MaskVerdict::Depends);
+        verdicts.space_hogs_.assign(data_.space_hogs_.size(), Str::MaskVerdict::Depends);
+    }
+
+    const std::wstring long_prefix = directory_prefix(item->get_long_path());
+    const std::wstring short_prefix = directory_prefix(item->get_short_path());
+
+    auto decide = [&](Str::MaskVerdict &verdict, const std::wstring &mask) {
+        if (verdict != Str::MaskVerdict::Depends) return;
+
+        verdict = either_path(Str::match_mask_prefix(long_prefix.c_str(), mask.c_str()),
+                              Str::match_mask_prefix(short_prefix.c_str(), mask.c_str()));
+    };
+
+    decide(verdicts.include_, data_.include_mask_);
+
+    for (size_t i = 0; i < verdicts.excludes_.size(); i++) {
+        decide(verdicts.excludes_[i], data_.excludes_[i]);
+    }
+
+    for (size_t i = 0; i < verdicts.space_hogs_.size(); i++) {
+        decide(verdicts.space_hogs_[i], data_.space_hogs_[i]);
+    }
+
+    return &cache_.emplace(directory, std::move(verdicts)).first->second;
+}
+
+bool MaskCache::match(Str::MaskVerdict verdict, const FileNode *item, const wchar_t *mask) {
+    switch (verdict) {
+        case Str::MaskVerdict::Always:
+            return true;
+        case Str::MaskVerdict::Never:
+            return false;
+        default:
+            return Str::match_mask(item->get_long_path(), mask) || Str::match_mask(item->get_short_path(), mask);
+    }
+}
@@ -0,0 +1,478 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+#include <algorithm>
+
+static uint64_t distance(const lcn64_t a, const lcn64_t b) {
+    return a < b ? b - a : a - b;
+}
+
+bool relocate_fragments(std::list<FileFragment> &fragments, const vcn64_t vcn, const lcn64_t lcn,
+                        const cluster_count64_t count, std::vector<RelocatedExtent> *relocated) {
+    // Cut the fragments at the begin and the end of the block, the parts inside the block go to lcn
+    struct Part {
+        vcn64_t vcn_;
+        vcn64_t next_vcn_;
+        lcn64_t lcn_;
+        bool is_virtual_;
+    };
+
+    std::vector<Part> parts;
+    vcn64_t fragment_vcn = 0;
+
+    for (auto &fragment: fragments) {
+        vcn64_t begin = fragment_vcn;
+
+        // Virtual fragments have no clusters, their parts keep the lcn that marks them as virtual
+        auto part_lcn = [&](const vcn64_t part_vcn) {
+            return fragment.is_virtual() ? fragment.lcn_ : fragment.lcn_ + (lcn64_t) (part_vcn - fragment_vcn);
+        };
+
+        for (const vcn64_t cut: {vcn, vcn + count}) {
+            if (cut > begin && cut < fragment.next_vcn_) {
+                parts.push_back({begin, cut, part_lcn(begin), fragment.is_virtual()});
+                begin = cut;
+            }
+        }
+
+        parts.push_back({begin, fragment.next_vcn_, part_lcn(begin), fragment.is_virtual()});
+        fragment_vcn = fragment.next_vcn_;
+    }
+
+    if (vcn + count > fragment_vcn) return false;
+
+    for (auto &part: parts) {
+        if (part.is_virtual_ || part.vcn_ < vcn || part.next_vcn_ > vcn + count) continue;
+
+        const lcn64_t to = lcn + (lcn64_t) (part.vcn_ - vcn);
+
+        if (relocated != nullptr) relocated->push_back({part.lcn_, to, part.next_vcn_ - part.vcn_});
+
+        part.lcn_ = to;
+    }
+
+    // Join the parts again where they are contiguous, like Windows reports them
+    fragments.clear();
+
+    lcn64_t next_lcn = 0;
+    bool last_virtual = false;
+
+    for (auto &part: parts) {
+        if (!fragments.empty() &&
+            (part.is_virtual_ ? last_virtual : !last_virtual && part.lcn_ == next_lcn)) {
+            fragments.back().next_vcn_ = part.next_vcn_;
+        } else {
+            fragments.push_back({.lcn_ = part.lcn_, .next_vcn_ = part.next_vcn_});
+        }
+
+        last_virtual = part.is_virtual_;
+        if (!part.is_virtual_) next_lcn = part.lcn_ + (lcn64_t) (part.next_vcn_ - part.vcn_);
+    }
+
+    return true;
+}
+
+HANDLE MoveExecutor::open(const DefragState &data, const FileNode *item) {
+    {
+        std::lock_guard<std::mutex> lock(handles_mutex_);
+
+        phase_requests_++;
+
+        const auto found = std::find_if(handles_.begin(), handles_.end(), [item](const CachedHandle &cached) {
+            return cached.item_ == item && !cached.in_use_;
+        });
+
+        if (found != handles_.end()) {
+            found->in_use_ = true;
+            handles_.splice(handles_.begin(), handles_, found);
+            return found->handle_;
+        }
+    }
+
+    HANDLE file_handle = open_item(data, item);
+
+    if (file_handle == nullptr) return nullptr;
+
+    // Make room by closing the least recently used handles that are not in use
+    std::vector<HANDLE> evicted;
+    {
+        std::lock_guard<std::mutex> lock(handles_mutex_);
+
+        phase_opens_++;
+        handles_.push_front({item, file_handle, true, false});
+
+        for (auto it = handles_.end(); handles_.size() > MOVE_HANDLE_CACHE_SIZE && it != handles_.begin();) {
+            --it;
+
+            if (it->in_use_) continue;
+
+            evicted.push_back(it->handle_);
+            it = handles_.erase(it);
+        }
+    }
+
+    for (HANDLE handle: evicted) {
+        close_item(handle);
+    }
+
+    return file_handle;
+}
+
+void MoveExecutor::close(HANDLE file_handle) {
+    {
+        std::lock_guard<std::mutex> lock(handles_mutex_);
+
+        const auto found = std::find_if(handles_.begin(), handles_.end(), [file_handle](const CachedHandle &cached) {
+            return cached.handle_ == file_handle && cached.in_use_;
+        });
+
+        if (found != handles_.end()) {
+            if (!found->stale_) {
+                found->in_use_ = false;
+                return;
+            }
+
+            handles_.erase(found);
+        }
+    }
+
+    close_item(file_handle);
+}
+
+void MoveExecutor::close_cached_handles(PARAM_OUT uint64_t &requests, PARAM_OUT uint64_t &opens) {
+    std::vector<HANDLE> released;
+    {
+        std::lock_guard<std::mutex> lock(handles_mutex_);
+
+        std::erase_if(handles_, [&released](const CachedHandle &cached) {
+            if (cached.in_use_) return false;
+
+            released.push_back(cached.handle_);
+            return true;
+        });
+
+        requests = phase_requests_;
+        opens = phase_opens_;
+        phase_requests_ = 0;
+        phase_opens_ = 0;
+    }
+
+    for (HANDLE handle: released) {
+        close_item(handle);
+    }
+
+    std::lock_guard<std::mutex> lock(statistics_mutex_);
+
+    statistics_.open_requests_ += requests;
+    statistics_.opens_ += opens;
+}
+
+void MoveExecutor::release_handles() {
+    uint64_t requests;
+    uint64_t opens;
+
+    close_cached_handles(requests, opens);
+
+    if (requests == 0) return;
+
+    DefragGui::get_instance()->show_debug(
+            DebugLevel::DetailedProgress, nullptr,
+            std::format(L"Opened " NUM_FMT " item handles for " NUM_FMT " requests", opens, requests));
+}
+
+bool MoveExecutor::verify_prediction(const bool required) {
+    std::lock_guard<std::mutex> lock(statistics_mutex_);
+
+    statistics_.predictions_++;
+
+    if (verify_countdown_ > 0) {
+        verify_countdown_--;
+        return true;
+    }
+
+    return required || statistics_.predictions_ % MOVE_VERIFY_INTERVAL == 0;
+}
+
+void MoveExecutor::observe_prediction(const bool correct) {
+    std::lock_guard<std::mutex> lock(statistics_mutex_);
+
+    statistics_.verified_predictions_++;
+
+    if (correct) return;
+
+    statistics_.mispredictions_++;
+    verify_countdown_ = MOVE_VERIFY_INTERVAL;
+}
+
+cluster_count64_t MoveExecutor::chunk_clusters(const DefragState &data) const {
+    if (data.bytes_per_cluster_ <= 0) return 262144;
+
+    std::lock_guard<std::mutex> lock(statistics_mutex_);
+
+    return std::max<cluster_count64_t>((cluster_count64_t) chunk_bytes_ / data.bytes_per_cluster_, 1);
+}
+
+void MoveExecutor::reset() {
+    std::lock_guard<std::mutex> lock(statistics_mutex_);
+
+    statistics_ = {};
+    verify_countdown_ = 0;
+    chunk_bytes_ = MOVE_CHUNK_INITIAL_BYTES;
+    chunk_throughput_ = 0;
+}
+
+void MoveExecutor::observe_chunk(const uint64_t bytes, const Clock::duration latency) {
+    // Smaller moves say nothing about the chunk size
+    if (bytes < chunk_bytes_) return;
+
+    if (latency > MOVE_CHUNK_LATENCY_TARGET) {
+        chunk_bytes_ = std::max<uint64_t>(chunk_bytes_ / 2, MOVE_CHUNK_MIN_BYTES);
+        chunk_throughput_ = 0;
+        return;
+    }
+
+    const double seconds = std::chrono::duration<double>(latency).count();
+    if (seconds <= 0) return;
+
+    const double throughput = (double) bytes / seconds;
+
+    if (throughput > chunk_throughput_) chunk_bytes_ = std::min<uint64_t>(chunk_bytes_ * 2, MOVE_CHUNK_MAX_BYTES);
+
+    chunk_throughput_ = throughput;
+}
+
+DWORD MoveExecutor::move(const DefragState &data, HANDLE file_handle, const FileNode *item, const vcn64_t vcn,
+                         const lcn64_t from_lcn, const lcn64_t lcn, const cluster_count64_t count) {
+    const auto started = Clock::now();
+    const DWORD result = move_clusters(data, file_handle, item, vcn, lcn, count);
+    const auto latency = Clock::now() - started;
+
+    // Do not use the handle again after a failure, the next attempt opens the item again
+    if (result != NO_ERROR) {
+        std::lock_guard<std::mutex> lock(handles_mutex_);
+
+        for (auto &cached: handles_) {
+            if (cached.handle_ == file_handle && cached.in_use_) cached.stale_ = true;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(statistics_mutex_);
+
+    statistics_.moves_++;
+
+    if (result != NO_ERROR) {
+        statistics_.failed_moves_++;
+        return result;
+    }
+
+    observe_chunk(count * data.bytes_per_cluster_, latency);
+
+    // The data is read at its old place and written at the new place
+    statistics_.clusters_moved_ += count;
+    statistics_.bytes_moved_ += count * data.bytes_per_cluster_;
+    statistics_.seek_distance_ += distance(statistics_.head_, from_lcn) + distance(from_lcn + count, lcn);
+    statistics_.head_ = lcn + count;
+
+    return NO_ERROR;
+}
+
+VolumeMoveExecutor::~VolumeMoveExecutor() {
+    uint64_t requests;
+    uint64_t opens;
+
+    close_cached_handles(requests, opens);
+}
+
+HANDLE VolumeMoveExecutor::open_item(const DefragState &data, const FileNode *item) {
+    return DefragRunner::open_item_handle(data, item);
+}
+
+void VolumeMoveExecutor::close_item(HANDLE file_handle) {
+    FlushFileBuffers(file_handle); // Is this useful? Can't hurt
+    CloseHandle(file_handle);
+}
+
+bool VolumeMoveExecutor::read_fragments(const DefragState &data, FileNode *item, HANDLE file_handle) {
+    return DefragRunner::get_fragments(data, item, file_handle);
+}
+
+DWORD VolumeMoveExecutor::move_clusters(const DefragState &data, HANDLE file_handle, const FileNode *,
+                                        const vcn64_t vcn, const lcn64_t lcn, const cluster_count64_t count) {
+    MOVE_FILE_DATA move_params;
+    DWORD w;
+
+    move_params.FileHandle = file_handle;
+    move_params.StartingLcn.QuadPart = lcn;
+    move_params.StartingVcn.QuadPart = vcn;
+    move_params.ClusterCount = (uint32_t) count;
+
+    // Call Windows to perform the move
+    if (DeviceIoControl(data.disk_.volume_handle_, FSCTL_MOVE_FILE, &move_params, sizeof move_params, nullptr, 0,
+                        &w, nullptr) != FALSE) {
+        return NO_ERROR;
+    }
+
+    return GetLastError();
+}
+
+void SimulatedMoveExecutor::load(DefragState &data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    files_.clear();
+    held_.clear();
+    clusters_.assign(data.total_clusters(), SimulatedCluster::Free);
+
+    auto mark = [&](const lcn64_t lcn, const cluster_count64_t count) {
+        std::fill_n(clusters_.begin() + lcn, count, SimulatedCluster::InUse);
+        data.bitmap_.mark(lcn, count, ClusterMapValue::InUse);
+    };
+
+    data.bitmap_.reset(data.total_clusters());
+    data.bitmap_.set_loaded();
+
+    for (auto &exclude: data.mft_excludes_) {
+        if (exclude.length() > 0) mark(exclude.begin(), exclude.length());
+    }
+
+    for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
+        vcn64_t vcn = 0;
+
+        for (auto &fragment: item->fragments_) {
+            if (!fragment.is_virtual()) mark(fragment.lcn_, fragment.next_vcn_ - vcn);
+
+            vcn = fragment.next_vcn_;
+        }
+
+        files_[item] = item->fragments_;
+    }
+}
+
+void SimulatedMoveExecutor::set_latency(const Clock::duration per_move, const Clock::duration per_cluster,
+                                        const size_t channels) {
+    std::lock_guard<std::mutex> lock(device_mutex_);
+
+    latency_per_move_ = per_move;
+    latency_per_cluster_ = per_cluster;
+    channels_ = std::max<size_t>(channels, 1);
+}
+
+void SimulatedMoveExecutor::wait_for_device(const cluster_count64_t count) {
+    std::unique_lock<std::mutex> lock(device_mutex_);
+
+    const Clock::duration latency = latency_per_move_ + latency_per_cluster_ * count;
+    if (latency <= Clock::duration::zero()) return;
+
+    device_free_.wait(lock, [this] { return busy_channels_ < channels_; });
+    busy_channels_++;
+    lock.unlock();
+
+    std::this_thread::sleep_for(latency);
+
+    lock.lock();
+    busy_channels_--;
+    device_free_.notify_one();
+}
+
+HANDLE SimulatedMoveExecutor::open_item(const DefragState &, const FileNode *item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (locked_.contains(item) || !files_.contains(item)) {
+        SetLastError(ERROR_SHARING_VIOLATION);
+        return nullptr;
+    }
+
+    // The handle is only used to find the item again
+    return (HANDLE) item;
+}
+
+bool SimulatedMoveExecutor::read_fragments(const DefragState &, FileNode *item, HANDLE file_handle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Look up by the handle, the item may be a copy that the fragments are read into
+    const auto found = files_.find((const FileNode *) file_handle);
+
+    if (found == files_.end()) return false;
+
+    item->fragments_ = found->second;
+    item->clusters_count_ = 0;
+
+    vcn64_t vcn = 0;
+
+    for (auto &fragment: item->fragments_) {
+        if (!fragment.is_virtual()) item->clusters_count_ += fragment.next_vcn_ - vcn;
+
+        vcn = fragment.next_vcn_;
+    }
+
+    return true;
+}
+
+void SimulatedMoveExecutor::release_held() {
+    std::erase_if(held_, [this](const HeldExtent &held) {
+        if (held.release_at_ >= moves_) return false;
+
+        std::fill_n(clusters_.begin() + held.lcn_, held.count_, SimulatedCluster::Free);
+        return true;
+    });
+}
+
+DWORD SimulatedMoveExecutor::move_clusters(const DefragState &, HANDLE, const FileNode *item, const vcn64_t vcn,
+                                           const lcn64_t lcn, const cluster_count64_t count) {
+    wait_for_device(count);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Every move counts, also the ones that fail, like the statistics do
+    moves_++;
+
+    const auto found = files_.find(item);
+
+    if (found == files_.end()) return ERROR_INVALID_HANDLE;
+    if (lcn < 0 || (uint64_t) lcn + count > clusters_.size()) return ERROR_INVALID_PARAMETER;
+
+    release_held();
+
+    std::list<FileFragment> fragments = found->second;
+    std::vector<RelocatedExtent> relocated;
+
+    if (!relocate_fragments(fragments, vcn, lcn, count, &relocated)) return ERROR_INVALID_PARAMETER;
+
+    // The destination must be free, Windows does not move into clusters that are in use
+    for (auto &extent: relocated) {
+        if (std::any_of(clusters_.begin() + extent.to_lcn_, clusters_.begin() + extent.to_lcn_ + extent.count_,
+                        [](const SimulatedCluster cluster) { return cluster != SimulatedCluster::Free; })) {
+            return ERROR_ACCESS_DENIED;
+        }
+    }
+
+    for (auto &extent: relocated) {
+        if (checkpoint_interval_ > 0) {
+            std::fill_n(clusters_.begin() + extent.from_lcn_, extent.count_, SimulatedCluster::Held);
+            held_.push_back({moves_ + checkpoint_interval_ - 1, extent.from_lcn_, extent.count_});
+        } else {
+            std::fill_n(clusters_.begin() + extent.from_lcn_, extent.count_, SimulatedCluster::Free);
+        }
+
+        std::fill_n(clusters_.begin() + extent.to_lcn_, extent.count_, SimulatedCluster::InUse);
+    }
+
+    found->second = std::move(fragments);
+
+    return NO_ERROR;
+}
@@ -0,0 +1,396 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+#include <cstddef>
+
+// First bytes of a journal file, and the version of the record layout. Change the version when the layout changes,
+// older journals are then ignored.
+constexpr char JOURNAL_MAGIC[8] = "JKDJRNL";
+constexpr uint32_t JOURNAL_VERSION = 2;
+
+// Number of records that are read from the file at a time
+constexpr size_t JOURNAL_READ_RECORDS = 4096;
+
+// The header of a journal file, the records follow directly
+struct JournalHeader {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t volume_serial_;
+};
+
+static_assert(sizeof(JournalHeader) % 8 == 0);
+
+// The journal is next to the snapshot: jkdefrag-XXXXXXXX.snapshot has jkdefrag-XXXXXXXX.journal
+static std::wstring journal_path(const DefragState &data) {
+    std::wstring path = data.snapshot_path_;
+
+    if (const size_t dot = path.rfind(L'.'); dot != std::wstring::npos) path.resize(dot);
+
+    return path + L".journal";
+}
+
+// FNV-1a hash of the bytes
+static uint64_t checksum(const void *bytes, const size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ ((const BYTE *) bytes)[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+uint64_t MoveCursor::name_hash(const FileNode *item) {
+    const wchar_t *name = item->get_long_fn();
+
+    return checksum(name, wcslen(name) * sizeof(wchar_t));
+}
+
+MoveJournal::~MoveJournal() {
+    close();
+}
+
+void MoveJournal::start() {
+    close();
+
+    failed_ = false;
+    planned_ahead_.clear();
+    moved_ = false;
+    planned_ = 0;
+    flushes_ = 0;
+    started_ = Clock::now();
+}
+
+bool MoveJournal::read_records(HANDLE file, const uint32_t volume_serial, PARAM_OUT std::vector<Record> &records,
+                               PARAM_OUT uint64_t &end) {
+    JournalHeader header{};
+    DWORD bytes_read = 0;
+
+    records.clear();
+    end = 0;
+
+    if (ReadFile(file, &header, sizeof(header), &bytes_read, nullptr) == FALSE || bytes_read != sizeof(header) ||
+        memcmp(header.magic_, JOURNAL_MAGIC, sizeof(header.magic_)) != 0 || header.version_ != JOURNAL_VERSION ||
+        header.volume_serial_ != volume_serial) {
+        return false;
+    }
+
+    end = sizeof(header);
+
+    // Read until the end of the file, or the first record that was not written completely
+    std::vector<Record> block(JOURNAL_READ_RECORDS);
+
+    while (ReadFile(file, block.data(), (DWORD) (block.size() * sizeof(Record)), &bytes_read, nullptr) != FALSE &&
+           bytes_read > 0) {
+        const size_t count = bytes_read / sizeof(Record);
+
+        for (size_t i = 0; i < count; i++) {
+            if (block[i].check_ != checksum(&block[i], offsetof(Record, check_))) return true;
+
+            records.push_back(block[i]);
+            end += sizeof(Record);
+        }
+
+        if (count < block.size()) break;
+    }
+
+    return true;
+}
+
+bool MoveJournal::recover(const DefragState &data, PARAM_OUT std::vector<inode_t> &inodes,
+                          PARAM_OUT std::optional<MoveCursor> &cursor) {
+    DefragGui *gui = DefragGui::get_instance();
+
+    inodes.clear();
+    cursor = std::nullopt;
+
+    if (!data.snapshot_key_.has_value()) return false;
+
+    HANDLE file = CreateFileW(journal_path(data).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    std::vector<Record> records;
+    uint64_t end;
+
+    const bool result = read_records(file, data.snapshot_key_->volume_serial_, PARAM_OUT records, PARAM_OUT end);
+
+    CloseHandle(file);
+
+    if (!result) return false;
+
+    // Every item that a move was planned for is read again, also when the move was not recorded as done: Windows
+    // may have done it before the run stopped
+    uint64_t planned = 0;
+    uint64_t done = 0;
+
+    for (auto &record: records) {
+        switch (record.type_) {
+            case RecordType::Planned:
+                inodes.push_back(record.inode_);
+                planned++;
+                break;
+            case RecordType::Done:
+                done++;
+                break;
+            case RecordType::Cursor:
+                cursor = MoveCursor{
+                        .sort_field_ = (int) record.value_,
+                        .zone_ = record.zone_,
+                        .lcn_ = record.lcn_,
+                        .previous_inode_ = record.inode_,
+                        .previous_name_hash_ = (uint64_t) record.count_,
+                };
+                break;
+        }
+    }
+
+    std::sort(inodes.begin(), inodes.end());
+    inodes.erase(std::unique(inodes.begin(), inodes.end()), inodes.end());
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"Move journal: " NUM_FMT " moves of " NUM_FMT " items planned, " NUM_FMT
+                                " done, {}", planned, inodes.size(), done,
+                                cursor.has_value() ? L"the sort can be continued" : L"no sort to continue"));
+
+    return true;
+}
+
+bool MoveJournal::open(const DefragState &data) {
+    DefragGui *gui = DefragGui::get_instance();
+
+    if (!data.snapshot_key_.has_value()) return false;
+
+    path_ = journal_path(data);
+    snapshot_path_ = data.snapshot_path_;
+
+    file_ = CreateFileW(path_.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (file_ == INVALID_HANDLE_VALUE) {
+        file_ = nullptr;
+        gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                        std::format(L"Move journal: cannot open {}: {}", path_, Str::system_error(GetLastError())));
+        return false;
+    }
+
+    // A journal that is still there belongs to the snapshot file as well, its moves are not in the snapshot either.
+    // Append after its last complete record. Anything else starts a new journal.
+    std::vector<Record> records;
+    uint64_t end;
+
+    if (!read_records(file_, data.snapshot_key_->volume_serial_, PARAM_OUT records, PARAM_OUT end)) end = 0;
+
+    LARGE_INTEGER position{};
+    position.QuadPart = (LONGLONG) end;
+
+    bool result = SetFilePointerEx(file_, position, nullptr, FILE_BEGIN) != FALSE && SetEndOfFile(file_) != FALSE;
+
+    if (result && end == 0) {
+        JournalHeader header{};
+        DWORD written = 0;
+
+        memcpy(header.magic_, JOURNAL_MAGIC, sizeof(header.magic_));
+        header.version_ = JOURNAL_VERSION;
+        header.volume_serial_ = data.snapshot_key_->volume_serial_;
+
+        result = WriteFile(file_, &header, sizeof(header), &written, nullptr) != FALSE && written == sizeof(header) &&
+                 FlushFileBuffers(file_) != FALSE;
+    }
+
+    if (!result) {
+        CloseHandle(file_);
+        file_ = nullptr;
+        DeleteFileW(path_.c_str());
+        return false;
+    }
+
+    last_flush_ = Clock::now();
+
+    return true;
+}
+
+void MoveJournal::append(const Record &record) {
+    pending_.push_back(record);
+    pending_.back().check_ = checksum(&record, offsetof(Record, check_));
+}
+
+void MoveJournal::flush_when_due() {
+    if (pending_.size() >= MOVE_JOURNAL_BATCH_SIZE || Clock::now() - last_flush_ >= MOVE_JOURNAL_FLUSH_INTERVAL) {
+        flush();
+    }
+}
+
+bool MoveJournal::prepare(DefragState &data) {
+    if (!moved_) {
+        moved_ = true;
+
+        DefragGui::get_instance()->show_debug(
+                DebugLevel::DetailedProgress, nullptr,
+                std::format(L"First move " NUM_FMT " ms after the start of the run",
+                            std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - started_).count()));
+    }
+
+    if (file_ == nullptr && !failed_) {
+        failed_ = !open(data);
+
+        // From now on the snapshot file is only valid together with the journal, it is saved again after the moves
+        if (!failed_) data.snapshot_saved_ = false;
+    }
+
+    if (file_ == nullptr) {
+        // The snapshot of the analysis no longer matches the volume once something moves
+        AnalysisSnapshot::discard(data);
+        return false;
+    }
+
+    return true;
+}
+
+void MoveJournal::plan(DefragState &data, const MoveTask &task) {
+    if (!prepare(data)) return;
+
+    // The record is on disk already, written together with the batch of the move
+    const auto ahead = std::find(planned_ahead_.begin(), planned_ahead_.end(),
+                                 std::make_pair(task.file_->inode_, task.lcn_to_));
+
+    if (ahead != planned_ahead_.end()) {
+        planned_ahead_.erase(ahead);
+        return;
+    }
+
+    append_planned(task);
+
+    // Write-ahead: the record is on disk before the move is done
+    flush();
+}
+
+void MoveJournal::plan_ahead(DefragState &data, const MoveTask &task) {
+    if (!prepare(data)) return;
+
+    append_planned(task);
+    planned_ahead_.emplace_back(task.file_->inode_, task.lcn_to_);
+}
+
+void MoveJournal::cancel(const MoveTask &task) {
+    const auto ahead = std::find(planned_ahead_.begin(), planned_ahead_.end(),
+                                 std::make_pair(task.file_->inode_, task.lcn_to_));
+
+    if (ahead != planned_ahead_.end()) planned_ahead_.erase(ahead);
+}
+
+void MoveJournal::append_planned(const MoveTask &task) {
+    planned_++;
+
+    append({
+                   .type_ = RecordType::Planned,
+                   .zone_ = Zone::None,
+                   .inode_ = task.file_->inode_,
+                   .lcn_ = task.lcn_to_,
+                   .count_ = task.count_,
+                   .value_ = task.vcn_from_,
+           });
+}
+
+void MoveJournal::done(const MoveTask &task, const bool succeeded) {
+    if (file_ == nullptr) return;
+
+    append({
+                   .type_ = RecordType::Done,
+                   .zone_ = Zone::None,
+                   .inode_ = task.file_->inode_,
+                   .lcn_ = task.lcn_to_,
+                   .count_ = task.count_,
+                   .value_ = succeeded ? 1ULL : 0ULL,
+           });
+
+    flush_when_due();
+}
+
+void MoveJournal::record_cursor(const MoveCursor &cursor) {
+    if (file_ == nullptr) return;
+
+    append({
+                   .type_ = RecordType::Cursor,
+                   .zone_ = cursor.zone_,
+                   .inode_ = cursor.previous_inode_,
+                   .lcn_ = cursor.lcn_,
+                   .count_ = (cluster_count64_t) cursor.previous_name_hash_,
+                   .value_ = (uint64_t) cursor.sort_field_,
+           });
+
+    flush_when_due();
+}
+
+void MoveJournal::flush() {
+    if (file_ == nullptr || pending_.empty()) return;
+
+    const DWORD length = (DWORD) (pending_.size() * sizeof(Record));
+    DWORD written = 0;
+
+    const bool result = WriteFile(file_, pending_.data(), length, &written, nullptr) != FALSE &&
+                        written == length && FlushFileBuffers(file_) != FALSE;
+
+    pending_.clear();
+    last_flush_ = Clock::now();
+    flushes_++;
+
+    if (result) return;
+
+    // The journal no longer covers all the moves, and the snapshot no longer matches the volume without it
+    DefragGui::get_instance()->show_debug(
+            DebugLevel::DetailedProgress, nullptr,
+            std::format(L"Move journal: cannot write {}: {}", path_, Str::system_error(GetLastError())));
+
+    CloseHandle(file_);
+    file_ = nullptr;
+    failed_ = true;
+    planned_ahead_.clear();
+
+    DeleteFileW(snapshot_path_.c_str());
+    DeleteFileW(path_.c_str());
+}
+
+void MoveJournal::close() {
+    if (file_ == nullptr) return;
+
+    flush();
+
+    if (file_ == nullptr) return;
+
+    CloseHandle(file_);
+    file_ = nullptr;
+
+    DefragGui::get_instance()->show_debug(
+            DebugLevel::DetailedProgress, nullptr,
+            std::format(L"Move journal: " NUM_FMT " moves recorded in " NUM_FMT " flushes", planned_, flushes_));
+}
+
+void MoveJournal::remove(const DefragState &data) {
+    pending_.clear();
+    planned_ahead_.clear();
+
+    if (file_ != nullptr) {
+        CloseHandle(file_);
+        file_ = nullptr;
+    }
+
+    if (!data.snapshot_path_.empty()) DeleteFileW(journal_path(data).c_str());
+}
@@ -113,8 +113,9 @@
 
         if (clusters > gap.length()) {
             clusters = gap.length();
-            // It looks like a partial move only succeeds if the number of clusters is a multiple of 8.
-            clusters = clusters - clusters % 8;
+            // Some partial moves only succeed if the number of clusters is a multiple of the alignment that was
+            // learned for the volume
+            clusters = clusters - clusters % data.disk_.partial_move_alignment_;
 
             if (clusters == 0) {
                 lcn = gap.end();
@@ -142,6 +143,13 @@
                 // No gaps found, exit
                 return;
             }
+
+            // If Windows refused the size of a partial move then try again with the new alignment
+            if (clusters < item->clusters_count_ - clusters_done &&
+                learn_partial_move_alignment(data, item, clusters, task.error_)) {
+                lcn = gap.begin();
+                continue;
+            }
         }
 
         lcn = gap.begin();
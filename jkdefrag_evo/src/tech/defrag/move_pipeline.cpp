@@ -0,0 +1,325 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+#include <utility>
+
+// The throughput is measured over this many finished moves for every move that runs at the same time
+static constexpr size_t MOVE_TUNE_WINDOW = 8;
+// A window that is this much slower than the one before counts as slower, less is noise
+static constexpr double MOVE_TUNE_TOLERANCE = 0.95;
+
+static void mark_fragments(DefragState &data, const FileNode *item, const ClusterMapValue value) {
+    vcn64_t vcn = 0;
+
+    for (auto &fragment: item->fragments_) {
+        if (!fragment.is_virtual()) data.bitmap_.mark(fragment.lcn_, fragment.next_vcn_ - vcn, value);
+
+        vcn = fragment.next_vcn_;
+    }
+}
+
+// The item that the executor reads the new fragments of the item into. Copying the whole item would also copy its
+// fragments, which are read again anyway, and its names.
+static std::unique_ptr<FileNode> make_result(const FileNode *item) {
+    auto result = std::make_unique<FileNode>();
+
+    result->inode_ = item->inode_;
+    result->is_dir_ = item->is_dir_;
+    result->creation_time_ = item->creation_time_;
+    result->mft_change_time_ = item->mft_change_time_;
+    result->last_access_time_ = item->last_access_time_;
+
+    return result;
+}
+
+MovePipeline::MovePipeline(DefragRunner &runner, DefragState &data, const size_t depth, const size_t max_concurrency,
+                           const bool tuned)
+        : runner_(runner), data_(data), depth_(std::max<size_t>(depth, 1)),
+          max_concurrency_(std::max<size_t>(max_concurrency, 1)), tuned_(tuned),
+          concurrency_(tuned ? 1 : max_concurrency_),
+          todo_(depth_ + max_concurrency_), done_(depth_ + max_concurrency_) {
+    for (size_t i = 0; i < max_concurrency_; i++) {
+        executors_.emplace_back(&MovePipeline::run_executor, this);
+    }
+}
+
+MovePipeline::~MovePipeline() {
+    drain();
+    todo_.close();
+
+    for (auto &executor: executors_) {
+        executor.join();
+    }
+}
+
+void MovePipeline::run_executor() {
+    MoveExecutor &executor = *data_.move_executor_;
+
+    while (auto next = todo_.pop()) {
+        PipelinedMove &move = **next;
+        const MoveTask &task = move.task_;
+
+        {
+            std::unique_lock<std::mutex> lock(gate_mutex_);
+            gate_.wait(lock, [this] { return running_moves_ < concurrency_; });
+            running_moves_++;
+        }
+
+        const auto started = Clock::now();
+
+        HANDLE file_handle = executor.open(data_, task.file_);
+
+        if (file_handle == nullptr) {
+            move.error_ = ERROR_OPEN_FAILED;
+        } else {
+            move.error_ = executor.move(data_, file_handle, task.file_, move.starting_vcn_, move.from_lcn_,
+                                        task.lcn_to_, task.count_);
+
+            // Fetch the new fragment map into the copy, the planner applies it to the item
+            move.refreshed_ = executor.read_fragments(data_, move.result_.get(), file_handle);
+
+            executor.close(file_handle);
+        }
+
+        move.done_at_ = Clock::now();
+        move.latency_ = move.done_at_ - started;
+
+        {
+            std::lock_guard<std::mutex> lock(gate_mutex_);
+            running_moves_--;
+        }
+
+        gate_.notify_one();
+        done_.push(std::move(*next));
+    }
+}
+
+void MovePipeline::submit(const MoveTask &task, const MoveDirection direction) {
+    FileNode *item = task.file_;
+    DefragGui *gui = DefragGui::get_instance();
+
+    // Directories on a volume that refused to move them, and blocks that are moved in parts, go through move_item()
+    // after the moves in flight
+    if (!item->can_move() || (item->is_dir_ && data_.cannot_move_dirs_ > 20) ||
+        task.count_ > DefragRunner::max_clusters_per_move(data_)) {
+        drain();
+
+        MoveTask sync_task = task;
+        const bool result = runner_.move_item(data_, sync_task, direction);
+
+        outcomes_.push_back({task, result});
+        return;
+    }
+
+    // Slow the program down if so selected
+    DefragRunner::slow_down(data_);
+
+    // Wait for room in the pipeline: the moves that run, and depth_ - 1 more that are planned ahead
+    while (in_flight_.size() >= concurrency_ + depth_ - 1) {
+        apply(done_.pop().value());
+    }
+
+    // Record the move in the journal, or discard the snapshot of the analysis if there is no journal
+    data_.move_journal_.plan(data_, task);
+
+    auto move = std::make_unique<PipelinedMove>();
+    move->task_ = task;
+    move->direction_ = direction;
+    move->old_lcn_ = item->get_item_lcn();
+    move->result_ = make_result(item);
+
+    DefragRunner::locate_block(item, task.vcn_from_, move->starting_vcn_, move->from_lcn_);
+
+    // Show progress message, and reserve the destination. The source stays in use until the move is applied.
+    gui->show_move(item, task.count_, move->from_lcn_, task.lcn_to_, move->starting_vcn_);
+    data_.bitmap_.mark(task.lcn_to_, task.count_, ClusterMapValue::InUse);
+
+    // Draw the item and the destination clusters on the screen in the BUSY color
+    runner_.colorize_disk_item(data_, item, move->starting_vcn_, task.count_, false);
+    gui->draw_cluster(data_, task.lcn_to_, task.lcn_to_ + task.count_, DrawColor::Busy);
+
+    item->is_moving_ = true;
+
+    todo_.push(move.get());
+    in_flight_.push_back(std::move(move));
+}
+
+void MovePipeline::poll() {
+    while (auto finished = done_.try_pop()) {
+        apply(finished.value());
+    }
+
+    if (!alternatives_.empty()) drain();
+}
+
+void MovePipeline::drain() {
+    while (!in_flight_.empty()) {
+        apply(done_.pop().value());
+    }
+
+    run_alternatives();
+}
+
+std::vector<MoveOutcome> MovePipeline::take_outcomes() {
+    return std::exchange(outcomes_, {});
+}
+
+void MovePipeline::apply(PipelinedMove *finished) {
+    const auto found = std::find_if(in_flight_.begin(), in_flight_.end(),
+                                    [finished](const auto &move) { return move.get() == finished; });
+
+    std::unique_ptr<PipelinedMove> move = std::move(*found);
+    in_flight_.erase(found);
+
+    tune(*move);
+
+    const MoveTask &task = move->task_;
+    FileNode *item = task.file_;
+    DefragGui *gui = DefragGui::get_instance();
+
+    item->is_moving_ = false;
+
+    // Update the PhaseDone counter for the progress bar, and undraw the destination clusters on the screen
+    data_.clusters_done_ += task.count_;
+    gui->draw_cluster(data_, task.lcn_to_, task.lcn_to_ + task.count_, DrawColor::Empty);
+
+    // Release the reservation, the new fragments of the item take their clusters again
+    data_.bitmap_.mark(task.lcn_to_, task.count_, ClusterMapValue::Free);
+
+    // Take the new fragment map of the item and refresh the screen. If it could not be read then the item keeps the
+    // fragments it had.
+    runner_.colorize_disk_item(data_, item, 0, 0, true);
+
+    if (move->refreshed_) {
+        mark_fragments(data_, item, ClusterMapValue::Free);
+
+        item->fragments_ = std::move(move->result_->fragments_);
+        item->clusters_count_ = move->result_->clusters_count_;
+        item->fragments_predicted_ = false;
+
+        mark_fragments(data_, item, ClusterMapValue::InUse);
+
+        if (item->get_item_lcn() != move->old_lcn_) Tree::reposition(data_.item_tree_, data_.tree_statistics_, item);
+    }
+
+    runner_.colorize_disk_item(data_, item, 0, 0, false);
+
+    // if windows reported an error while moving the item then show the error message
+    if (move->error_ != NO_ERROR) {
+        gui->show_debug(DebugLevel::DetailedProgress, item, Str::system_error(move->error_));
+        finish(task, false);
+        return;
+    }
+
+    if (!move->refreshed_ || !data_.is_still_running()) {
+        finish(task, false);
+        return;
+    }
+
+    // Windows moved the block but left it fragmented, try the alternative strategy once the executor is idle
+    if (DefragRunner::is_fragmented(item, task.vcn_from_, task.count_)) {
+        alternatives_.push_back(std::move(move));
+        return;
+    }
+
+    finish(task, true);
+}
+
+void MovePipeline::tune(const PipelinedMove &move) {
+    if (!tuned_ || max_concurrency_ == 1) return;
+
+    if (window_moves_ == 0) window_start_ = move.done_at_ - move.latency_;
+
+    window_moves_++;
+    window_clusters_ += move.task_.count_;
+    window_latency_ += move.latency_;
+
+    if (window_moves_ < MOVE_TUNE_WINDOW * concurrency_) return;
+
+    const double seconds = std::chrono::duration<double>(move.done_at_ - window_start_).count();
+    const double throughput = seconds > 0 ? (double) window_clusters_ / seconds : 0;
+
+    // The last step made the moves slower, turn around
+    if (throughput < last_throughput_ * MOVE_TUNE_TOLERANCE) tune_step_ = -tune_step_;
+
+    last_throughput_ = throughput;
+
+    const auto concurrency = (size_t) std::clamp<int64_t>((int64_t) concurrency_ + tune_step_, 1,
+                                                          (int64_t) max_concurrency_);
+
+    // At the limits step back, to find out if the other side is faster after all
+    if (concurrency == 1 || concurrency == max_concurrency_) tune_step_ = concurrency == 1 ? 1 : -1;
+
+    DefragGui::get_instance()->show_debug(
+            DebugLevel::DetailedProgress, nullptr,
+            std::format(L"Concurrent moves " NUM_FMT " -> " NUM_FMT ", " NUM_FMT " clusters per second, "
+                        "average latency " NUM_FMT " us", concurrency_, concurrency, (uint64_t) throughput,
+                        std::chrono::duration_cast<std::chrono::microseconds>(window_latency_).count() /
+                        (int64_t) window_moves_));
+
+    {
+        std::lock_guard<std::mutex> lock(gate_mutex_);
+        concurrency_ = concurrency;
+    }
+
+    gate_.notify_all();
+
+    window_moves_ = 0;
+    window_clusters_ = 0;
+    window_latency_ = Clock::duration::zero();
+}
+
+void MovePipeline::run_alternatives() {
+    for (auto &move: alternatives_) {
+        MoveTask task = move->task_;
+        bool result = false;
+
+        task.file_handle_ = data_.move_executor_->open(data_, task.file_);
+
+        if (task.file_handle_ != nullptr) {
+            result = runner_.move_item_alternative(data_, task, move->direction_, move->old_lcn_);
+            data_.move_executor_->close(task.file_handle_);
+        }
+
+        finish(move->task_, result);
+    }
+
+    alternatives_.clear();
+}
+
+void MovePipeline::finish(const MoveTask &task, const bool succeeded) {
+    FileNode *item = task.file_;
+
+    data_.move_journal_.done(task, succeeded);
+
+    if (succeeded) {
+        if (item->is_dir_) data_.cannot_move_dirs_ = 0;
+    } else {
+        // Like move_item(): set the Unmovable flag, colorize the item on the screen and recalculate the begin of the
+        // zones
+        item->is_unmovable_ = true;
+
+        if (item->is_dir_) data_.cannot_move_dirs_++;
+
+        runner_.colorize_disk_item(data_, item, 0, 0, false);
+        DefragRunner::calculate_zones(data_);
+    }
+
+    outcomes_.push_back({task, succeeded});
+}
@@ -0,0 +1,120 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+#include <algorithm>
+
+// Clusters the disk head travels for the moves in this order, starting at head: to the data, and from the data to the
+// destination. The same model as the MoveStatistics of the executors.
+static uint64_t seek_distance(const std::vector<ScheduledMove> &moves, lcn64_t head) {
+    uint64_t distance = 0;
+
+    for (auto &move: moves) {
+        const lcn64_t data_end = move.from_lcn_ + move.task_.count_;
+
+        distance += (uint64_t) (std::abs(head - move.from_lcn_) + std::abs(data_end - move.task_.lcn_to_));
+        head = move.task_.lcn_to_ + move.task_.count_;
+    }
+
+    return distance;
+}
+
+MoveScheduler::MoveScheduler(DefragRunner &runner, DefragState &data)
+        : runner_(runner), data_(data),
+          batch_size_(data.disk_.incurs_seek_penalty_ && !data.keep_move_order_ ? MOVE_SCHEDULER_BATCH_SIZE : 1) {
+    batch_.reserve(batch_size_);
+}
+
+MoveScheduler::~MoveScheduler() {
+    flush();
+
+    if (planned_distance_ == 0) return;
+
+    DefragGui::get_instance()->show_debug(
+            DebugLevel::DetailedProgress, nullptr,
+            std::format(L"Elevator order: estimated seek distance " NUM_FMT " clusters, " NUM_FMT " saved",
+                        scheduled_distance_, planned_distance_ - scheduled_distance_));
+}
+
+void MoveScheduler::add(const MoveTask &task, const MoveDirection direction) {
+    // Without a batch there is nothing to order, move at once
+    if (batch_size_ == 1) {
+        MoveTask move_task = task;
+        if (!runner_.move_item(data_, move_task, direction)) failed_ = true;
+        return;
+    }
+
+    data_.bitmap_.mark(task.lcn_to_, task.count_, ClusterMapValue::InUse);
+
+    batch_.push_back({task, direction, task.file_->get_item_lcn()});
+
+    if (batch_.size() >= batch_size_) flush();
+}
+
+void MoveScheduler::flush() {
+    if (batch_.empty()) return;
+
+    const lcn64_t head = data_.move_executor_->statistics().head_;
+    const uint64_t planned = seek_distance(batch_, head);
+
+    // Sweep up from the head by source and then by destination, and wrap around to the lowest source
+    std::vector<ScheduledMove> moves = batch_;
+
+    std::sort(moves.begin(), moves.end(), [](const ScheduledMove &a, const ScheduledMove &b) {
+        if (a.from_lcn_ != b.from_lcn_) return a.from_lcn_ < b.from_lcn_;
+        return a.task_.lcn_to_ < b.task_.lcn_to_;
+    });
+
+    const auto first = std::find_if(moves.begin(), moves.end(),
+                                    [head](const ScheduledMove &move) { return move.from_lcn_ >= head; });
+    std::rotate(moves.begin(), first, moves.end());
+
+    // The estimate can be worse than the planned order, for example when the moves go down the disk
+    uint64_t scheduled = seek_distance(moves, head);
+
+    if (scheduled > planned) {
+        moves = std::move(batch_);
+        scheduled = planned;
+    }
+
+    batch_.clear();
+
+    planned_distance_ += planned;
+    scheduled_distance_ += scheduled;
+
+    // The moves of the batch are on disk in the journal before the first one is done
+    if (data_.is_still_running()) {
+        for (auto &move: moves) {
+            data_.move_journal_.plan_ahead(data_, move.task_);
+        }
+
+        data_.move_journal_.flush();
+    }
+
+    for (auto &move: moves) {
+        // Release the reservation, the move takes the clusters again
+        data_.bitmap_.mark(move.task_.lcn_to_, move.task_.count_, ClusterMapValue::Free);
+
+        if (!data_.is_still_running()) {
+            data_.move_journal_.cancel(move.task_);
+            continue;
+        }
+
+        if (!runner_.move_item(data_, move.task_, move.direction_)) failed_ = true;
+    }
+}
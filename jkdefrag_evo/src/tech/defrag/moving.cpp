@@ -18,10 +18,43 @@
 #include "precompiled_header.h"
 
 
+cluster_count64_t DefragRunner::max_clusters_per_move(const DefragState &data) {
+    return data.move_executor_->chunk_clusters(data);
+}
+
+bool DefragRunner::learn_partial_move_alignment(DefragState &data, FileNode *item,
+                                                const cluster_count64_t clusters, const DWORD error) const {
+    cluster_count64_t &alignment = data.disk_.partial_move_alignment_;
+
+    // Only a refused parameter can be the alignment, and only if the clusters are not aligned to the next step
+    if (error != ERROR_INVALID_PARAMETER) return false;
+    if (alignment >= MOVE_MAX_PARTIAL_ALIGNMENT || clusters % (alignment * 2) == 0) return false;
+
+    alignment = alignment * 2;
+
+    DefragGui::get_instance()->show_debug(
+            DebugLevel::DetailedGapFilling, item,
+            std::format(L"Partial move of " NUM_FMT " clusters refused, moving in multiples of " NUM_FMT " clusters",
+                        clusters, alignment));
+
+    // The failure was the alignment, not the item. Give it another chance.
+    item->is_unmovable_ = false;
+
+    colorize_disk_item(data, item, 0, 0, false);
+    calculate_zones(data);
+
+    return true;
+}
+
 bool DefragRunner::move_item(DefragState &defrag_state, MoveTask &task,
                              MoveDirection direction) const {
+    task.error_ = NO_ERROR;
+
     // If the Item is Unmovable, Excluded, or has zero size then we cannot move it
-    if (!task.file_->can_move()) return false;
+    if (!task.file_->can_move()) {
+        defrag_state.move_journal_.cancel(task);
+        return false;
+    }
 
     // Directories cannot be moved on FAT volumes. This is a known Windows limitation
     // and not a bug in JkDefrag. But JkDefrag will still try, to allow for possible
@@ -31,44 +64,49 @@ bool DefragRunner::move_item(DefragState &defrag_state, MoveTask &task,
     if (task.file_->is_dir_ && defrag_state.cannot_move_dirs_ > 20) {
         task.file_->is_unmovable_ = true;
         colorize_disk_item(defrag_state, task.file_, 0, 0, false);
+        defrag_state.move_journal_.cancel(task);
         return false;
     }
 
+    // Record the move in the journal, or discard the snapshot of the analysis if there is no journal
+    defrag_state.move_journal_.plan(defrag_state, task);
+
     // Open a filehandle for the item and call the subfunctions (see above) to
     // move the file. If success then return true.
     cluster_count64_t clusters_done = 0;
     bool result = true;
 
     while (clusters_done < task.count_ && defrag_state.is_still_running()) {
-        cluster_count64_t clusters_todo = task.count_ - clusters_done;
+        const cluster_count64_t clusters_todo = std::min(task.count_ - clusters_done,
+                                                         max_clusters_per_move(defrag_state));
 
-        if (defrag_state.bytes_per_cluster_ > 0) {
-            if (clusters_todo > 0x40000000LL / defrag_state.bytes_per_cluster_) {
-                clusters_todo = 0x40000000LL / defrag_state.bytes_per_cluster_;
-            }
-        } else {
-            if (clusters_todo > 262144) clusters_todo = 262144;
-        }
+        HANDLE file_handle = defrag_state.move_executor_->open(defrag_state, task.file_);
 
-        HANDLE file_handle = open_item_handle(defrag_state, task.file_);
-        if (file_handle == nullptr) break;
+        if (file_handle == nullptr) {
+            result = false;
+            break;
+        }
 
         {
             auto try_task = task;
             try_task.lcn_to_ = task.lcn_to_ + clusters_done;
             try_task.vcn_from_ = task.vcn_from_ + clusters_done;
             try_task.count_ = clusters_todo;
+            try_task.file_handle_ = file_handle;
 
             result = move_item_try_strategies(defrag_state, try_task, direction);
-
-            if (!result) break;
+            task.error_ = try_task.error_;
         }
 
+        defrag_state.move_executor_->close(file_handle);
+
+        if (!result) break;
+
         clusters_done = clusters_done + clusters_todo;
-        FlushFileBuffers(file_handle);// Is this useful? Can't hurt
-        CloseHandle(file_handle);
     }
 
+    defrag_state.move_journal_.done(task, result);
+
     if (result) {
         if (task.file_->is_dir_) defrag_state.cannot_move_dirs_ = 0;
         return true;
@@ -86,6 +124,27 @@ bool DefragRunner::move_item(DefragState &defrag_state, MoveTask &task,
     return false;
 }
 
+void DefragRunner::locate_block(const FileNode *item, const vcn64_t offset, PARAM_OUT vcn64_t &vcn,
+                                PARAM_OUT lcn64_t &lcn) {
+    // Find the first fragment that contains clusters inside the block
+    vcn64_t fragment_vcn = 0;
+    vcn64_t real_vcn = 0;
+
+    auto fragment = item->fragments_.begin();
+    for (; fragment != item->fragments_.end(); fragment++) {
+        if (!fragment->is_virtual()) {
+            if (real_vcn + fragment->next_vcn_ - fragment_vcn - 1 >= offset) break;
+
+            real_vcn = real_vcn + fragment->next_vcn_ - fragment_vcn;
+        }
+
+        fragment_vcn = fragment->next_vcn_;
+    }
+
+    vcn = fragment_vcn + (offset - real_vcn);
+    lcn = fragment == item->fragments_.end() ? 0 : fragment->lcn_ + (offset - real_vcn);
+}
+
 /**
  * \brief Subfunction for MoveItem(), see below. Move (part of) an item to a new location on disk.
  * The file is moved in a single FSCTL_MOVE_FILE call. If the file has fragments then Windows will join them up.
@@ -95,44 +154,26 @@ bool DefragRunner::move_item(DefragState &defrag_state, MoveTask &task,
  * \param size
  * \return NO_ERROR value or GetLastError() from DeviceIoControl()
  */
-DWORD DefragRunner::move_item_whole(DefragState &data, MoveTask &task) const {
+DWORD DefragRunner::move_item_whole(DefragState &data, MoveTask &task,
+                                    std::optional<std::list<FileFragment>> &predicted) const {
     MOVE_FILE_DATA move_params;
-    uint64_t lcn;
-    DWORD w;
+    vcn64_t vcn;
+    lcn64_t lcn;
     DefragGui *gui = DefragGui::get_instance();
 
-    // Find the first fragment that contains clusters inside the block, so we can translate the absolute cluster number
-    // of the block into the virtual cluster number used by Windows.
-    vcn64_t vcn = 0;
-    vcn64_t real_vcn = 0;
-
-    auto fragment = task.file_->fragments_.begin();
-    for (; fragment != task.file_->fragments_.end(); fragment++) {
-        if (!fragment->is_virtual()) {
-            if (real_vcn + fragment->next_vcn_ - vcn - 1 >= task.vcn_from_) break;
-
-            real_vcn = real_vcn + fragment->next_vcn_ - vcn;
-        }
-
-        vcn = fragment->next_vcn_;
-    }
+    // Translate the absolute cluster number of the block into the virtual cluster number used by Windows
+    locate_block(task.file_, task.vcn_from_, vcn, lcn);
 
     // Set up the parameters for the move
     move_params.FileHandle = task.file_handle_;
     move_params.StartingLcn.QuadPart = task.lcn_to_;
-    move_params.StartingVcn.QuadPart = vcn + (task.vcn_from_ - real_vcn);
+    move_params.StartingVcn.QuadPart = vcn;
     move_params.ClusterCount = (uint32_t) task.count_;
 
-    if (fragment == task.file_->fragments_.end()) {
-        lcn = 0;
-    } else {
-        lcn = fragment->lcn_ + (task.vcn_from_ - real_vcn);
-    }
-
     // Show progress message
     gui->show_move(task.file_, task.count_, lcn, task.lcn_to_, move_params.StartingVcn.QuadPart);
-    data.bitmap_.mark(lcn, lcn + task.count_, ClusterMapValue::Free);
-    data.bitmap_.mark(task.lcn_to_, task.lcn_to_ + task.count_, ClusterMapValue::InUse);
+    data.bitmap_.mark(lcn, task.count_, ClusterMapValue::Free);
+    data.bitmap_.mark(task.lcn_to_, task.count_, ClusterMapValue::InUse);
 
     // Draw the item and the destination clusters on the screen in the BUSY	color
     colorize_disk_item(data, task.file_, move_params.StartingVcn.QuadPart, move_params.ClusterCount,
@@ -140,15 +181,9 @@ DWORD DefragRunner::move_item_whole(DefragState &data, MoveTask &task) const {
 
     gui->draw_cluster(data, task.lcn_to_, task.lcn_to_ + task.count_, DrawColor::Busy);
 
-    // Call Windows to perform the move.
-    DWORD result = DeviceIoControl(data.disk_.volume_handle_, FSCTL_MOVE_FILE, &move_params,
-                                   sizeof move_params, nullptr, 0, &w, nullptr);
-
-    if (result != FALSE) {
-        result = NO_ERROR;
-    } else {
-        result = GetLastError();
-    }
+    // Perform the move
+    const DWORD result = data.move_executor_->move(data, task.file_handle_, task.file_,
+                                                   move_params.StartingVcn.QuadPart, lcn, task.lcn_to_, task.count_);
 
     // Update the PhaseDone counter for the progress bar
     data.clusters_done_ += move_params.ClusterCount;
@@ -156,6 +191,17 @@ DWORD DefragRunner::move_item_whole(DefragState &data, MoveTask &task) const {
     // Undraw the destination clusters on the screen
     gui->draw_cluster(data, task.lcn_to_, task.lcn_to_ + task.count_, DrawColor::Empty);
 
+    // If the move failed then the block is still where it was
+    if (result != NO_ERROR) {
+        data.bitmap_.mark(task.lcn_to_, task.count_, ClusterMapValue::Free);
+        data.bitmap_.mark(lcn, task.count_, ClusterMapValue::InUse);
+    }
+
+    if (result == NO_ERROR && predicted.has_value() &&
+        !relocate_fragments(predicted.value(), vcn, task.lcn_to_, task.count_)) {
+        predicted.reset();
+    }
+
     return result;
 }
 
@@ -168,10 +214,10 @@ DWORD DefragRunner::move_item_whole(DefragState &data, MoveTask &task) const {
  * \param size Number of clusters to be moved
  * \return NO_ERROR or GetLastError() from DeviceIoControl()
  */
-DWORD DefragRunner::move_item_in_fragments(DefragState &data, MoveTask &task) const {
+DWORD DefragRunner::move_item_in_fragments(DefragState &data, MoveTask &task,
+                                           std::optional<std::list<FileFragment>> &predicted) const {
     MOVE_FILE_DATA move_params;
     uint64_t from_lcn;
-    DWORD w;
     DefragGui *gui = DefragGui::get_instance();
 
     // Walk through the fragments of the item and move them one by one to the new location
@@ -224,10 +270,8 @@ DWORD DefragRunner::move_item_in_fragments(DefragState &data, MoveTask &task) co
                 // Show progress message
                 gui->show_move(task.file_, move_params.ClusterCount, from_lcn,
                                move_params.StartingLcn.QuadPart, move_params.StartingVcn.QuadPart);
-                data.bitmap_.mark(from_lcn, from_lcn + move_params.ClusterCount,
-                                  ClusterMapValue::Free);
-                data.bitmap_.mark(move_params.StartingLcn.QuadPart,
-                                  move_params.StartingLcn.QuadPart + move_params.ClusterCount,
+                data.bitmap_.mark(from_lcn, move_params.ClusterCount, ClusterMapValue::Free);
+                data.bitmap_.mark(move_params.StartingLcn.QuadPart, move_params.ClusterCount,
                                   ClusterMapValue::InUse);
 
                 // Draw the item and the destination clusters on the screen in the BUSY	color.
@@ -238,16 +282,10 @@ DWORD DefragRunner::move_item_in_fragments(DefragState &data, MoveTask &task) co
                                   move_params.StartingLcn.QuadPart + move_params.ClusterCount,
                                   DrawColor::Busy);
 
-                // Call Windows to perform the move
-                error_code =
-                        DeviceIoControl(data.disk_.volume_handle_, FSCTL_MOVE_FILE, &move_params,
-                                        sizeof move_params, nullptr, 0, &w, nullptr);
-
-                if (error_code != 0) {
-                    error_code = NO_ERROR;
-                } else {
-                    error_code = GetLastError();
-                }
+                // Perform the move
+                error_code = data.move_executor_->move(data, task.file_handle_, task.file_,
+                                                       move_params.StartingVcn.QuadPart, from_lcn,
+                                                       move_params.StartingLcn.QuadPart, move_params.ClusterCount);
 
                 // Update the PhaseDone counter for the progress bar
                 data.clusters_done_ += move_params.ClusterCount;
@@ -256,12 +294,20 @@ DWORD DefragRunner::move_item_in_fragments(DefragState &data, MoveTask &task) co
                 gui->draw_cluster(data, move_params.StartingLcn.QuadPart,
                                   move_params.StartingLcn.QuadPart + move_params.ClusterCount,
                                   DrawColor::Empty);
-                data.bitmap_.mark(move_params.StartingLcn.QuadPart,
-                                  move_params.StartingLcn.QuadPart + move_params.ClusterCount,
-                                  ClusterMapValue::Free);
 
-                // If there was an error then exit
-                if (error_code != NO_ERROR) return error_code;
+                // If there was an error then the fragment is still where it was, and exit
+                if (error_code != NO_ERROR) {
+                    data.bitmap_.mark(move_params.StartingLcn.QuadPart, move_params.ClusterCount,
+                                      ClusterMapValue::Free);
+                    data.bitmap_.mark(from_lcn, move_params.ClusterCount, ClusterMapValue::InUse);
+                    return error_code;
+                }
+
+                if (predicted.has_value() &&
+                    !relocate_fragments(predicted.value(), move_params.StartingVcn.QuadPart,
+                                        move_params.StartingLcn.QuadPart, move_params.ClusterCount)) {
+                    predicted.reset();
+                }
             }
 
             real_vcn = real_vcn + fragment.next_vcn_ - vcn;
@@ -293,26 +339,52 @@ bool DefragRunner::move_item_with_strat(DefragState &data, MoveTask &task,
     // Slow the program down if so selected
     slow_down(data);
 
+    // A block that is one fragment lands in one piece, but Windows may leave a fragmented block fragmented without
+    // an error. The next strategy depends on that, so the prediction for a fragmented block is always checked.
+    const bool was_fragmented = is_fragmented(task.file_, task.vcn_from_, task.count_);
+    std::optional<std::list<FileFragment>> predicted = task.file_->fragments_;
+
     // Move the item, either in a single block or fragment by fragment
     switch (strategy) {
         case MoveStrategy::Whole:
-            error_code = move_item_whole(data, task);
+            error_code = move_item_whole(data, task, predicted);
             break;
         case MoveStrategy::InFragments:
-            error_code = move_item_in_fragments(data, task);
+            error_code = move_item_in_fragments(data, task, predicted);
     }
 
+    task.error_ = error_code;
+
     // If there was an error then fetch the errormessage and save it
     std::wstring error_string;
     if (error_code != NO_ERROR) { error_string = Str::system_error(error_code); }
 
-    // Fetch the new fragment map of the item and refresh the screen
+    // After a failed move the fragments of the item are unknown, they are always read from the volume
+    const bool is_predicted = error_code == NO_ERROR && predicted.has_value();
+    const bool verify = !is_predicted || data.move_executor_->verify_prediction(was_fragmented);
+
+    // Take the new fragment map of the item and refresh the screen
     colorize_disk_item(data, task.file_, 0, 0, true);
-    Tree::detach(data.item_tree_, task.file_);
 
-    const bool result = get_fragments(data, task.file_, task.file_handle_);
+    const lcn64_t old_lcn = task.file_->get_item_lcn();
+    bool result = true;
+
+    if (verify) {
+        result = data.move_executor_->read_fragments(data, task.file_, task.file_handle_);
+
+        if (result) {
+            if (is_predicted) data.move_executor_->observe_prediction(task.file_->fragments_ == predicted.value());
+
+            task.file_->fragments_predicted_ = false;
+        }
+    } else {
+        task.file_->fragments_ = std::move(predicted.value());
+        task.file_->fragments_predicted_ = true;
+    }
+
+    // The tree only changes if the first cluster of the item moved, for example not after a later chunk
+    if (task.file_->get_item_lcn() != old_lcn) Tree::reposition(data.item_tree_, data.tree_statistics_, task.file_);
 
-    Tree::insert(data.item_tree_, data.balance_count_, task.file_);
     colorize_disk_item(data, task.file_, 0, 0, false);
 
     // if windows reported an error while moving the item then show the error message and return false
@@ -327,10 +399,6 @@ bool DefragRunner::move_item_with_strat(DefragState &data, MoveTask &task,
 
 bool DefragRunner::move_item_try_strategies(DefragState &data, MoveTask &task,
                                             const MoveDirection direction) const {
-    lcn_extent_t cluster;
-
-    DefragGui *gui = DefragGui::get_instance();
-
     // Remember the current position on disk of the item
     const auto old_lcn = task.file_->get_item_lcn();
 
@@ -344,6 +412,15 @@ bool DefragRunner::move_item_try_strategies(DefragState &data, MoveTask &task,
     // If the block is not fragmented then return true
     if (!is_fragmented(task.file_, task.vcn_from_, task.count_)) return true;
 
+    return move_item_alternative(data, task, direction, old_lcn);
+}
+
+bool DefragRunner::move_item_alternative(DefragState &data, MoveTask &task, const MoveDirection direction,
+                                         const lcn64_t old_lcn) const {
+    lcn_extent_t cluster;
+
+    DefragGui *gui = DefragGui::get_instance();
+
     // Show debug message: "Windows could not move the file, trying alternative method."
     gui->show_debug(DebugLevel::DetailedProgress, task.file_,
                     L"Windows could not move the file, trying alternative method.");
@@ -387,6 +464,7 @@ bool DefragRunner::move_item_try_strategies(DefragState &data, MoveTask &task,
             up_task.lcn_to_ = cluster.begin();
 
             auto result = move_item_with_strat(data, up_task, MoveStrategy::InFragments);
+            task.error_ = up_task.error_;
 
             if (!result) return false;
             break;
@@ -396,6 +474,7 @@ bool DefragRunner::move_item_try_strategies(DefragState &data, MoveTask &task,
             down_task.lcn_to_ = cluster.end() - task.count_;
 
             auto result = move_item_with_strat(data, down_task, MoveStrategy::InFragments);
+            task.error_ = down_task.error_;
 
             if (!result) return false;
             break;
@@ -418,3 +497,46 @@ bool DefragRunner::move_item_try_strategies(DefragState &data, MoveTask &task,
     // Strategy 1 has helped. Move the Item again to where we want it, but this time use strategy InFragments.
     return move_item_with_strat(data, task, MoveStrategy::InFragments);
 }
+
+bool DefragRunner::verify_predicted_fragments(DefragState &data) const {
+    std::vector<FileNode *> predicted;
+
+    for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
+        if (item->fragments_predicted_) predicted.push_back(item);
+    }
+
+    bool result = true;
+
+    for (FileNode *item: predicted) {
+        HANDLE file_handle = data.move_executor_->open(data, item);
+
+        if (file_handle == nullptr) {
+            result = false;
+            continue;
+        }
+
+        // Read into a copy, if it fails the item keeps the fragments it has
+        FileNode actual = *item;
+        const bool refreshed = data.move_executor_->read_fragments(data, &actual, file_handle);
+
+        data.move_executor_->close(file_handle);
+
+        if (!refreshed) {
+            result = false;
+            continue;
+        }
+
+        const bool correct = actual.fragments_ == item->fragments_;
+
+        data.move_executor_->observe_prediction(correct);
+        item->fragments_predicted_ = false;
+
+        if (correct) continue;
+
+        item->fragments_ = std::move(actual.fragments_);
+        item->clusters_count_ = actual.clusters_count_;
+        Tree::reposition(data.item_tree_, data.tree_statistics_, item);
+    }
+
+    return result;
+}
@@ -19,6 +19,15 @@
 
 #include <time_util.h>
 
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+// Upper limit for the number of threads of the directory walker in scan_dir()
+constexpr size_t SCAN_DIR_MAX_THREADS = 16;
+
 // Calculate the beginning of the 3 zones.
 // Unmovable files pose an interesting problem. Suppose an unmovable file is in zone 1, then the calculation for the
 // beginning of zone 2 must count that file. But that changes the beginning of zone 2. Some unmovable files may now
@@ -397,14 +406,19 @@ int DefragRunner::compare_items(FileNode *item_1, FileNode *item_2, int sort_fie
     return 0;
 }
 
-// Scan all files in a directory and all it's subdirectories (recursive)
-// and store the information in a tree in memory for later use by the optimizer
-void DefragRunner::scan_dir(DefragState &data, const wchar_t *mask, FileNode *parent_directory) {
+// An item that was found by scan_dir_entries(), with the attributes that FindFirstFileW() returned for it
+struct ScannedItem {
+    std::unique_ptr<FileNode> item_;
+    DWORD attributes_;
+};
+
+// Scan the files in one directory, without its subdirectories. Every item that could be opened and whose
+// clustermap could be read is added to the list, the subdirectories among them still have to be scanned.
+// Only reads the volume and its own items, so several directories can be scanned at once on different threads.
+void DefragRunner::scan_dir_entries(const DefragState &data, const wchar_t *mask, FileNode *parent_directory,
+                                    PARAM_OUT std::vector<ScannedItem> &items) {
     DefragGui *gui = DefragGui::get_instance();
 
-    // Slow the program down to the percentage that was specified on the command line.
-    slow_down(data);
-
     // Determine the rootpath (base path of the directory) by stripping everything after the last backslash in the mask.
     // The FindFirstFile() system call only processes wildcards in the last section (i.e. after the last backslash).
     std::unique_ptr<wchar_t[]> root_path(_wcsdup(mask));
@@ -416,16 +430,6 @@ void DefragRunner::scan_dir(DefragState &data, const wchar_t *mask, FileNode *pa
     // Show debug message: "Analyzing: %s"
     gui->show_debug(DebugLevel::DetailedProgress, nullptr, std::format(L"Analyzing: {}", mask));
 
-    // Fetch the current time in the uint64_t format (1 second = 10000000)
-    SYSTEMTIME time_1;
-    FILETIME time_2;
-    GetSystemTime(&time_1);
-
-    filetime64_t system_time{};
-    if (SystemTimeToFileTime(&time_1, &time_2) == TRUE) {
-        system_time = from_FILETIME(time_2);
-    }
-
     /* Walk through all the files. If nothing found then exit.
     Note: I am using FindFirstFileW() instead of _findfirst() because the latter
     will crash (exit program) on files with badly formed dates. */
@@ -436,8 +440,6 @@ void DefragRunner::scan_dir(DefragState &data, const wchar_t *mask, FileNode *pa
         return;
     }
 
-    std::unique_ptr<FileNode> item;
-
     do {
         if (*data.running_ != RunningState::RUNNING) break;
 
@@ -451,7 +453,7 @@ void DefragRunner::scan_dir(DefragState &data, const wchar_t *mask, FileNode *pa
         }
 
         // Create new item
-        item = std::make_unique<FileNode>();
+        auto item = std::make_unique<FileNode>();
 
         size_t length = wcslen(root_path.get()) + wcslen(find_file_data.cFileName) + 2;
         _ASSERT(MAX_PATH > length);
@@ -485,76 +487,204 @@ void DefragRunner::scan_dir(DefragState &data, const wchar_t *mask, FileNode *pa
 
         if (!result) continue;
 
-        // Increment counters
-        data.count_all_files_ += 1;
-        data.count_all_bytes_ += item->bytes_;
-        data.count_all_clusters_ += item->clusters_count_;
+        items.push_back({.item_ = std::move(item), .attributes_ = find_file_data.dwFileAttributes});
+    } while (FindNextFileW(find_handle, &find_file_data) != 0);
+
+    FindClose(find_handle);
+}
 
-        if (is_fragmented(item.get(), 0, item->clusters_count_)) {
-            data.count_fragmented_items_ += 1;
-            data.count_fragmented_bytes_ += item->bytes_;
-            data.count_fragmented_clusters_ += item->clusters_count_;
-        }
+// Scan all files in a directory and all it's subdirectories and store the information in a tree in memory for later
+// use by the optimizer.
+//
+// The directories are scanned by a pool of threads. Every thread has its own deque of directories: it takes the
+// directory that it found last from the back of its own deque, and when that is empty it steals from the front of the
+// deque of another thread, where the directories are that are highest in the tree. The items are collected per thread
+// and added to the tree by this thread when all the threads are done.
+void DefragRunner::scan_dir(DefragState &data, const wchar_t *mask, FileNode *parent_directory) {
+    // The directories of one thread, and the items that it found
+    struct ScanDirWorker {
+        std::mutex mutex_;
+        std::deque<std::pair<std::wstring, FileNode *>> directories_;
+        std::vector<ScannedItem> items_;
+    };
+
+    DefragGui *gui = DefragGui::get_instance();
 
-        data.clusters_done_ += item->clusters_count_;
+    // Slowing down is done between the directories, and only works when there is a single thread
+    const size_t thread_count = data.speed_ > 0 && data.speed_ < 100
+                                ? 1
+                                : std::clamp<size_t>(std::thread::hardware_concurrency(), 1, SCAN_DIR_MAX_THREADS);
+    std::vector<ScanDirWorker> workers(thread_count);
+    // Number of directories that were found and are not scanned yet, the threads stop when it drops to zero
+    std::atomic<size_t> pending_directories = 1;
+    std::atomic<uint64_t> clusters_done = 0;
 
-        // Show progress message
-        gui->show_analyze(data, item.get());
+    workers[0].directories_.emplace_back(mask, parent_directory);
 
-        // If it's a directory then iterate subdirectories
-        if (item->is_dir_) {
-            data.count_directories_ += 1;
-            // length = wcslen(root_path.get()) + wcslen(find_file_data.cFileName) + 4;
-            auto temp_path = std::format(L"{}\\{}\\*", root_path.get(), find_file_data.cFileName);
-            scan_dir(data, temp_path.c_str(), item.get());
-        }
+    auto worker = [&](const size_t self) {
+        ScanDirWorker &own = workers[self];
+        std::vector<ScannedItem> found;
 
-        // Ignore the item if it has no clusters or no LCN. Very small files are stored in the MFT and are reported by
-        // Windows as having zero clusters and no fragments
-        if (item->clusters_count_ == 0 || item->fragments_.empty()) continue;
+        while (pending_directories > 0) {
+            std::optional<std::pair<std::wstring, FileNode *>> directory;
 
-        // Draw the item on the screen
-        colorize_disk_item(data, item.get(), 0, 0, false);
+            {
+                std::lock_guard<std::mutex> lock(own.mutex_);
 
-        // Show debug info about the file.
-        // Show debug message: "%I64d clusters at %I64d, %I64d bytes"
-        gui->show_debug(DebugLevel::DetailedFileInfo, item.get(),
-                        std::format(L"%I64d clusters at " NUM_FMT ", " NUM_FMT " bytes",
-                                    item->clusters_count_, item->get_item_lcn(), item->bytes_));
+                if (!own.directories_.empty()) {
+                    directory = std::move(own.directories_.back());
+                    own.directories_.pop_back();
+                }
+            }
+
+            for (size_t i = 1; i < thread_count && !directory.has_value(); i++) {
+                ScanDirWorker &victim = workers[(self + i) % thread_count];
+                std::lock_guard<std::mutex> lock(victim.mutex_);
+
+                if (!victim.directories_.empty()) {
+                    directory = std::move(victim.directories_.front());
+                    victim.directories_.pop_front();
+                }
+            }
+
+            // Nothing to do right now, but other threads may still find more directories
+            if (!directory.has_value()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+
+            if (data.is_still_running()) {
+                if (thread_count == 1) slow_down(data);
+
+                found.clear();
+                scan_dir_entries(data, directory->first.c_str(), directory->second, PARAM_OUT found);
+
+                for (auto &scanned: found) {
+                    if (scanned.item_->is_dir_) {
+                        std::lock_guard<std::mutex> lock(own.mutex_);
+
+                        own.directories_.emplace_back(std::format(L"{}\\*", scanned.item_->get_long_path()),
+                                                      scanned.item_.get());
+                        pending_directories++;
+                    }
+
+                    clusters_done += scanned.item_->clusters_count_;
+                    own.items_.push_back(std::move(scanned));
+                }
+            }
 
-        if ((find_file_data.dwFileAttributes & FILE_ATTRIBUTE_COMPRESSED) != 0) {
-            // Show debug message: "Special file attribute: Compressed"
-            gui->show_debug(DebugLevel::DetailedFileInfo, item.get(), L"Special file attribute: Compressed");
+            pending_directories--;
         }
+    };
 
-        if ((find_file_data.dwFileAttributes & FILE_ATTRIBUTE_ENCRYPTED) != 0) {
-            // Show debug message: "Special file attribute: Encrypted"
-            gui->show_debug(DebugLevel::DetailedFileInfo, item.get(), L"Special file attribute: Encrypted");
+    {
+        std::vector<std::thread> threads;
+
+        for (size_t i = 0; i < thread_count; i++) {
+            threads.emplace_back(worker, i);
         }
 
-        if ((find_file_data.dwFileAttributes & FILE_ATTRIBUTE_OFFLINE) != 0) {
-            // Show debug message: "Special file attribute: Offline"
-            gui->show_debug(DebugLevel::DetailedFileInfo, item.get(), L"Special file attribute: Offline");
+        // Update the progress percentage while the threads are working
+        while (pending_directories > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+            data.clusters_done_ = clusters_done;
+            gui->draw_cluster(data, 0, 0, DrawColor::Empty);
         }
 
-        if ((find_file_data.dwFileAttributes & FILE_ATTRIBUTE_READONLY) != 0) {
-            // Show debug message: "Special file attribute: Read-only"
-            gui->show_debug(DebugLevel::DetailedFileInfo, item.get(), L"Special file attribute: Read-only");
+        for (auto &thread: threads) {
+            thread.join();
         }
+    }
 
-        if ((find_file_data.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0) {
-            // Show debug message: "Special file attribute: Sparse-file"
-            gui->show_debug(DebugLevel::DetailedFileInfo, item.get(), L"Special file attribute: Sparse-file");
+    // Items without clusters or without a LCN are not added to the tree. Very small files are stored in the MFT and are
+    // reported by Windows as having zero clusters and no fragments. The items in such a directory lose their parent
+    // directory, they already have their full path.
+    std::unordered_set<const FileNode *> dropped;
+
+    for (auto &own: workers) {
+        for (auto &scanned: own.items_) {
+            if (scanned.item_->clusters_count_ == 0 || scanned.item_->fragments_.empty()) {
+                dropped.insert(scanned.item_.get());
+            }
         }
+    }
+
+    for (auto &own: workers) {
+        for (auto &scanned: own.items_) {
+            FileNode *item = scanned.item_.get();
+
+            if (dropped.contains(item->parent_directory_)) item->parent_directory_ = nullptr;
+
+            // Increment counters
+            data.count_all_files_ += 1;
+            data.count_all_bytes_ += item->bytes_;
+            data.count_all_clusters_ += item->clusters_count_;
 
-        if ((find_file_data.dwFileAttributes & FILE_ATTRIBUTE_TEMPORARY) != 0) {
-            // Show debug message: "Special file attribute: Temporary"
-            gui->show_debug(DebugLevel::DetailedFileInfo, item.get(), L"Special file attribute: Temporary");
+            if (is_fragmented(item, 0, item->clusters_count_)) {
+                data.count_fragmented_items_ += 1;
+                data.count_fragmented_bytes_ += item->bytes_;
+                data.count_fragmented_clusters_ += item->clusters_count_;
+            }
+
+            if (item->is_dir_) data.count_directories_ += 1;
         }
+    }
 
-        // Add the item to the ItemTree in memory
-        Tree::insert(data.item_tree_, data.balance_count_, item.release());
-    } while (FindNextFileW(find_handle, &find_file_data) != 0);
+    data.clusters_done_ = clusters_done;
 
-    FindClose(find_handle);
+    for (auto &own: workers) {
+        for (auto &scanned: own.items_) {
+            FileNode *item = scanned.item_.get();
+
+            if (dropped.contains(item)) continue;
+
+            // Draw the item on the screen
+            colorize_disk_item(data, item, 0, 0, false);
+
+            // Show debug info about the file.
+            // Show debug message: "%I64d clusters at %I64d, %I64d bytes"
+            gui->show_debug(DebugLevel::DetailedFileInfo, item,
+                            std::format(L"%I64d clusters at " NUM_FMT ", " NUM_FMT " bytes",
+                                        item->clusters_count_, item->get_item_lcn(), item->bytes_));
+
+            if ((scanned.attributes_ & FILE_ATTRIBUTE_COMPRESSED) != 0) {
+                // Show debug message: "Special file attribute: Compressed"
+                gui->show_debug(DebugLevel::DetailedFileInfo, item, L"Special file attribute: Compressed");
+            }
+
+            if ((scanned.attributes_ & FILE_ATTRIBUTE_ENCRYPTED) != 0) {
+                // Show debug message: "Special file attribute: Encrypted"
+                gui->show_debug(DebugLevel::DetailedFileInfo, item, L"Special file attribute: Encrypted");
+            }
+
+            if ((scanned.attributes_ & FILE_ATTRIBUTE_OFFLINE) != 0) {
+                // Show debug message: "Special file attribute: Offline"
+                gui->show_debug(DebugLevel::DetailedFileInfo, item, L"Special file attribute: Offline");
+            }
+
+            if ((scanned.attributes_ & FILE_ATTRIBUTE_READONLY) != 0) {
+                // Show debug message: "Special file attribute: Read-only"
+                gui->show_debug(DebugLevel::DetailedFileInfo, item, L"Special file attribute: Read-only");
+            }
+
+            if ((scanned.attributes_ & FILE_ATTRIBUTE_SPARSE_FILE) != 0) {
+                // Show debug message: "Special file attribute: Sparse-file"
+                gui->show_debug(DebugLevel::DetailedFileInfo, item, L"Special file attribute: Sparse-file");
+            }
+
+            if ((scanned.attributes_ & FILE_ATTRIBUTE_TEMPORARY) != 0) {
+                // Show debug message: "Special file attribute: Temporary"
+                gui->show_debug(DebugLevel::DetailedFileInfo, item, L"Special file attribute: Temporary");
+            }
+
+            // Add the item to the ItemTree in memory
+            Tree::insert(data.item_tree_, data.tree_statistics_, scanned.item_.release());
+        }
+    }
+
+    gui->show_analyze(data, nullptr);
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"Scanned " NUM_FMT " items on {} threads", data.count_all_files_, thread_count));
 }
@@ -98,3 +98,13 @@ auto ClusterMap::ensure_lcn_loaded(HANDLE handle, lcn64_t lcn) -> DWORD {
     if (!has_fragment_for_lcn(lcn)) { return load_lcn(handle, lcn); }
     return NO_ERROR;
 }
+
+auto ClusterMap::ensure_extent_loaded(HANDLE handle, lcn64_t lcn, cluster_count64_t count) -> DWORD {
+    for (lcn64_t fragment_lcn = get_fragment_start(lcn); fragment_lcn < lcn + count;
+         fragment_lcn += LCN_PER_BITMAP_FRAGMENT) {
+        const DWORD result_code = ensure_lcn_loaded(handle, fragment_lcn);
+        if (result_code != NO_ERROR) { return result_code; }
+    }
+
+    return NO_ERROR;
+}
@@ -46,12 +46,30 @@ public:
 
     auto ensure_lcn_loaded(HANDLE handle, lcn64_t lcn) -> DWORD;
 
+    /// Load the fragments of the drive bitmap for the clusters lcn...lcn + count
+    auto ensure_extent_loaded(HANDLE handle, lcn64_t lcn, cluster_count64_t count) -> DWORD;
+
+    /// Treat the whole bitmap as loaded, for a bitmap that is filled with mark() instead of from the volume
+    void set_loaded() { std::fill(availability_.begin(), availability_.end(), true); }
+
     /// Returns true if a cluster is in use (assumes the drive map was loaded)
     inline auto in_use(lcn64_t lcn) -> bool {
         _ASSERT(has_fragment_for_lcn(lcn));
         return cluster_map_[lcn] == ClusterMapValue::InUse;
     }
 
+    /// Returns true if all the clusters lcn...lcn + count are in use (assumes the drive map was loaded)
+    inline auto all_in_use(lcn64_t lcn, cluster_count64_t count) -> bool {
+        const auto begin = std::begin(cluster_map_) + lcn;
+        return std::find(begin, begin + count, ClusterMapValue::Free) == begin + count;
+    }
+
+    /// Returns the number of free clusters in lcn...lcn + count (assumes the drive map was loaded)
+    inline auto count_free(lcn64_t lcn, cluster_count64_t count) -> cluster_count64_t {
+        const auto begin = std::begin(cluster_map_) + lcn;
+        return (cluster_count64_t) std::count(begin, begin + count, ClusterMapValue::Free);
+    }
+
     static constexpr auto get_fragment_start(lcn64_t lcn) -> lcn64_t {
         return (lcn / LCN_PER_BITMAP_FRAGMENT) * LCN_PER_BITMAP_FRAGMENT;
     }
@@ -52,27 +52,43 @@
     }
 */
 bool ScanFAT::analyze_fat_volume(DefragState &defrag_state) {
+    DefragGui *gui = DefragGui::get_instance();
+
+    // All the reads go through the reader, which can also read an image file of a volume
+    auto volume_reader = VolumeReader::create(defrag_state.disk_.volume_name_.c_str(), defrag_state.disk_.is_image_,
+                                              FAT_READ_SLOTS);
+
+    if (volume_reader == nullptr) {
+        gui->show_debug(DebugLevel::Progress, nullptr,
+                        std::format(L"Cannot open volume '{}' for reading: {}", defrag_state.disk_.volume_name_,
+                                    Str::system_error(GetLastError())));
+        return false;
+    }
+
+    // reader_ is cleared again before the reader is closed
+    reader_ = volume_reader.get();
+
+    const bool result = analyze_fat_volume_read_items(defrag_state);
+
+    reader_ = nullptr;
+
+    return result;
+}
+
+bool ScanFAT::analyze_fat_volume_read_items(DefragState &defrag_state) {
     FatDiskInfoStruct disk_info{};
-    OVERLAPPED g_overlapped;
     DWORD bytes_read;
     size_t fat_size;
     BYTE *root_directory;
     uint64_t root_length;
-    int result;
     wchar_t s1[BUFSIZ];
     char s2[BUFSIZ];
     DefragGui *gui = DefragGui::get_instance();
 
     // Read the boot block from the disk
-    g_overlapped.Offset = 0;
-    g_overlapped.OffsetHigh = 0;
-    g_overlapped.hEvent = nullptr;
-
     FatBootSectorStruct boot_sector{};
-    result = ReadFile(defrag_state.disk_.volume_handle_, &boot_sector, sizeof(FatBootSectorStruct), &bytes_read,
-                      &g_overlapped);
 
-    if (result == 0 || bytes_read != 512) {
+    if (!reader_->read(0, (BYTE *) &boot_sector, sizeof(FatBootSectorStruct))) {
         gui->show_debug(DebugLevel::Progress, nullptr,
                         std::format(L"Error while reading bootblock: {}",
                                     Str::system_error(GetLastError())));
@@ -230,31 +246,33 @@ bool ScanFAT::analyze_fat_volume(DefragState &defrag_state) {
         fat_size = (size_t) (fat_size + disk_info.bytes_per_sector_ - fat_size % disk_info.bytes_per_sector_);
     }
 
-    disk_info.fat_data_.fat12 = new BYTE[fat_size];
+    auto fat_data = std::make_unique<BYTE[]>(fat_size);
 
-    ULARGE_INTEGER trans;
-    trans.QuadPart = boot_sector.bpb_rsvd_sec_cnt_ * disk_info.bytes_per_sector_;
-    g_overlapped.Offset = trans.LowPart;
-    g_overlapped.OffsetHigh = trans.HighPart;
-    g_overlapped.hEvent = nullptr;
+    const uint64_t fat_offset = (uint64_t) boot_sector.bpb_rsvd_sec_cnt_ * disk_info.bytes_per_sector_;
 
     gui->show_debug(DebugLevel::Progress, nullptr,
-                    std::format(L"Reading FAT, " NUM_FMT " bytes at offset=" NUM_FMT, fat_size, trans.QuadPart));
-
-    result = ReadFile(defrag_state.disk_.volume_handle_, disk_info.fat_data_.fat12, (uint32_t) fat_size,
-                      &bytes_read, &g_overlapped);
+                    std::format(L"Reading FAT, " NUM_FMT " bytes at offset=" NUM_FMT, fat_size, fat_offset));
 
-    if (result == 0) {
+    if (!reader_->read(fat_offset, fat_data.get(), fat_size)) {
         gui->show_debug(DebugLevel::Progress, nullptr,
                         std::format(L"Error: {}", Str::system_error(GetLastError())));
         return false;
     }
 
+    // Decode the FAT once, all the chains are followed in the decoded form. The raw FAT is not needed after this.
+    disk_info.chains_.decode(defrag_state.disk_.type_, fat_data.get(), fat_size, disk_info.countof_clusters_ + 1);
+    fat_data.reset();
+
     //ShowHex(Data,disk_info.FatData.FAT12,32);
 
+    // The directories are loaded breadth-first, the subdirectories of every directory that is analyzed are added
+    // to the queue. On FAT32 the root directory is a cluster chain like any other directory.
+    std::deque<FatPendingDirectory> pending;
+
     // Read the root directory from disk into memory
     if (defrag_state.disk_.type_ == DiskType::FAT32) {
-        root_directory = load_directory(defrag_state, &disk_info, boot_sector.fat32.bpb_root_clus_, &root_length);
+        disk_info.chains_.claim_head(boot_sector.fat32.bpb_root_clus_);
+        pending.push_back({.item_ = nullptr, .start_cluster_ = boot_sector.fat32.bpb_root_clus_});
     } else {
         uint64_t root_start;
         root_start = (boot_sector.bpb_rsvd_sec_cnt_ + boot_sector.bpb_num_fats_ * disk_info.fat_sz_) *
@@ -266,8 +284,6 @@ bool ScanFAT::analyze_fat_volume(DefragState &defrag_state) {
             gui->show_debug(DebugLevel::Progress, nullptr,
                             std::format(L"Root directory is too big, " NUM_FMT " bytes", root_length));
 
-            delete disk_info.fat_data_.fat12;
-
             return false;
         }
 
@@ -278,8 +294,6 @@ bool ScanFAT::analyze_fat_volume(DefragState &defrag_state) {
                                         root_start, (disk_info.countof_clusters_ + 1) * disk_info.sectors_per_cluster_ *
                                                     disk_info.bytes_per_sector_));
 
-            delete disk_info.fat_data_.fat12;
-
             return false;
         }
 
@@ -297,46 +311,54 @@ bool ScanFAT::analyze_fat_volume(DefragState &defrag_state) {
         root_directory = new BYTE[bytes_read];
 
         // Read data from disk
-        trans.QuadPart = root_start;
-
-        g_overlapped.Offset = trans.LowPart;
-        g_overlapped.OffsetHigh = trans.HighPart;
-        g_overlapped.hEvent = nullptr;
-
         gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
                         std::format(L"Reading root directory, " NUM_FMT " bytes at offset=" NUM_FMT, bytes_read,
-                                    trans.QuadPart));
+                                    root_start));
 
-        result = ReadFile(defrag_state.disk_.volume_handle_, root_directory, bytes_read, &bytes_read, &g_overlapped);
-
-        if (result == 0) {
+        if (!reader_->read(root_start, root_directory, bytes_read)) {
             gui->show_debug(DebugLevel::Progress, nullptr,
                             std::format(L"Error: {}", Str::system_error(GetLastError())));
-
-            delete disk_info.fat_data_.fat12;
             delete root_directory;
 
             return false;
         }
+
+        // Analyze all the items in the root directory and add to the item tree
+        analyze_fat_directory(defrag_state, &disk_info, root_directory, root_length, nullptr, PARAM_OUT pending);
+
+        // Cleanup
+        delete root_directory;
     }
 
-    // Analyze all the items in the root directory and add to the item tree
-    analyze_fat_directory(defrag_state, &disk_info, root_directory, root_length, nullptr);
+    const Clock::time_point directories_start = Clock::now();
 
-    // Cleanup
-    delete root_directory;
-    delete disk_info.fat_data_.fat12;
+    directories_loaded_ = 0;
+    load_directories(defrag_state, &disk_info, pending);
+    directories_time_ = Clock::now() - directories_start;
+
+    // The directory entries add the first clusters of the chains to the cross-links of the FAT itself
+    if (disk_info.chains_.cross_link_count() > 0) {
+        gui->show_debug(DebugLevel::Progress, nullptr,
+                        std::format(L"FAT has " NUM_FMT " cross-linked clusters, perhaps the disk is corrupted.",
+                                    disk_info.chains_.cross_link_count()));
+    }
+
+    defrag_state.disk_.bytes_read_ += reader_->bytes_read();
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"  Read " NUM_FMT " bytes in " NUM_FMT " reads", reader_->bytes_read(),
+                                reader_->read_count()));
 
     return true;
 }
 
 // Analyze a directory and add all the items to the item tree
 void ScanFAT::analyze_fat_directory(DefragState &data, FatDiskInfoStruct *disk_info, BYTE *buffer,
-                                    const uint64_t length, FileNode *parent_directory) {
+                                    const uint64_t length, FileNode *parent_directory,
+                                    PARAM_OUT std::deque<FatPendingDirectory> &pending) {
     wchar_t short_name[13];
     wchar_t long_name[820];
     UCHAR long_name_checksum;
-    uint64_t sub_dir_length;
     uint64_t start_cluster;
     int i;
     DefragGui *gui = DefragGui::get_instance();
@@ -512,11 +534,15 @@ void ScanFAT::analyze_fat_directory(DefragState &data, FatDiskInfoStruct *disk_i
             start_cluster = dir->dir_fst_clus_lo_;
         }
 
-        make_fragment_list(data, disk_info, item, start_cluster);
+        // Two entries with the same first cluster share their clusters, the FAT alone does not show that. The
+        // second entry is then reported as cross-linked by make_fragment_list().
+        disk_info->chains_.claim_head(start_cluster);
+        make_fragment_list(disk_info, item, start_cluster);
 
         item->creation_time_ = convert_time(dir->dir_crt_date_, dir->dir_crt_time_, dir->dir_crt_time_tenth_);
         item->mft_change_time_ = convert_time(dir->dir_wrt_date_, dir->dir_wrt_time_, 0);
         item->last_access_time_ = convert_time(dir->dir_lst_acc_date_, 0, 0);
+        item->inode_ = 0;
         item->parent_inode_ = 0;
         item->parent_directory_ = parent_directory;
         item->is_dir_ = false;
@@ -532,7 +558,7 @@ void ScanFAT::analyze_fat_directory(DefragState &data, FatDiskInfoStruct *disk_i
                                     item->bytes_));
 
         // Add the item record to the sorted item tree in memory
-        Tree::insert(data.item_tree_, data.balance_count_, item);
+        Tree::insert(data.item_tree_, data.tree_statistics_, item);
 
         // Draw the item on the screen
         gui->show_analyze(data, item);
@@ -553,15 +579,9 @@ void ScanFAT::analyze_fat_directory(DefragState &data, FatDiskInfoStruct *disk_i
             data.count_fragmented_clusters_ += item->clusters_count_;
         }
 
-        // If this is a directory then iterate
+        // If this is a directory then queue it, it is loaded together with the other directories of its level
         if (item->is_dir_) {
-            BYTE *sub_dir_buf = load_directory(data, disk_info, start_cluster, &sub_dir_length);
-
-            analyze_fat_directory(data, disk_info, sub_dir_buf, sub_dir_length, item);
-
-            delete sub_dir_buf;
-
-            gui->show_debug(DebugLevel::DetailedGapFinding, nullptr, L"Finished with subdirectory.");
+            pending.push_back({.item_ = item, .start_cluster_ = start_cluster});
         }
     }
 }
@@ -0,0 +1,203 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+// Decode the FAT in one sweep. Every entry becomes a cluster number, CHAIN_END or CHAIN_BROKEN, so the chains can
+// be followed without looking at the FAT type again.
+void FatChains::decode(const DiskType type, const BYTE *fat, const uint64_t fat_bytes, const uint64_t max_cluster) {
+    uint64_t entries;
+    uint32_t end_of_chain;
+
+    switch (type) {
+        case DiskType::FAT12:
+            entries = fat_bytes * 2 / 3;
+            end_of_chain = 0xFF8;
+            break;
+        case DiskType::FAT16:
+            entries = fat_bytes / sizeof(USHORT);
+            end_of_chain = 0xFFF8;
+            break;
+        default:
+            entries = fat_bytes / sizeof(ULONG);
+            end_of_chain = 0xFFFFFF8;
+            break;
+    }
+
+    entries = std::min<uint64_t>(entries, max_cluster + 1);
+    max_cluster_ = max_cluster;
+    cross_link_count_ = 0;
+
+    next_.assign(max_cluster + 1, CHAIN_BROKEN);
+    run_end_.resize(max_cluster + 1);
+    flags_.assign(max_cluster + 1, 0);
+
+    auto store = [&](const uint64_t cluster, const uint32_t value) {
+        if (value >= end_of_chain) {
+            next_[cluster] = CHAIN_END;
+        } else if (value >= 2 && value <= max_cluster) {
+            next_[cluster] = value;
+        }
+    };
+
+    switch (type) {
+        case DiskType::FAT12: {
+            // Two entries are packed in three bytes, they are unpacked together
+            uint64_t cluster = 0;
+
+            for (; cluster + 1 < entries; cluster += 2) {
+                const BYTE *packed = &fat[cluster / 2 * 3];
+
+                store(cluster, packed[0] | (packed[1] & 0x0F) << 8);
+                store(cluster + 1, packed[1] >> 4 | packed[2] << 4);
+            }
+
+            if (cluster < entries) {
+                const BYTE *packed = &fat[cluster / 2 * 3];
+
+                store(cluster, packed[0] | (packed[1] & 0x0F) << 8);
+            }
+
+            break;
+        }
+        case DiskType::FAT16:
+            for (uint64_t cluster = 0; cluster < entries; cluster++) {
+                store(cluster, ((const USHORT *) fat)[cluster]);
+            }
+
+            break;
+        default:
+            for (uint64_t cluster = 0; cluster < entries; cluster++) {
+                store(cluster, ((const ULONG *) fat)[cluster] & 0xFFFFFFF);
+            }
+
+            break;
+    }
+
+    // A cluster that is the next cluster of more than one other cluster is cross-linked
+    for (uint64_t cluster = 2; cluster <= max_cluster; cluster++) {
+        const uint32_t next = next_[cluster];
+
+        if (next >= CHAIN_BROKEN) continue;
+
+        if ((flags_[next] & CLUSTER_REFERENCED) == 0) {
+            flags_[next] |= CLUSTER_REFERENCED;
+        } else if ((flags_[next] & CLUSTER_CROSS_LINKED) == 0) {
+            flags_[next] |= CLUSTER_CROSS_LINKED;
+            cross_link_count_++;
+        }
+    }
+
+    // From the last cluster down, so the end of the run of the next cluster is already known, and whether the rest
+    // of that run has a cross-linked cluster
+    for (uint64_t cluster = max_cluster + 1; cluster-- > 0;) {
+        const uint32_t next = next_[cluster];
+
+        if (next == cluster + 1) {
+            run_end_[cluster] = run_end_[next];
+
+            if ((flags_[next] & CLUSTER_RUN_CROSS_LINKED) != 0) flags_[cluster] |= CLUSTER_RUN_CROSS_LINKED;
+        } else {
+            run_end_[cluster] = (uint32_t) cluster;
+        }
+
+        if ((flags_[cluster] & CLUSTER_CROSS_LINKED) != 0) flags_[cluster] |= CLUSTER_RUN_CROSS_LINKED;
+    }
+
+    find_loops();
+}
+
+// Follow the chains run by run from every cluster, marking the clusters on the way. A chain that comes back to a
+// cluster of the current walk loops, and so does every chain that runs into it. Every cluster is walked once.
+void FatChains::find_loops() {
+    std::vector<uint32_t> path;
+
+    for (uint64_t start = 2; start <= max_cluster_; start++) {
+        if ((flags_[start] & CLUSTER_DONE) != 0 || next_[start] == CHAIN_BROKEN) continue;
+
+        uint32_t cluster = (uint32_t) start;
+        bool loops = false;
+
+        path.clear();
+
+        while (true) {
+            if ((flags_[cluster] & CLUSTER_DONE) != 0) {
+                loops = (flags_[cluster] & CLUSTER_LOOPS) != 0;
+                break;
+            }
+
+            if ((flags_[cluster] & CLUSTER_VISITING) != 0) {
+                loops = true;
+                break;
+            }
+
+            flags_[cluster] |= CLUSTER_VISITING;
+            path.push_back(cluster);
+
+            const uint32_t next = next_[run_end_[cluster]];
+
+            if (next == CHAIN_END || next == CHAIN_BROKEN) break;
+
+            cluster = next;
+        }
+
+        for (auto visited: path) {
+            flags_[visited] = (flags_[visited] & ~CLUSTER_VISITING) | CLUSTER_DONE | (loops ? CLUSTER_LOOPS : 0);
+        }
+    }
+}
+
+bool FatChains::claim_head(const uint64_t cluster) {
+    if (cluster < 2 || cluster > max_cluster_) return false;
+
+    if ((flags_[cluster] & CLUSTER_REFERENCED) == 0) {
+        flags_[cluster] |= CLUSTER_REFERENCED;
+        return false;
+    }
+
+    if ((flags_[cluster] & CLUSTER_CROSS_LINKED) == 0) {
+        flags_[cluster] |= CLUSTER_CROSS_LINKED | CLUSTER_RUN_CROSS_LINKED;
+        cross_link_count_++;
+    }
+
+    return true;
+}
+
+FatChainStatus FatChains::walk(uint64_t cluster, PARAM_OUT std::vector<FatRun> &runs,
+                               PARAM_OUT bool &cross_linked) const {
+    runs.clear();
+    cross_linked = false;
+
+    if (cluster < 2 || cluster > max_cluster_) return FatChainStatus::Broken;
+    if ((flags_[cluster] & CLUSTER_LOOPS) != 0) return FatChainStatus::Loops;
+
+    // The chain is known to end, so this terminates
+    while (true) {
+        const uint32_t run_end = run_end_[cluster];
+
+        if ((flags_[cluster] & CLUSTER_RUN_CROSS_LINKED) != 0) cross_linked = true;
+
+        runs.push_back({.first_cluster_ = cluster, .count_ = run_end - cluster + 1});
+
+        const uint32_t next = next_[run_end];
+
+        if (next == CHAIN_END) return FatChainStatus::Ok;
+        if (next == CHAIN_BROKEN) return FatChainStatus::Broken;
+
+        cluster = next;
+    }
+}
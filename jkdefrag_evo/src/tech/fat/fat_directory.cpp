@@ -17,177 +17,187 @@
 
 #include "precompiled_header.h"
 
+#include <algorithm>
+
 /**
- * \brief Load a directory from disk into a new memory buffer.
- * \return Return nullptr if error. Note: the caller owns the returned buffer.
+ * \brief Load the pending directories breadth-first and analyze them. The subdirectories that are found are added
+ * to the back of the queue, so the directories of one level are loaded together.
+ *
+ * A batch of directories is taken from the front of the queue. The cluster runs of all the directories in the
+ * batch are sorted by their position on disk, runs that are next to each other are merged into one read, and the
+ * reads are started with at most slot_count() of them in flight. A directory is analyzed as soon as all of its runs
+ * have been read, while the next reads of the batch are still in flight.
  */
-BYTE *
-ScanFAT::load_directory(const DefragState &data, const FatDiskInfoStruct *disk_info, const uint64_t start_cluster,
-                        uint64_t *out_length) {
-    std::unique_ptr<BYTE[]> buffer;
-    uint64_t fragment_length;
-    OVERLAPPED g_overlapped;
-    DWORD bytes_read;
-    int max_iterate;
-    wchar_t s1[BUFSIZ];
-    DefragGui *gui = DefragGui::get_instance();
-
-    // Reset the OutLength to zero, in case we exit for an error
-    if (out_length != nullptr) *out_length = 0;
-
-    // If cluster is zero then return nullptr
-    if (start_cluster == 0) return nullptr;
-
-    // Count the size of the directory
-    uint64_t buffer_length = 0;
-    uint64_t cluster = start_cluster;
+void ScanFAT::load_directories(DefragState &data, FatDiskInfoStruct *disk_info,
+                               std::deque<FatPendingDirectory> &pending) {
+    // A directory of the batch, and how many of its runs have yet to be read
+    struct LoadedDirectory {
+        FileNode *item_;
+        std::unique_ptr<BYTE[]> buffer_;
+        uint64_t length_;
+        size_t runs_left_;
+        bool failed_;
+    };
+
+    // A run of clusters of a directory, and where it goes in the buffer of the directory
+    struct DirectoryRun {
+        size_t directory_;
+        uint64_t disk_offset_;
+        uint64_t buffer_offset_;
+        uint64_t length_;
+    };
+
+    // One read of runs that are next to each other on disk
+    struct MergedRead {
+        uint64_t offset_;
+        uint64_t length_;
+        size_t first_run_;
+        size_t run_count_;
+        std::unique_ptr<BYTE[]> buffer_;
+        bool started_;
+    };
 
-    for (max_iterate = 0; max_iterate < disk_info->countof_clusters_ + 1; max_iterate++) {
-        // Exit the loop when we have reached the end of the cluster list
-        if (data.disk_.type_ == DiskType::FAT12 && cluster >= 0xFF8) break;
-        if (data.disk_.type_ == DiskType::FAT16 && cluster >= 0xFFF8) break;
-        if (data.disk_.type_ == DiskType::FAT32 && cluster >= 0xFFFFFF8) break;
-
-        // Sanity check, test if the cluster is within the range of valid cluster numbers
-        if (cluster < 2) return nullptr;
-        if (cluster > disk_info->countof_clusters_ + 1) return nullptr;
+    DefragGui *gui = DefragGui::get_instance();
+    const uint64_t bytes_per_cluster = disk_info->sectors_per_cluster_ * disk_info->bytes_per_sector_;
+    const size_t slots = reader_->slot_count();
+    std::vector<FatRun> chain;
+    bool cross_linked;
+
+    while (!pending.empty() && data.is_still_running()) {
+        std::vector<LoadedDirectory> directories;
+        std::vector<DirectoryRun> runs;
+        uint64_t batch_length = 0;
+
+        // Take a batch of directories from the front of the queue, and collect their runs
+        while (!pending.empty() && batch_length < FAT_DIRECTORY_BATCH_SIZE) {
+            const FatPendingDirectory directory = pending.front();
+
+            pending.pop_front();
+
+            if (directory.start_cluster_ == 0) continue;
+
+            switch (disk_info->chains_.walk(directory.start_cluster_, PARAM_OUT chain, PARAM_OUT cross_linked)) {
+                case FatChainStatus::Ok:
+                    break;
+                case FatChainStatus::Loops:
+                    gui->show_debug(DebugLevel::Progress, nullptr,
+                                    L"Infinite loop in FAT detected, perhaps the disk is corrupted.");
+                    continue;
+                case FatChainStatus::Broken:
+                    continue;
+            }
 
-        // Increment the BufferLength counter
-        buffer_length = buffer_length + disk_info->sectors_per_cluster_ * disk_info->bytes_per_sector_;
+            uint64_t length = 0;
 
-        // Get next cluster from FAT
-        switch (data.disk_.type_) {
-            case DiskType::FAT12:
-                if ((cluster & 1) == 1) {
-                    cluster = *(WORD *) &disk_info->fat_data_.fat12[cluster + cluster / 2] >> 4;
-                } else {
-                    cluster = *(WORD *) &disk_info->fat_data_.fat12[cluster + cluster / 2] & 0xFFF;
-                }
-                break;
-
-            case DiskType::FAT16:
-                cluster = disk_info->fat_data_.fat16[cluster];
-                break;
-            case DiskType::FAT32:
-                cluster = disk_info->fat_data_.fat32[cluster] & 0xFFFFFFF;
-                break;
-        }
-    }
-
-    // If too many iterations (infinite loop in FAT) then return nullptr
-    if (max_iterate >= disk_info->countof_clusters_ + 1) {
-        gui->show_debug(DebugLevel::Progress, nullptr,
-                        L"Infinite loop in FAT detected, perhaps the disk is corrupted.");
+            for (auto &run: chain) {
+                length += run.count_ * bytes_per_cluster;
+            }
 
-        return nullptr;
-    }
+            if (length > UINT_MAX) {
+                gui->show_debug(DebugLevel::Progress, nullptr,
+                                std::format(L"Directory is too big, " NUM_FMT " bytes", length));
+                continue;
+            }
 
-    // Allocate buffer
-    if (buffer_length > UINT_MAX) {
-        gui->show_debug(DebugLevel::Progress, nullptr,
-                        std::format(L"Directory is too big, " NUM_FMT " bytes", buffer_length));
+            uint64_t buffer_offset = 0;
 
-        return nullptr;
-    }
+            for (auto &run: chain) {
+                runs.push_back({
+                        .directory_ = directories.size(),
+                        .disk_offset_ = (disk_info->first_data_sector_ +
+                                         (run.first_cluster_ - 2) * disk_info->sectors_per_cluster_) *
+                                        disk_info->bytes_per_sector_,
+                        .buffer_offset_ = buffer_offset,
+                        .length_ = run.count_ * bytes_per_cluster,
+                });
 
-    buffer = std::make_unique<BYTE[]>(buffer_length);
+                buffer_offset += run.count_ * bytes_per_cluster;
+            }
 
-    // Loop through the FAT cluster list and load all fragments from disk into the buffer.
-    uint64_t buffer_offset = 0;
-    cluster = start_cluster;
+            directories.push_back({
+                    .item_ = directory.item_,
+                    .buffer_ = std::make_unique<BYTE[]>(length),
+                    .length_ = length,
+                    .runs_left_ = chain.size(),
+                    .failed_ = false,
+            });
 
-    uint64_t first_cluster = cluster;
-    uint64_t last_cluster = 0;
+            batch_length += length;
+        }
 
-    for (max_iterate = 0; max_iterate < disk_info->countof_clusters_ + 1; max_iterate++) {
-        // Exit the loop when we have reached the end of the cluster list
-        if (data.disk_.type_ == DiskType::FAT12 && cluster >= 0xFF8) break;
-        if (data.disk_.type_ == DiskType::FAT16 && cluster >= 0xFFF8) break;
-        if (data.disk_.type_ == DiskType::FAT32 && cluster >= 0xFFFFFF8) break;
+        // Sort the runs by their position on disk, and merge the runs that are next to each other into one read
+        std::sort(runs.begin(), runs.end(), [](const DirectoryRun &a, const DirectoryRun &b) {
+            return a.disk_offset_ < b.disk_offset_;
+        });
+
+        std::vector<MergedRead> reads;
+
+        for (size_t i = 0; i < runs.size(); i++) {
+            if (!reads.empty() &&
+                reads.back().offset_ + reads.back().length_ == runs[i].disk_offset_ &&
+                reads.back().length_ + runs[i].length_ <= FAT_MAX_READ_SIZE) {
+                reads.back().length_ += runs[i].length_;
+                reads.back().run_count_++;
+            } else {
+                reads.push_back({
+                        .offset_ = runs[i].disk_offset_,
+                        .length_ = runs[i].length_,
+                        .first_run_ = i,
+                        .run_count_ = 1,
+                });
+            }
+        }
 
-        // Sanity check, test if the cluster is within the range of valid cluster numbers
-        if (cluster < 2) break;
-        if (cluster > disk_info->countof_clusters_ + 1) break;
+        gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
+                        std::format(L"Reading " NUM_FMT " directories, " NUM_FMT " bytes in " NUM_FMT " reads",
+                                    directories.size(), batch_length, reads.size()));
 
-        /* If this is a new fragment then load the previous fragment from disk. If not then
-        add to the counters and continue. */
-        if (cluster != last_cluster + 1 && last_cluster != 0) {
-            fragment_length =
-                    (last_cluster - first_cluster + 1) * disk_info->sectors_per_cluster_ * disk_info->bytes_per_sector_;
-            ULARGE_INTEGER trans;
-            trans.QuadPart =
-                    (disk_info->first_data_sector_ + (first_cluster - 2) * disk_info->sectors_per_cluster_) *
-                    disk_info->bytes_per_sector_;
+        // The reads finish in the order they were started, so the slot of a read is its index modulo the number of
+        // slots. All the reads that were started are finished, even when the analysis is stopped.
+        size_t started = 0;
 
-            g_overlapped.Offset = trans.LowPart;
-            g_overlapped.OffsetHigh = trans.HighPart;
-            g_overlapped.hEvent = nullptr;
+        for (size_t finished = 0; finished < reads.size(); finished++) {
+            for (; started < reads.size() && started < finished + slots; started++) {
+                MergedRead &read = reads[started];
 
-            gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
-                            std::format(L"Reading directory fragment, " NUM_FMT " bytes at offset=" NUM_FMT,
-                                        fragment_length, trans.QuadPart));
+                read.buffer_ = std::make_unique<BYTE[]>(read.length_);
+                read.started_ = reader_->begin_read(started % slots, read.offset_, read.buffer_.get(),
+                                                    (size_t) read.length_);
+            }
 
-            BOOL result = ReadFile(data.disk_.volume_handle_, &buffer[buffer_offset], (uint32_t) fragment_length,
-                                   &bytes_read, &g_overlapped);
+            MergedRead &read = reads[finished];
+            const bool ok = read.started_ && reader_->finish_read(finished % slots);
 
-            if (result == FALSE) {
+            if (!ok) {
                 gui->show_debug(DebugLevel::Progress, nullptr,
-                                std::format(L"Error: {}", Str::system_error(GetLastError())));
-                return nullptr;
+                                std::format(L"Error while reading directory at offset=" NUM_FMT ": {}", read.offset_,
+                                            Str::system_error(GetLastError())));
             }
 
-            buffer_offset = buffer_offset + fragment_length;
-            first_cluster = cluster;
-        }
-
-        last_cluster = cluster;
+            // Copy the runs into their directories, and analyze every directory that is now complete
+            for (size_t i = read.first_run_; i < read.first_run_ + read.run_count_; i++) {
+                const DirectoryRun &run = runs[i];
+                LoadedDirectory &directory = directories[run.directory_];
 
-        // Get next cluster from FAT
-        switch (data.disk_.type_) {
-            case DiskType::FAT12:
-                if ((cluster & 1) == 1) {
-                    cluster = *(WORD *) &disk_info->fat_data_.fat12[cluster + cluster / 2] >> 4;
+                if (ok) {
+                    memcpy(&directory.buffer_[run.buffer_offset_], &read.buffer_[run.disk_offset_ - read.offset_],
+                           run.length_);
                 } else {
-                    cluster = *(WORD *) &disk_info->fat_data_.fat12[cluster + cluster / 2] & 0xFFF;
+                    directory.failed_ = true;
                 }
 
-                break;
-            case DiskType::FAT16:
-                cluster = disk_info->fat_data_.fat16[cluster];
-                break;
-            case DiskType::FAT32:
-                cluster = disk_info->fat_data_.fat32[cluster] & 0xFFFFFFF;
-                break;
-        }
-    }
-
-    // Load the last fragment
-    if (last_cluster != 0) {
-        fragment_length =
-                (last_cluster - first_cluster + 1) * disk_info->sectors_per_cluster_ * disk_info->bytes_per_sector_;
-        ULARGE_INTEGER trans;
-        trans.QuadPart =
-                (disk_info->first_data_sector_ + (first_cluster - 2) * disk_info->sectors_per_cluster_)
-                * disk_info->bytes_per_sector_;
-
-        g_overlapped.Offset = trans.LowPart;
-        g_overlapped.OffsetHigh = trans.HighPart;
-        g_overlapped.hEvent = nullptr;
+                if (--directory.runs_left_ > 0) continue;
 
-        gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
-                        std::format(L"reading directory fragment, " NUM_FMT " bytes at offset=" NUM_FMT,
-                                    fragment_length, trans.QuadPart));
+                if (!directory.failed_) {
+                    directories_loaded_++;
+                    analyze_fat_directory(data, disk_info, directory.buffer_.get(), directory.length_,
+                                          directory.item_, PARAM_OUT pending);
+                }
 
-        BOOL result = ReadFile(data.disk_.volume_handle_, &buffer[buffer_offset], (uint32_t) fragment_length,
-                               &bytes_read, &g_overlapped);
+                directory.buffer_.reset();
+            }
 
-        if (result == FALSE) {
-            gui->show_debug(DebugLevel::Progress, nullptr,
-                            std::format(L"Error: {}", Str::system_error(GetLastError())));
-            return nullptr;
+            read.buffer_.reset();
         }
     }
-
-    if (out_length != nullptr) *out_length = buffer_length;
-    return buffer.release();
 }
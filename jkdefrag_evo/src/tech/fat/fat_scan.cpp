@@ -64,12 +64,9 @@ filetime64_t ScanFAT::convert_time(const USHORT date, const USHORT time, const U
 // and next cluster numbers are recorded in the FAT, which is simply an array of "next"
 // cluster numbers.
 // - A zero-length file has a first cluster number of 0.
-// - The FAT contains either an EOC mark (End Of Clusterchain) or the cluster number of
-// the next cluster of the file.
-void ScanFAT::make_fragment_list(const DefragState &data, const FatDiskInfoStruct *disk_info,
-                                 FileNode *item, uint64_t cluster) {
-    int max_iterate;
-
+// - The chain is followed through the decoded FAT a run of contiguous clusters at a time,
+// every run is a fragment.
+void ScanFAT::make_fragment_list(const FatDiskInfoStruct *disk_info, FileNode *item, const uint64_t cluster) {
     DefragGui *gui = DefragGui::get_instance();
 
     item->clusters_count_ = 0;
@@ -78,78 +75,33 @@ void ScanFAT::make_fragment_list(const DefragState &data, const FatDiskInfoStruc
     // If cluster is zero then return zero
     if (cluster == 0) return;
 
-    // Loop through the FAT cluster list, counting the clusters and creating items in the fragment list
-    lcn64_t first_cluster = cluster;
-    lcn64_t last_cluster = 0;
-    vcn64_t vcn = 0;
+    std::vector<FatRun> runs;
+    bool cross_linked;
 
-    for (max_iterate = 0; max_iterate < disk_info->countof_clusters_ + 1; max_iterate++) {
-        // Exit the loop when we have reached the end of the cluster list
-        if (data.disk_.type_ == DiskType::FAT12 && cluster >= 0xFF8) break;
-        if (data.disk_.type_ == DiskType::FAT16 && cluster >= 0xFFF8) break;
-        if (data.disk_.type_ == DiskType::FAT32 && cluster >= 0xFFFFFF8) break;
-
-        // Sanity check, test if the cluster is within the range of valid cluster numbers
-        if (cluster < 2) break;
-        if (cluster > disk_info->countof_clusters_ + 1) break;
-
-        // Increment the cluster counter
-        item->clusters_count_ += 1;
-
-        // If this is a new fragment then create a record for the previous fragment.
-        // If not then add the cluster to the counters and continue
-        if (cluster != last_cluster + 1 && last_cluster != 0) {
-            vcn = vcn + last_cluster - first_cluster + 1;
-
-            FileFragment new_fragment = {
-                    .lcn_ = first_cluster - 2,
-                    .next_vcn_ = vcn,
-            };
-
-            item->fragments_.push_back(new_fragment);
-            first_cluster = cluster;
-        }
-
-        last_cluster = cluster;
-
-        // Get next cluster from FAT
-        switch (data.disk_.type_) {
-            case DiskType::FAT12:
-                if ((cluster & 1) == 1) {
-                    cluster = *(WORD *) &disk_info->fat_data_.fat12[cluster + cluster / 2] >> 4;
-                } else {
-                    cluster = *(WORD *) &disk_info->fat_data_.fat12[cluster + cluster / 2] & 0xFFF;
-                }
-
-                break;
-
-            case DiskType::FAT16:
-                cluster = disk_info->fat_data_.fat16[cluster];
-                break;
-            case DiskType::FAT32:
-                cluster = disk_info->fat_data_.fat32[cluster] & 0xFFFFFFF;
-                break;
-            default:
-                _ASSERT(false); // should not occur
-        }
-    }
-
-    // If too many iterations (infinite loop in FAT) then exit
-    if (max_iterate >= disk_info->countof_clusters_ + 1) {
+    if (disk_info->chains_.walk(cluster, PARAM_OUT runs, PARAM_OUT cross_linked) == FatChainStatus::Loops) {
         gui->show_debug(DebugLevel::Progress, nullptr,
                         L"Infinite loop in FAT detected, perhaps the disk is corrupted.");
 
         return;
     }
 
-    // Create the last fragment
-    if (last_cluster != 0) {
-        vcn = vcn + last_cluster - first_cluster + 1;
+    if (cross_linked) {
+        gui->show_debug(DebugLevel::Progress, nullptr,
+                        std::format(L"Cross-linked cluster chain starting at cluster " NUM_FMT
+                                    ", perhaps the disk is corrupted.", cluster));
+    }
+
+    vcn64_t vcn = 0;
+
+    for (auto &run: runs) {
+        item->clusters_count_ += run.count_;
+        vcn += run.count_;
 
         FileFragment new_fragment = {
-                .lcn_ = first_cluster - 2,
+                .lcn_ = run.first_cluster_ - 2,
                 .next_vcn_ = vcn,
         };
+
         item->fragments_.push_back(new_fragment);
     }
 }
@@ -37,6 +37,16 @@ void FileNode::set_names(const wchar_t *long_path, const wchar_t *long_filename,
     }
 }
 
+void FileNode::set_filenames(std::wstring &&long_filename, std::wstring &&short_filename) {
+    if (long_filename == short_filename) {
+        this->short_filename_ = std::nullopt;
+    } else {
+        this->short_filename_ = std::move(short_filename);
+    }
+
+    this->long_filename_ = std::move(long_filename);
+}
+
 FileNode::~FileNode() {
     // fragments_.clear();
 }
@@ -0,0 +1,215 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+#include <array>
+
+// Number of the most fragmented items whose run lists the decoder is measured on, and how often every list is
+// decoded
+constexpr size_t RUN_BENCHMARK_ITEMS = 1000;
+constexpr size_t RUN_BENCHMARK_ROUNDS = 100;
+
+// Encode the fragments of an item as NTFS mapping pairs, every field as small as its value allows
+static void encode_runs(const FileNode *item, PARAM_OUT std::vector<BYTE> &run_data) {
+    vcn64_t vcn = 0;
+    lcn64_t lcn = 0;
+
+    run_data.clear();
+
+    for (auto &fragment: item->fragments_) {
+        const auto length = (uint64_t) (fragment.next_vcn_ - vcn);
+        const int64_t delta = fragment.is_virtual() ? 0 : fragment.lcn_ - lcn;
+
+        uint8_t length_size = 1;
+
+        while (length_size < 8 && (length >> (length_size * 8)) != 0) length_size++;
+
+        // A virtual run has no offset field. The offset is signed, the top bit of its last byte is the sign.
+        uint8_t offset_size = 0;
+
+        if (!fragment.is_virtual()) {
+            offset_size = 1;
+
+            while (offset_size < 8 && (delta < -(1LL << (offset_size * 8 - 1)) ||
+                                       delta >= (1LL << (offset_size * 8 - 1)))) {
+                offset_size++;
+            }
+
+            lcn = fragment.lcn_;
+        }
+
+        run_data.push_back((BYTE) (length_size | offset_size << 4));
+
+        for (uint8_t i = 0; i < length_size; i++) run_data.push_back((BYTE) (length >> (i * 8)));
+        for (uint8_t i = 0; i < offset_size; i++) run_data.push_back((BYTE) ((uint64_t) delta >> (i * 8)));
+
+        vcn = fragment.next_vcn_;
+    }
+
+    run_data.push_back(0);
+}
+
+// Return true if the runs are the fragments of the item
+static bool runs_match(const FileNode *item, const std::vector<NtfsRun> &runs) {
+    if (runs.size() != item->fragments_.size()) return false;
+
+    vcn64_t vcn = 0;
+    auto run = runs.begin();
+
+    for (auto &fragment: item->fragments_) {
+        if (run->vcn_ != vcn || run->length_ != (cluster_count64_t) (fragment.next_vcn_ - vcn)) return false;
+        if (fragment.is_virtual() ? !run->is_virtual_ : run->lcn_ != fragment.lcn_) return false;
+
+        vcn = fragment.next_vcn_;
+        ++run;
+    }
+
+    return true;
+}
+
+// Measure the run decoder on the run lists of the most fragmented items of the image, encoded again from their
+// fragments. The first round is checked against the fragments.
+static void benchmark_run_decoder(const DefragState &data) {
+    DefragGui *gui = DefragGui::get_instance();
+    std::vector<const FileNode *> items;
+
+    for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
+        if (item->fragments_.size() > 1) items.push_back(item);
+    }
+
+    if (items.empty()) return;
+
+    const size_t count = std::min(items.size(), RUN_BENCHMARK_ITEMS);
+
+    std::partial_sort(items.begin(), items.begin() + (ptrdiff_t) count, items.end(),
+                      [](const FileNode *a, const FileNode *b) {
+                          return a->fragments_.size() > b->fragments_.size();
+                      });
+    items.resize(count);
+
+    std::vector<std::vector<BYTE>> run_lists(count);
+    uint64_t mismatches = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        encode_runs(items[i], PARAM_OUT run_lists[i]);
+
+        std::vector<NtfsRun> decoded;
+        std::array<NtfsRun, NTFS_RUN_BATCH> runs{};
+        NtfsRunDecoder decoder(run_lists[i].data(), (uint32_t) run_lists[i].size(), 0);
+
+        while (const size_t decoded_count = decoder.decode(runs)) {
+            decoded.insert(decoded.end(), runs.begin(), runs.begin() + (ptrdiff_t) decoded_count);
+        }
+
+        if (decoder.is_corrupt() || !runs_match(items[i], decoded)) mismatches++;
+    }
+
+    // The sum of the lcns keeps the decoding from being optimized away
+    uint64_t total_runs = 0;
+    uint64_t lcn_sum = 0;
+    const Clock::time_point start_time = Clock::now();
+
+    for (size_t round = 0; round < RUN_BENCHMARK_ROUNDS; round++) {
+        for (auto &run_list: run_lists) {
+            std::array<NtfsRun, NTFS_RUN_BATCH> runs{};
+            NtfsRunDecoder decoder(run_list.data(), (uint32_t) run_list.size(), 0);
+
+            while (const size_t decoded_count = decoder.decode(runs)) {
+                total_runs += decoded_count;
+                lcn_sum += (uint64_t) runs[decoded_count - 1].lcn_;
+            }
+        }
+    }
+
+    const auto elapsed_us = std::max<int64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start_time).count(), 1);
+
+    gui->show_always(std::format(
+            L"Run decoder: " NUM_FMT " run lists of the most fragmented items, " NUM_FMT " do not match their "
+            "fragments, " NUM_FMT " runs decoded in " NUM_FMT " us, " NUM_FMT " runs per second (check " NUM_FMT ")",
+            count, mismatches, total_runs, elapsed_us, total_runs * 1000000 / (uint64_t) elapsed_us, lcn_sum & 0xFF));
+}
+
+// Analyze an image file of an NTFS or FAT volume. Nothing is moved, the image is only read, so this gives a
+// repeatable measurement of the scanners that does not depend on the volumes of this computer.
+void DefragRunner::analyze_image_sync(const wchar_t *image_path, RunningState *run_state) {
+    DefragGui *gui = DefragGui::get_instance();
+    DefragState data{};
+
+    RunningState default_running;
+    if (run_state == nullptr) {
+        data.running_ = &default_running;
+    } else {
+        data.running_ = run_state;
+    }
+
+    *data.running_ = RunningState::RUNNING;
+
+    gui->clear_screen(std::format(L"Analyzing image '{}'", image_path));
+
+    data.disk_.volume_name_ = image_path;
+    data.disk_.is_image_ = true;
+
+    const Clock::time_point start_time = Clock::now();
+
+    bool result = ScanNTFS::get_instance()->analyze_ntfs_volume(data);
+
+    if (!result && data.is_still_running()) {
+        result = ScanFAT::get_instance()->analyze_fat_volume(data);
+    }
+
+    const auto elapsed_ms = std::max<int64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time).count(), 1);
+
+    if (result) {
+        uint64_t items = 0;
+
+        for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
+            items++;
+        }
+
+        PROCESS_MEMORY_COUNTERS memory_counters{};
+        GetProcessMemoryInfo(GetCurrentProcess(), &memory_counters, sizeof memory_counters);
+
+        gui->show_always(std::format(
+                L"Analyzed image '{}': " NUM_FMT " items in " NUM_FMT " ms, " NUM_FMT " items per second, "
+                NUM_FMT " bytes read, peak memory " NUM_FMT " bytes",
+                image_path, items, elapsed_ms, items * 1000 / elapsed_ms, data.disk_.bytes_read_,
+                memory_counters.PeakWorkingSetSize));
+
+        if (data.disk_.type_ == DiskType::NTFS) {
+            benchmark_run_decoder(data);
+        } else {
+            const ScanFAT *scan_fat = ScanFAT::get_instance();
+            const auto directories_ms = std::max<int64_t>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(scan_fat->directories_time()).count(), 1);
+
+            gui->show_always(std::format(
+                    L"FAT directories: " NUM_FMT " loaded in " NUM_FMT " ms, " NUM_FMT " directories per second",
+                    scan_fat->directories_loaded(), directories_ms,
+                    scan_fat->directories_loaded() * 1000 / directories_ms));
+        }
+    } else {
+        gui->show_always(std::format(L"Image '{}' is not an NTFS or FAT volume, or it cannot be read",
+                                     image_path));
+    }
+
+    Tree::delete_tree(data.item_tree_);
+
+    *data.running_ = RunningState::STOPPED;
+}
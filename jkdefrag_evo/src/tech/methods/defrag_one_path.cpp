@@ -43,11 +43,21 @@ void DefragRunner::defrag_one_path(DefragState &defrag_state, const wchar_t *tar
     // Clear the screen and show "Processing '%s'" message
     gui->clear_screen(std::format(L"Processing {}", target_path));
 
+    // The journal of the moves is opened for this volume at the first move, the clock runs until then
+    defrag_state.move_journal_.start();
+    defrag_state.resume_cursor_ = std::nullopt;
+
     try_request_privileges();
 
     if (!defrag_one_path_mountpoint_setup(defrag_state, target_path)) return;
 
     defrag_one_path_count_clusters(defrag_state);
+    defrag_one_path_query_seek_penalty(defrag_state);
+
+    // The chunk size and the alignment of partial moves are learned again for every volume, and the statistics of
+    // the moves are of this volume
+    defrag_state.disk_.partial_move_alignment_ = 1;
+    defrag_state.move_executor_->reset();
 
     // Determine the number of bytes per cluster.
     // Again I have to do this in a roundabout manner. As far as I know, there is no system call that returns the number
@@ -74,6 +84,37 @@ void DefragRunner::defrag_one_path(DefragState &defrag_state, const wchar_t *tar
 
     defrag_one_path_stages(defrag_state, opt_mode);
 
+    defrag_state.move_executor_->release_handles();
+
+    const MoveStatistics &moves = defrag_state.move_executor_->statistics();
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"Moved " NUM_FMT " clusters (" NUM_FMT " bytes) in " NUM_FMT " moves, " NUM_FMT
+                                " failed, seek distance " NUM_FMT " clusters, " NUM_FMT " handles opened for " NUM_FMT
+                                " requests", moves.clusters_moved_, moves.bytes_moved_, moves.moves_,
+                                moves.failed_moves_, moves.seek_distance_, moves.opens_, moves.open_requests_));
+
+    // The tree follows all the moves, save it again with the key from before the analysis. The predicted fragments
+    // are read first, the snapshot must not keep a wrong prediction. If it is not saved, the journal of the moves
+    // stays with the old snapshot for the next run.
+    if (defrag_state.snapshot_key_.has_value() && verify_predicted_fragments(defrag_state)) {
+        AnalysisSnapshot::save(defrag_state);
+    }
+
+    defrag_state.move_journal_.close();
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"Predicted the fragments after " NUM_FMT " moves, checked " NUM_FMT ", " NUM_FMT
+                                " were wrong", moves.predictions_, moves.verified_predictions_,
+                                moves.mispredictions_));
+
+    const Tree::Statistics &tree = defrag_state.tree_statistics_;
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"Item tree: " NUM_FMT " repositions, " NUM_FMT " of them relinked, " NUM_FMT
+                                " inserts, " NUM_FMT " detaches, " NUM_FMT " rotations", tree.repositions_,
+                                tree.relinks_, tree.inserts_, tree.detaches_, tree.rotations_));
+
     call_show_status(defrag_state, DefragPhase::Done, Zone::None); // "Finished."
 
     // Close the volume handles
@@ -84,6 +125,7 @@ void DefragRunner::defrag_one_path(DefragState &defrag_state, const wchar_t *tar
 
     // Cleanup
     Tree::delete_tree(defrag_state.item_tree_);
+    defrag_state.tree_statistics_ = {};
 
     defrag_state.disk_.mount_point_.clear();
     defrag_state.disk_.mount_point_slash_.clear();
@@ -256,6 +298,29 @@ bool DefragRunner::defrag_one_path_count_clusters(DefragState &defrag_state) {
     return true;
 }
 
+// Ask the storage driver if the disk of the volume has a seek penalty. If the driver does not know, or the volume
+// spans several disks, then treat it as a rotating disk.
+void DefragRunner::defrag_one_path_query_seek_penalty(DefragState &defrag_state) {
+    DefragGui *gui = DefragGui::get_instance();
+
+    STORAGE_PROPERTY_QUERY query{};
+    query.PropertyId = StorageDeviceSeekPenaltyProperty;
+    query.QueryType = PropertyStandardQuery;
+
+    DEVICE_SEEK_PENALTY_DESCRIPTOR descriptor{};
+    DWORD w;
+
+    defrag_state.disk_.incurs_seek_penalty_ = true;
+
+    if (DeviceIoControl(defrag_state.disk_.volume_handle_, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof query,
+                        &descriptor, sizeof descriptor, &w, nullptr) != FALSE && w >= sizeof descriptor) {
+        defrag_state.disk_.incurs_seek_penalty_ = descriptor.IncursSeekPenalty != FALSE;
+    }
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"Seek penalty: {}", defrag_state.disk_.incurs_seek_penalty_ ? L"yes" : L"no"));
+}
+
 // Fixup the input mask.
 // - If the length is 2 or 3 characters then rewrite into "<DRIVE>:\*".
 // - If it does not contain a wildcard then append '*'.
@@ -276,9 +341,19 @@ void DefragRunner::defrag_one_path_fixup_input_mask(DefragState &data, const wch
 }
 
 void DefragRunner::defrag_one_path_stages(DefragState &data, OptimizeMode opt_mode) {
+    // The snapshot is only checked, it is not saved again afterwards
+    if (opt_mode == OptimizeMode::ValidateSnapshot) {
+        call_show_status(data, DefragPhase::Analyze, Zone::None);
+        AnalysisSnapshot::prepare(data);
+        AnalysisSnapshot::check(data);
+        data.snapshot_key_ = std::nullopt;
+        return;
+    }
+
     if (data.is_still_running()) {
         StopWatch clock1(L"defrag_one_path: analyze");
         analyze_volume(data);
+        data.move_executor_->volume_analyzed(data);
     }
 
     if (data.is_still_running() && opt_mode == OptimizeMode::AnalyzeFixup) {
@@ -38,7 +38,9 @@ void DefragRunner::defragment(DefragState &data) {
     // Exit if nothing to do
     if (data.phase_todo_ == 0) return;
 
-    // Walk through all files and defrag
+    // Walk through all files and defrag. On a rotating disk the moves of whole items are done in batches, in
+    // elevator order.
+    MoveScheduler scheduler(*this, data);
     FileNode *next_item = Tree::smallest(data.item_tree_);
 
     while (next_item != nullptr && data.is_still_running()) {
@@ -84,12 +86,16 @@ void DefragRunner::defragment(DefragState &data) {
                     .count_ = item->clusters_count_,
                     .file_ = item,
             };
-            move_item(data, task, MoveDirection::Up);
+            scheduler.add(task, MoveDirection::Up);
             continue;
         }
 
+        // The item is moved in parts, each into the biggest gap that is left. Do the planned moves first, so the
+        // gaps are what they will be.
+        scheduler.flush();
+
         // Open a filehandle for the item. If error then set the Unmovable flag, colorize the item on the screen, and loop.
-        HANDLE file_handle = open_item_handle(data, item);
+        HANDLE file_handle = data.move_executor_->open(data, item);
 
         if (file_handle == nullptr) {
             item->is_unmovable_ = true;
@@ -140,6 +146,7 @@ void DefragRunner::defragment(DefragState &data) {
                     .lcn_to_ = gap.begin(),
                     .count_ = clusters,
                     .file_ = item,
+                    .file_handle_ = file_handle,
             };
             move_item_try_strategies(data, task, MoveDirection::Up);
 
@@ -160,7 +167,6 @@ void DefragRunner::defragment(DefragState &data) {
         } while (clusters_done < item->clusters_count_ && data.is_still_running());
 
         // Close the item
-        FlushFileBuffers(file_handle); // Is this useful? Can't hurt
-        CloseHandle(file_handle);
+        data.move_executor_->close(file_handle);
     }
 }
@@ -56,6 +56,9 @@ void DefragRunner::fixup(DefragState &data) {
 //        gap_end[file_zone] = 0;
 //    }
 
+    // On a rotating disk the moves are done in batches, in elevator order
+    MoveScheduler scheduler(*this, data);
+
     auto next_item = Tree::smallest(data.item_tree_);
 
     while (next_item != nullptr && data.is_still_running()) {
@@ -147,19 +150,19 @@ void DefragRunner::fixup(DefragState &data) {
             }
         }
 
-        // Move the item.
+        // Plan the move of the item. The destination is reserved, if the move fails then it is free again.
         MoveTask task = {
                 .vcn_from_ = 0,
                 .lcn_to_ = gap[file_zone].begin(),
                 .count_ = item->clusters_count_,
                 .file_ = item,
         };
-        auto result4 = move_item(data, task, MoveDirection::Up);
+        scheduler.add(task, MoveDirection::Up);
+        gap[file_zone].shift_begin(task.count_);
 
-        if (result4) {
-            gap[file_zone].shift_begin(item->clusters_count_);
-        } else {
-            gap[file_zone].set_length(0); // Force re-scan of gap
+        // A move of the batch failed, its destination can be behind the gaps. Force re-scan of the gaps.
+        if (scheduler.take_failed()) {
+            for (auto &zone_gap: gap) zone_gap.set_length(0);
         }
 
         // Get new system time
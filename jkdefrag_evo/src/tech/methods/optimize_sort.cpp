@@ -17,6 +17,32 @@
 
 #include "precompiled_header.h"
 
+// Take the cursor of a run that was stopped: the item it placed last in the zone, and the LCN of the next item. If
+// the item is not on the volume any more then the zone is sorted from its begin.
+static void resume_sort(const DefragState &data, const MoveCursor &cursor, PARAM_OUT FileNode *&previous_item,
+                        PARAM_OUT uint64_t &lcn) {
+    if (cursor.previous_inode_ != MOVE_CURSOR_NO_ITEM) {
+        auto item = Tree::smallest(data.item_tree_);
+
+        // The streams of a file have the same Inode, the name tells them apart
+        while (item != nullptr && (item->inode_ != cursor.previous_inode_ ||
+                                   MoveCursor::name_hash(item) != cursor.previous_name_hash_)) {
+            item = Tree::next(item);
+        }
+
+        if (item == nullptr) return;
+
+        previous_item = item;
+    }
+
+    lcn = cursor.lcn_;
+
+    DefragGui::get_instance()->show_debug(
+            DebugLevel::Progress, nullptr,
+            std::format(L"Continuing the sort of zone {} at LCN " NUM_FMT ", where the last run stopped",
+                        zone_to_str(cursor.zone_), lcn));
+}
+
 // Optimize the volume by moving all the files into a sorted order.
 // SortField=0    Filename
 // SortField=1    Filesize
@@ -34,7 +60,18 @@ void DefragRunner::optimize_sort(DefragState &defrag_state, const int sort_field
     [[maybe_unused]] uint64_t vacated_until = 0;
     const uint64_t minimum_vacate = defrag_state.total_clusters() / 200;
 
-    for (defrag_state.zone_ = Zone::ZoneFirst;
+    // Continue where a run that was stopped left off, if it sorted on the same field
+    std::optional<MoveCursor> resume = std::exchange(defrag_state.resume_cursor_, std::nullopt);
+
+    if (resume.has_value() &&
+        (resume->sort_field_ != sort_field ||
+         resume->zone_ < Zone::ZoneFirst || resume->zone_ >= Zone::ZoneAll_MaxValue ||
+         resume->lcn_ < defrag_state.zones_[(size_t) resume->zone_] ||
+         resume->lcn_ >= (lcn64_t) defrag_state.total_clusters())) {
+        resume.reset();
+    }
+
+    for (defrag_state.zone_ = resume.has_value() ? resume->zone_ : Zone::ZoneFirst;
          defrag_state.zone_ < Zone::ZoneAll_MaxValue; defrag_state.zone_ = (Zone) ((int) defrag_state.zone_ + 1)) {
         call_show_status(defrag_state, DefragPhase::ZoneSort, defrag_state.zone_); // "Zone N: Sort"
 
@@ -43,7 +80,23 @@ void DefragRunner::optimize_sort(DefragState &defrag_state, const int sort_field
 
         uint64_t lcn = defrag_state.zones_[(size_t) defrag_state.zone_];
 
+        if (resume.has_value()) {
+            resume_sort(defrag_state, resume.value(), PARAM_OUT previous_item, PARAM_OUT lcn);
+            resume.reset();
+        }
+
         while (defrag_state.is_still_running()) {
+            // Record where the sort is, a run that is stopped continues here
+            const MoveCursor cursor = {
+                    .sort_field_ = sort_field,
+                    .zone_ = defrag_state.zone_,
+                    .lcn_ = (lcn64_t) lcn,
+                    .previous_inode_ = previous_item != nullptr ? previous_item->inode_ : MOVE_CURSOR_NO_ITEM,
+                    .previous_name_hash_ = previous_item != nullptr ? MoveCursor::name_hash(previous_item) : 0,
+            };
+
+            defrag_state.move_journal_.record_cursor(cursor);
+
             // Find the next item that we want to place
             FileNode *item = nullptr;
             uint64_t phase_temp = 0;
@@ -121,8 +174,9 @@ void DefragRunner::optimize_sort(DefragState &defrag_state, const int sort_field
                 if (clusters > gap.length()) {
                     clusters = gap.length();
 
-                    // It looks like a partial move only succeeds if the number of clusters is a multiple of 8.
-                    clusters = clusters - clusters % 8;
+                    // Some partial moves only succeed if the number of clusters is a multiple of the alignment
+                    // that was learned for the volume
+                    clusters = clusters - clusters % defrag_state.disk_.partial_move_alignment_;
 
                     if (clusters == 0) {
                         lcn = gap.end();
@@ -148,6 +202,13 @@ void DefragRunner::optimize_sort(DefragState &defrag_state, const int sort_field
                     } else {
                         return; // No gaps found, exit.
                     }
+
+                    // If Windows refused the size of a partial move then try again with the new alignment
+                    if (clusters < item->clusters_count_ - clusters_done &&
+                        learn_partial_move_alignment(defrag_state, item, clusters, task.error_)) {
+                        lcn = gap.begin();
+                        continue;
+                    }
                 }
 
                 lcn = gap.begin();
@@ -17,6 +17,9 @@
 
 #include "precompiled_header.h"
 
+// Number of moves that are planned ahead while the previous ones run
+static constexpr size_t MOVE_PIPELINE_DEPTH = 4;
+
 // Optimize the harddisk by filling gaps with files from above
 void DefragRunner::optimize_volume(DefragState &defrag_state) {
     FileNode *item;
@@ -26,6 +29,45 @@ void DefragRunner::optimize_volume(DefragState &defrag_state) {
     // Sanity check
     if (defrag_state.item_tree_ == nullptr) return;
 
+    StopWatch watch(L"optimize_volume");
+
+    // The moves are done on executor threads while this thread looks for the next gap and item. A gap is taken as
+    // soon as a move into it is submitted, if the move fails then the gap is scanned again from where the move was.
+    // A rotating disk, or a throttled run, does one move at a time. Unless a number of moves was set, the number of
+    // moves that run at the same time is tuned while running.
+    const bool throttled = defrag_state.speed_ > 0 && defrag_state.speed_ < 100;
+    const bool concurrent = !defrag_state.disk_.incurs_seek_penalty_ && !throttled;
+    const size_t max_concurrency = !concurrent ? 1
+                                               : defrag_state.move_concurrency_ > 0 ? defrag_state.move_concurrency_
+                                                                                    : MOVE_MAX_CONCURRENCY;
+
+    MovePipeline pipeline(*this, defrag_state, MOVE_PIPELINE_DEPTH, max_concurrency,
+                          defrag_state.move_concurrency_ == 0);
+    int retry = 0;
+
+    auto take_outcomes = [&]() {
+        for (auto &outcome: pipeline.take_outcomes()) {
+            if (outcome.succeeded_) {
+                retry = 0;
+                continue;
+            }
+
+            gap.set_begin(std::min(gap.begin(), outcome.task_.lcn_to_));
+            gap.set_length(0); // Force re-scan of gap
+            retry = retry + 1;
+        }
+    };
+
+    // Before giving up on a zone wait for the moves in flight, a failed move leaves a gap to be filled again.
+    // Return true if there were moves in flight.
+    auto settle = [&]() {
+        if (pipeline.idle()) return false;
+
+        pipeline.drain();
+        take_outcomes();
+        return true;
+    };
+
     // Process all the zones
     for (int zone_i = 0; zone_i < (int) Zone::ZoneAll_MaxValue; zone_i++) {
         auto zone = (Zone) zone_i;
@@ -34,14 +76,19 @@ void DefragRunner::optimize_volume(DefragState &defrag_state) {
 
         // Walk through all the gaps
         gap.set_begin(defrag_state.zones_[(size_t) zone]);
-        int retry = 0;
+        retry = 0;
 
         while (defrag_state.is_still_running()) {
+            // Apply the moves that are done, so find_gap() sees their clusters
+            pipeline.poll();
+            take_outcomes();
+
             // Find the next gap
             auto result = find_gap(defrag_state, gap.begin(), 0, 0, true, false, false);
             if (result.has_value()) {
                 gap = result.value();
             } else {
+                if (settle()) continue;
                 break;
             }
 
@@ -53,6 +100,8 @@ void DefragRunner::optimize_volume(DefragState &defrag_state) {
                 if (item->get_item_lcn() < gap.end()) break;
                 if (item->is_unmovable_) continue;
                 if (item->is_excluded_) continue;
+                // Moves in flight were already counted when the gap they go to was found
+                if (item->is_moving_) continue;
 
                 auto preferred_zone = item->get_preferred_zone();
                 if (preferred_zone != zone) continue;
@@ -61,7 +110,10 @@ void DefragRunner::optimize_volume(DefragState &defrag_state) {
             }
 
             defrag_state.phase_todo_ += phase_temp;
-            if (phase_temp == 0) break;
+            if (phase_temp == 0) {
+                if (settle()) continue;
+                break;
+            }
 
             // Loop until the gap is filled. First look for combinations of files that perfectly
             // fill the gap. If no combination can be found, or if there are fewer files than
@@ -93,15 +145,11 @@ void DefragRunner::optimize_volume(DefragState &defrag_state) {
                         .count_ = item->clusters_count_,
                         .file_ = item,
                 };
-                auto result2 = move_item(defrag_state, task, MoveDirection::Up);
+                pipeline.submit(task, MoveDirection::Up);
+                gap.shift_begin(task.count_);
 
-                if (result2) {
-                    gap.shift_begin(item->clusters_count_);
-                    retry = 0;
-                } else {
-                    gap.set_length(0); // Force re-scan of gap
-                    retry = retry + 1;
-                }
+                pipeline.poll();
+                take_outcomes();
             }
 
             // If the gap could not be filled then skip
@@ -0,0 +1,116 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+#include <functional>
+
+// The simulated disk without seek penalty: every move takes this long plus the time per cluster, and the disk works
+// on this many moves at the same time
+static constexpr auto SIMULATED_LATENCY_PER_MOVE = std::chrono::microseconds(200);
+static constexpr auto SIMULATED_LATENCY_PER_CLUSTER = std::chrono::nanoseconds(20);
+static constexpr size_t SIMULATED_CHANNELS = 4;
+
+// Run the stages of an optimize mode on an image file of an NTFS or FAT volume. The moves are done by a simulated
+// volume in memory that is loaded from the analysis, the image itself is only read. This measures the strategies
+// without a disk, and without changing one.
+void DefragRunner::simulate_image_sync(const wchar_t *image_path, const OptimizeMode optimize_mode,
+                                       RunningState *run_state) {
+    DefragGui *gui = DefragGui::get_instance();
+
+    RunningState default_running;
+    RunningState *running = run_state == nullptr ? &default_running : run_state;
+
+    *running = RunningState::RUNNING;
+
+    gui->clear_screen(std::format(L"Simulating image '{}'", image_path));
+
+    // One run of the stages. Every run analyzes the image again, so all the runs start from the same volume.
+    // setup changes the volume and the simulated executor before the run. Return false if the image could not be
+    // analyzed.
+    auto simulate = [&](const wchar_t *name,
+                        const std::function<void(DefragState &, SimulatedMoveExecutor &)> &setup) -> bool {
+        DefragState data{};
+        data.running_ = running;
+        data.speed_ = 100;
+        data.free_space_ = 1;
+        data.include_mask_ = L"*";
+        data.use_default_space_hogs_ = true;
+        data.add_default_space_hogs();
+        data.disk_.volume_name_ = image_path;
+        data.disk_.is_image_ = true;
+
+        auto executor = std::make_unique<SimulatedMoveExecutor>();
+        setup(data, *executor);
+        data.move_executor_ = std::move(executor);
+
+        const Clock::time_point start_time = Clock::now();
+
+        defrag_one_path_stages(data, optimize_mode);
+        data.move_executor_->release_handles();
+
+        const auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
+        const bool analyzed = data.item_tree_ != nullptr;
+
+        if (analyzed) {
+            const MoveStatistics &moves = data.move_executor_->statistics();
+
+            gui->show_always(std::format(
+                    L"{}: " NUM_FMT " moves, " NUM_FMT " failed, " NUM_FMT " clusters moved, seek distance " NUM_FMT
+                    " clusters, " NUM_FMT " ms", name, moves.moves_, moves.failed_moves_, moves.clusters_moved_,
+                    moves.seek_distance_, elapsed_ms.count()));
+        }
+
+        Tree::delete_tree(data.item_tree_);
+
+        return analyzed;
+    };
+
+    // A rotating disk: the moves of whole items in elevator order, and in the order that they were planned
+    if (!simulate(L"Rotating disk, elevator order", [](DefragState &, SimulatedMoveExecutor &) {})) {
+        gui->show_always(std::format(L"Image '{}' is not an NTFS or FAT volume, or it cannot be read",
+                                     image_path));
+        *running = RunningState::STOPPED;
+        return;
+    }
+
+    simulate(L"Rotating disk, planned order", [](DefragState &data, SimulatedMoveExecutor &) {
+        data.keep_move_order_ = true;
+    });
+
+    // The concurrent moves of optimize_volume() on a disk without seek penalty, that works on SIMULATED_CHANNELS
+    // moves at the same time: a fixed number of moves against the number that is tuned while running
+    if (optimize_mode == OptimizeMode::AnalyzeFixupFastopt
+        || optimize_mode == OptimizeMode::DeprecatedAnalyzeFixupFull) {
+        auto solid_state = [](const size_t concurrency) {
+            return [concurrency](DefragState &data, SimulatedMoveExecutor &executor) {
+                data.disk_.incurs_seek_penalty_ = false;
+                data.move_concurrency_ = concurrency;
+                executor.set_latency(SIMULATED_LATENCY_PER_MOVE, SIMULATED_LATENCY_PER_CLUSTER, SIMULATED_CHANNELS);
+            };
+        };
+
+        simulate(L"Solid state, 1 concurrent move", solid_state(1));
+        simulate(std::format(L"Solid state, " NUM_FMT " concurrent moves", SIMULATED_CHANNELS).c_str(),
+                 solid_state(SIMULATED_CHANNELS));
+        simulate(std::format(L"Solid state, " NUM_FMT " concurrent moves", MOVE_MAX_CONCURRENCY).c_str(),
+                 solid_state(MOVE_MAX_CONCURRENCY));
+        simulate(L"Solid state, tuned concurrent moves", solid_state(0));
+    }
+
+    *running = RunningState::STOPPED;
+}
@@ -17,19 +17,8 @@
 
 #include "precompiled_header.h"
 
-// Load the MFT into a list of ItemStruct records in memory
-// Expensive call (can reach 1 minute runtime or more)
-bool ScanNTFS::analyze_ntfs_volume(DefragState &data) {
-    DefragGui *gui = DefragGui::get_instance();
-
-    MemReader<uint8_t> buff(std::make_unique<uint8_t[]>(MFT_BUFFER_SIZE), MFT_BUFFER_SIZE);
-
-    if (!analyze_ntfs_volume_read_bootblock(data, buff)) { return false; }
-
-    // Extract data from the bootblock
-    NtfsDiskInfoStruct disk_info{};
-
-    data.disk_.type_ = DiskType::NTFS;
+// Extract the layout of the volume from the bootblock
+static void read_disk_info(const MemReader<uint8_t> &buff, PARAM_OUT NtfsDiskInfoStruct &disk_info) {
     disk_info.bytes_per_sector_ = buff.read<USHORT>(11);
 
     // Still to do: check for impossible values
@@ -48,6 +37,47 @@ bool ScanNTFS::analyze_ntfs_volume(DefragState &data) {
     }
 
     disk_info.clusters_per_index_record_ = buff.read<ULONG>(68);
+}
+
+// Load the MFT into a list of ItemStruct records in memory
+// Expensive call (can reach 1 minute runtime or more)
+bool ScanNTFS::analyze_ntfs_volume(DefragState &data) {
+    DefragGui *gui = DefragGui::get_instance();
+
+    // All the reads below go through the reader, which keeps several reads of the MFT in flight
+    auto volume_reader = VolumeReader::create(data.disk_.volume_name_.c_str(), data.disk_.is_image_,
+                                              MFT_READ_SLOTS);
+
+    if (volume_reader == nullptr) {
+        gui->show_debug(DebugLevel::Progress, nullptr,
+                        std::format(L"Cannot open volume '{}' for reading: {}", data.disk_.volume_name_,
+                                    Str::system_error(GetLastError())));
+        return false;
+    }
+
+    // reader_ is cleared again before the reader is closed
+    reader_ = volume_reader.get();
+    record_cache_.clear();
+
+    const bool result = analyze_ntfs_volume_read_items(data, *volume_reader);
+
+    reader_ = nullptr;
+
+    return result;
+}
+
+bool ScanNTFS::analyze_ntfs_volume_read_items(DefragState &data, VolumeReader &reader) {
+    DefragGui *gui = DefragGui::get_instance();
+
+    MemReader<uint8_t> buff(std::make_unique<uint8_t[]>(MFT_BUFFER_SIZE), MFT_BUFFER_SIZE);
+
+    if (!analyze_ntfs_volume_read_bootblock(data, reader, buff)) { return false; }
+
+    // Extract data from the bootblock
+    NtfsDiskInfoStruct disk_info{};
+
+    data.disk_.type_ = DiskType::NTFS;
+    read_disk_info(buff, PARAM_OUT disk_info);
 
     data.bytes_per_cluster_ = disk_info.bytes_per_sector_ * disk_info.sectors_per_cluster_;
 
@@ -71,16 +101,11 @@ bool ScanNTFS::analyze_ntfs_volume(DefragState &data) {
     data.disk_.mft_locked_clusters_ = disk_info.bytes_per_sector_ * disk_info.sectors_per_cluster_ /
                                       disk_info.bytes_per_mft_record_;
 
-    analyze_ntfs_volume_read_mft(data, disk_info, buff);
+    analyze_ntfs_volume_read_mft(data, reader, disk_info, buff);
 
-    uint64_t mft_bitmap_bytes = 0;
-    std::list<FileFragment> mft_bitmap_fragments;
-    uint64_t mft_data_bytes = 0;
-    std::list<FileFragment> mft_data_fragments;
+    MftLayout mft_layout{};
 
-    if (!analyze_ntfs_volume_extract_mft(data, disk_info, buff, PARAM_OUT mft_bitmap_fragments,
-                                         PARAM_OUT mft_bitmap_bytes, PARAM_OUT mft_data_bytes,
-                                         PARAM_OUT mft_data_fragments)) {
+    if (!analyze_ntfs_volume_extract_mft(data, disk_info, buff, PARAM_OUT mft_layout)) {
         return false;
     }
 
@@ -92,7 +117,7 @@ bool ScanNTFS::analyze_ntfs_volume(DefragState &data) {
     uint64_t vcn = 0;
     uint64_t max_mft_bitmap_bytes = 0;
 
-    for (auto &fragment: mft_bitmap_fragments) {
+    for (auto &fragment: mft_layout.bitmap_fragments_) {
         if (!fragment.is_virtual()) {
             max_mft_bitmap_bytes = max_mft_bitmap_bytes + (fragment.next_vcn_ - vcn) *
                                                                   disk_info.bytes_per_sector_ *
@@ -102,10 +127,10 @@ bool ScanNTFS::analyze_ntfs_volume(DefragState &data) {
         vcn = fragment.next_vcn_;
     }
 
-    if (max_mft_bitmap_bytes < mft_bitmap_bytes) max_mft_bitmap_bytes = (size_t) mft_bitmap_bytes;
+    if (max_mft_bitmap_bytes < mft_layout.bitmap_bytes_) max_mft_bitmap_bytes = (size_t) mft_layout.bitmap_bytes_;
 
     auto mft_bitmap = std::make_unique<BYTE[]>(max_mft_bitmap_bytes);
-    std::memset(mft_bitmap.get(), 0, (size_t) mft_bitmap_bytes);
+    std::memset(mft_bitmap.get(), 0, (size_t) mft_layout.bitmap_bytes_);
 
     vcn = 0;
     uint64_t real_vcn = 0;
@@ -113,21 +138,13 @@ bool ScanNTFS::analyze_ntfs_volume(DefragState &data) {
     gui->show_debug(DebugLevel::DetailedGapFinding, nullptr, L"Reading $MFT::$BITMAP into memory");
 
     // Follow the chain of MFT bitmap fragments
-    for (auto &fragment: mft_bitmap_fragments) {
+    for (auto &fragment: mft_layout.bitmap_fragments_) {
         if (!fragment.is_virtual()) {
             gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
                             std::format(L"  Extent Lcn=" NUM_FMT ", RealVcn=" NUM_FMT
                                         ", Size=" NUM_FMT,
                                         fragment.lcn_, real_vcn, fragment.next_vcn_ - vcn));
 
-            ULARGE_INTEGER trans;
-            trans.QuadPart =
-                    fragment.lcn_ * disk_info.bytes_per_sector_ * disk_info.sectors_per_cluster_;
-
-            OVERLAPPED overlapped = {.Offset = trans.LowPart,
-                                     .OffsetHigh = trans.HighPart,
-                                     .hEvent = nullptr};
-
             gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
                             std::format(L"    Reading " NUM_FMT " clusters (" NUM_FMT
                                         " bytes) from LCN=" NUM_FMT,
@@ -136,18 +153,10 @@ bool ScanNTFS::analyze_ntfs_volume(DefragState &data) {
                                                 disk_info.sectors_per_cluster_,
                                         fragment.lcn_));
 
-            DWORD bytes_read;
-            auto result =
-                    ReadFile(data.disk_.volume_handle_,
-                             &mft_bitmap[real_vcn * disk_info.bytes_per_sector_ *
-                                         disk_info.sectors_per_cluster_],
-                             (uint32_t) ((fragment.next_vcn_ - vcn) * disk_info.bytes_per_sector_ *
-                                         disk_info.sectors_per_cluster_),
-                             &bytes_read, &overlapped);
-
-            if (result == 0 || bytes_read != (fragment.next_vcn_ - vcn) *
-                                                     disk_info.bytes_per_sector_ *
-                                                     disk_info.sectors_per_cluster_) {
+            if (!reader.read(fragment.lcn_ * disk_info.bytes_per_sector_ * disk_info.sectors_per_cluster_,
+                             &mft_bitmap[real_vcn * disk_info.bytes_per_sector_ * disk_info.sectors_per_cluster_],
+                             (fragment.next_vcn_ - vcn) * disk_info.bytes_per_sector_ *
+                             disk_info.sectors_per_cluster_)) {
                 gui->show_debug(DebugLevel::Progress, nullptr,
                                 std::format(L"  {}", Str::system_error(GetLastError())));
                 Tree::delete_tree(data.item_tree_);
@@ -164,10 +173,10 @@ bool ScanNTFS::analyze_ntfs_volume(DefragState &data) {
     // Construct an array of all the items in memory, indexed by Inode.
     // Note: the maximum number of Inodes is primarily determined by the size of the
     // bitmap. But that is rounded up to 8 Inodes, and the MFT can be shorter.
-    uint64_t max_inode = mft_bitmap_bytes * 8;
+    uint64_t max_inode = mft_layout.bitmap_bytes_ * 8;
 
-    if (max_inode > mft_data_bytes / disk_info.bytes_per_mft_record_) {
-        max_inode = mft_data_bytes / disk_info.bytes_per_mft_record_;
+    if (max_inode > mft_layout.data_bytes_ / disk_info.bytes_per_mft_record_) {
+        max_inode = mft_layout.data_bytes_ / disk_info.bytes_per_mft_record_;
     }
 
     auto inode_array = std::make_unique<FileNode *[]>(max_inode);
@@ -175,184 +184,169 @@ bool ScanNTFS::analyze_ntfs_volume(DefragState &data) {
     std::fill(inode_array.get() + 1, inode_array.get() + max_inode, nullptr);
 
     // Read and process all the records in the MFT. The records are read into a buffer and then given one by one to the
-    // interpret_mft_record() subroutine.
-    auto fragment = mft_data_fragments.begin();
-    vcn = 0;
-    real_vcn = 0;
-
+    // interpret_mft_record() subroutine, on several threads.
     data.clusters_done_ = 0;
     data.phase_todo_ = 0;
 
     Clock::time_point start_time = Clock::now();
 
-    static const BYTE bitmap_masks[8] = {1, 2, 4, 8, 16, 32, 64, 128};
-    for (auto inode_number = 1; inode_number < max_inode; inode_number++) {
-        if ((mft_bitmap[inode_number >> 3] & bitmap_masks[inode_number % 8]) == 0) continue;
+    // Only the ranges of the MFT that are in use are read
+    std::vector<MftRange> ranges;
+    data.phase_todo_ = find_mft_ranges(mft_bitmap.get(), max_inode,
+                                       MFT_MAX_READ_GAP / disk_info.bytes_per_mft_record_, PARAM_OUT ranges);
+
+    uint64_t records_to_read = 0;
+
+    for (auto &range: ranges) {
+        records_to_read += range.end_inode_ - range.first_inode_;
+    }
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"  MFT: " NUM_FMT " records in use out of " NUM_FMT ", reading " NUM_FMT
+                                " records in " NUM_FMT " ranges",
+                                data.phase_todo_, max_inode, records_to_read, ranges.size()));
 
-        data.phase_todo_ += 1;
+    if (!read_mft_records(data, reader, disk_info, mft_bitmap.get(), ranges, inode_array.get(), max_inode,
+                          mft_layout)) {
+        Tree::delete_tree(data.item_tree_);
+        data.item_tree_ = nullptr;
+        return false;
     }
 
-    uint64_t block_start;
-    uint64_t block_end = 0;
+    Clock::time_point end_time = Clock::now();
 
-    // For all inodes, while we are in the RUNNING state
-    for (auto inode_number = 1; inode_number < max_inode; inode_number++) {
-        if (*data.running_ != RunningState::RUNNING) break;
+    if (end_time > start_time) {
+        auto diff_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time)
+                               .count();
+        gui->show_debug(DebugLevel::Progress, nullptr,
+                        std::format(L"  Analysis speed: " NUM_FMT " items per second",
+                                    max_inode * 1000 / diff_ms));
+    }
 
-        // Ignore the Inode if the bitmap says it's not in use
-        if ((mft_bitmap[inode_number >> 3] & bitmap_masks[inode_number % 8]) == 0) {
-            gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
-                            std::format(L"Inode " NUM_FMT " is not in use.", inode_number));
-            continue;
-        }
+    data.disk_.bytes_read_ += reader.bytes_read();
 
-        // Update the progress counter
-        data.clusters_done_ += 1;
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"  Read " NUM_FMT " bytes in " NUM_FMT " reads", reader.bytes_read(),
+                                reader.read_count()));
 
-        // Read a block of inode's into memory
-        if (inode_number >= block_end) {
-            // Slow the program down to the percentage that was specified on the command line
-            DefragRunner::slow_down(data);
+    if (*data.running_ != RunningState::RUNNING) {
+        Tree::delete_tree(data.item_tree_);
+        data.item_tree_ = nullptr;
+        return false;
+    }
 
-            block_start = inode_number;
-            block_end = block_start + MFT_BUFFER_SIZE / disk_info.bytes_per_mft_record_;
+    // Setup the ParentDirectory in all the items with the info in the InodeArray
+    for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
+        item->parent_directory_ = inode_array[item->parent_inode_];
 
-            if (block_end > mft_bitmap_bytes * 8) block_end = mft_bitmap_bytes * 8;
+        if (item->parent_inode_ == 5) item->parent_directory_ = nullptr;
+    }
 
-            uint64_t u1;
+    return true;
+}
 
-            while (fragment != mft_data_fragments.end()) {
-                // Calculate Inode at the end of the fragment
-                u1 = (real_vcn + fragment->next_vcn_ - vcn) * disk_info.bytes_per_sector_ *
-                     disk_info.sectors_per_cluster_ / disk_info.bytes_per_mft_record_;
+// Bring the items of a loaded snapshot up to date, the items of the Inodes are no longer in the tree
+bool ScanNTFS::update_ntfs_inodes(DefragState &data, std::vector<uint64_t> &inodes) {
+    DefragGui *gui = DefragGui::get_instance();
 
-                if (u1 > inode_number) break;
+    auto volume_reader = VolumeReader::create(data.disk_.volume_name_.c_str(), data.disk_.is_image_,
+                                              MFT_READ_SLOTS);
 
-                do {
-                    gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
-                                    L"Skipping to next extent");
+    if (volume_reader == nullptr) {
+        gui->show_debug(DebugLevel::Progress, nullptr,
+                        std::format(L"Cannot open volume '{}' for reading: {}", data.disk_.volume_name_,
+                                    Str::system_error(GetLastError())));
+        return false;
+    }
 
-                    if (!fragment->is_virtual()) {
-                        real_vcn = real_vcn + fragment->next_vcn_ - vcn;
-                    }
+    // reader_ is cleared again before the reader is closed
+    reader_ = volume_reader.get();
+    record_cache_.clear();
 
-                    vcn = fragment->next_vcn_;
-                    fragment++;
+    const bool result = update_ntfs_inodes_read_items(data, *volume_reader, inodes);
 
-                    if (fragment == mft_data_fragments.end()) break;
-                } while (fragment->is_virtual());
+    reader_ = nullptr;
 
-                gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
-                                std::format(L"  Extent Lcn=" NUM_FMT ", RealVcn=" NUM_FMT
-                                            ", Size=" NUM_FMT,
-                                            fragment->lcn_, real_vcn, fragment->next_vcn_ - vcn));
-            }
+    return result;
+}
 
-            if (fragment == mft_data_fragments.end()) break;
-            if (block_end >= u1) block_end = u1;
+bool ScanNTFS::update_ntfs_inodes_read_items(DefragState &data, VolumeReader &reader, std::vector<uint64_t> &inodes) {
+    DefragGui *gui = DefragGui::get_instance();
 
-            ULARGE_INTEGER trans;
-            trans.QuadPart = (fragment->lcn_ - real_vcn) * disk_info.bytes_per_sector_ *
-                                     disk_info.sectors_per_cluster_ +
-                             block_start * disk_info.bytes_per_mft_record_;
+    MemReader<uint8_t> buff(std::make_unique<uint8_t[]>(MFT_BUFFER_SIZE), MFT_BUFFER_SIZE);
 
-            OVERLAPPED overlapped{.Offset = trans.LowPart,
-                                  .OffsetHigh = trans.HighPart,
-                                  .hEvent = nullptr};
+    if (!analyze_ntfs_volume_read_bootblock(data, reader, buff)) return false;
 
-            gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
-                            std::format(L"Reading block of " NUM_FMT
-                                        " Inodes from MFT into memory, " NUM_FMT
-                                        " bytes from LCN=" NUM_FMT,
-                                        block_end - block_start,
-                                        (block_end - block_start) * disk_info.bytes_per_mft_record_,
-                                        trans.QuadPart / (disk_info.bytes_per_sector_ *
-                                                          disk_info.sectors_per_cluster_)));
-
-            DWORD bytes_read;
-            auto result = ReadFile(
-                    data.disk_.volume_handle_, buff.get(),
-                    (uint32_t) ((block_end - block_start) * disk_info.bytes_per_mft_record_),
-                    &bytes_read, &overlapped);
-
-            if (result == 0 ||
-                bytes_read != (block_end - block_start) * disk_info.bytes_per_mft_record_) {
-                gui->show_debug(DebugLevel::Progress, nullptr,
-                                std::format(L"Error while reading Inodes " NUM_FMT " to " NUM_FMT
-                                            ": reason {}",
-                                            inode_number, block_end - 1,
-                                            Str::system_error(GetLastError())));
+    NtfsDiskInfoStruct disk_info{};
+    read_disk_info(buff, PARAM_OUT disk_info);
 
-                Tree::delete_tree(data.item_tree_);
-                data.item_tree_ = nullptr;
-                return FALSE;
-            }
-        }
+    // The $MFT itself is always read again, it tells where the other records are, and it grows with the volume
+    if (!analyze_ntfs_volume_read_mft(data, reader, disk_info, buff)) return false;
 
-        // Fixup the raw data of this Inode
-        const auto raw_mftdata_offset =
-                (inode_number - block_start) * disk_info.bytes_per_mft_record_;
-        if (fixup_raw_mftdata(data, &disk_info, buff.get() + raw_mftdata_offset,
-                              disk_info.bytes_per_mft_record_) == FALSE) {
-            gui->show_debug(
-                    DebugLevel::Progress, nullptr,
-                    std::format(L"The error occurred while processing Inode %I64u (max " NUM_FMT
-                                ")",
-                                inode_number, max_inode));
-
-            continue;
-        }
+    MftLayout mft_layout{};
 
-        // Interpret the Inode's attributes
-        // auto result =
-        interpret_mft_record(data, &disk_info, inode_array.get(), inode_number, max_inode,
-                             PARAM_OUT mft_data_fragments, PARAM_OUT mft_data_bytes,
-                             PARAM_OUT mft_bitmap_fragments, PARAM_OUT mft_bitmap_bytes,
-                             buff.get() + raw_mftdata_offset, disk_info.bytes_per_mft_record_);
-    }
+    if (!analyze_ntfs_volume_extract_mft(data, disk_info, buff, PARAM_OUT mft_layout)) return false;
 
-    Clock::time_point end_time = Clock::now();
+    // Read the changed records in batches, the same way as the extension records. Records that cannot be read or
+    // are not in use any more belong to deleted files, they get no items.
+    std::erase(inodes, 0);
+    read_extension_records(data, &disk_info, mft_layout.data_fragments_, inodes);
 
-    if (end_time > start_time) {
-        auto diff_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time)
-                               .count();
-        gui->show_debug(DebugLevel::Progress, nullptr,
-                        std::format(L"  Analysis speed: " NUM_FMT " items per second",
-                                    max_inode * 1000 / diff_ms));
+    for (auto inode: inodes) {
+        if (!data.is_still_running()) break;
+
+        BYTE *record = record_cache_.find(inode);
+
+        if (record == nullptr) continue;
+
+        InodeItems inode_items;
+
+        if (interpret_mft_record(data, &disk_info, inode, mft_layout, record, disk_info.bytes_per_mft_record_,
+                                 PARAM_OUT inode_items)) {
+            add_inode_items(data, nullptr, 0, inode_items);
+        }
     }
 
-    if (*data.running_ != RunningState::RUNNING) {
-        Tree::delete_tree(data.item_tree_);
-        data.item_tree_ = nullptr;
-        return false;
+    data.disk_.bytes_read_ += reader.bytes_read();
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"  Updated " NUM_FMT " Inodes, read " NUM_FMT " bytes in " NUM_FMT " reads",
+                                inodes.size(), reader.bytes_read(), reader.read_count()));
+
+    if (!data.is_still_running()) return false;
+
+    // The directories that changed are new items now, so link the parent directories of all the items again.
+    // For every Inode the same item is chosen as in add_inode_items().
+    std::unordered_map<uint64_t, FileNode *> directories;
+
+    for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
+        if (!item->is_dir_) continue;
+
+        auto [found, inserted] = directories.try_emplace(item->inode_, item);
+
+        if (!inserted && found->second->have_long_fn() && item->have_long_fn() &&
+            wcscmp(found->second->get_long_fn(), item->get_long_fn()) > 0) {
+            found->second = item;
+        }
     }
 
-    // Setup the ParentDirectory in all the items with the info in the InodeArray
     for (auto item = Tree::smallest(data.item_tree_); item != nullptr; item = Tree::next(item)) {
-        item->parent_directory_ = inode_array[item->parent_inode_];
+        const auto found = directories.find(item->parent_inode_);
 
-        if (item->parent_inode_ == 5) item->parent_directory_ = nullptr;
+        item->parent_directory_ = item->parent_inode_ == 5 || found == directories.end() ? nullptr : found->second;
     }
 
     return true;
 }
 
 // Read the boot block from the disk
-bool ScanNTFS::analyze_ntfs_volume_read_bootblock(DefragState &data, MemReader<uint8_t> &buff) {
+bool ScanNTFS::analyze_ntfs_volume_read_bootblock(DefragState &data, VolumeReader &reader,
+                                                  MemReader<uint8_t> &buff) {
     StopWatch clock(L"NTFS: read bootblock");
 
     DefragGui *gui = DefragGui::get_instance();
-    OVERLAPPED overlapped{
-            .Offset = 0,
-            .OffsetHigh = 0,
-            .hEvent = nullptr,
-    };
 
-    DWORD bytes_read;
-    auto result = ReadFile(data.disk_.volume_handle_, buff.get(), (uint32_t) 512, &bytes_read,
-                           &overlapped);
-
-    if (result == FALSE || bytes_read != 512) {
+    if (!reader.read(0, buff.get(), 512)) {
         gui->show_debug(DebugLevel::Progress, nullptr,
                         std::format(L"Error while reading bootblock: {}",
                                     Str::system_error(GetLastError())));
@@ -372,27 +366,12 @@ bool ScanNTFS::analyze_ntfs_volume_read_bootblock(DefragState &data, MemReader<u
 }
 
 // Read the $MFT record from disk into memory, which is always the first record in the MFT
-bool ScanNTFS::analyze_ntfs_volume_read_mft(DefragState &data, NtfsDiskInfoStruct &disk_info,
-                                            MemReader<uint8_t> &buff) {
+bool ScanNTFS::analyze_ntfs_volume_read_mft(DefragState &data, VolumeReader &reader,
+                                            NtfsDiskInfoStruct &disk_info, MemReader<uint8_t> &buff) {
     DefragGui *gui = DefragGui::get_instance();
-    ULARGE_INTEGER trans;
-    trans.QuadPart =
-            disk_info.mft_start_lcn_ * disk_info.bytes_per_sector_ * disk_info.sectors_per_cluster_;
-
-    OVERLAPPED overlapped{
-            .Offset = 0,
-            .OffsetHigh = 0,
-            .hEvent = nullptr,
-    };
-    DWORD bytes_read;
-
-    overlapped.Offset = trans.LowPart;
-    overlapped.OffsetHigh = trans.HighPart;
-    overlapped.hEvent = nullptr;
-    auto result = ReadFile(data.disk_.volume_handle_, buff.get(),
-                           (uint32_t) disk_info.bytes_per_mft_record_, &bytes_read, &overlapped);
-
-    if (result == 0 || bytes_read != disk_info.bytes_per_mft_record_) {
+
+    if (!reader.read(disk_info.mft_start_lcn_ * disk_info.bytes_per_sector_ * disk_info.sectors_per_cluster_,
+                     buff.get(), disk_info.bytes_per_mft_record_)) {
         gui->show_debug(DebugLevel::Progress, nullptr,
                         std::format(L"Error while reading first MFT record: {}",
                                     Str::system_error(GetLastError())));
@@ -410,17 +389,17 @@ bool ScanNTFS::analyze_ntfs_volume_read_mft(DefragState &data, NtfsDiskInfoStruc
 // Extract data from the MFT record and put into an Item struct in memory. If there was an error then exit
 bool ScanNTFS::analyze_ntfs_volume_extract_mft(
         DefragState &data, NtfsDiskInfoStruct &disk_info, MemReader<uint8_t> &buff,
-        PARAM_OUT std::list<FileFragment> &mft_bitmap_fragments,
-        PARAM_OUT uint64_t &mft_bitmap_bytes, PARAM_OUT uint64_t &mft_data_bytes,
-        PARAM_OUT std::list<FileFragment> &mft_data_fragments) {
+        PARAM_OUT MftLayout &mft_layout) {
     DefragGui *gui = DefragGui::get_instance();
 
-    auto result = interpret_mft_record(data, &disk_info, nullptr, 0, 0,
-                                       PARAM_OUT mft_data_fragments, PARAM_OUT mft_data_bytes,
-                                       PARAM_OUT mft_bitmap_fragments, PARAM_OUT mft_bitmap_bytes,
-                                       buff.get(), disk_info.bytes_per_mft_record_);
+    InodeItems inode_items;
+    // The only writer of the layout, it is read-only for all the other records
+    auto result = interpret_mft_record(data, &disk_info, 0, mft_layout, buff.get(), disk_info.bytes_per_mft_record_,
+                                       PARAM_OUT inode_items, PARAM_OUT &mft_layout);
+
+    if (result) add_inode_items(data, nullptr, 0, inode_items);
 
-    if (!result || mft_data_bytes == 0 || mft_bitmap_bytes == 0) {
+    if (!result || mft_layout.data_bytes_ == 0 || mft_layout.bitmap_bytes_ == 0) {
         gui->show_debug(DebugLevel::Progress, nullptr, L"Fatal error, cannot process this disk.");
         Tree::delete_tree(data.item_tree_);
         data.item_tree_ = nullptr;
@@ -429,6 +408,6 @@ bool ScanNTFS::analyze_ntfs_volume_extract_mft(
 
     gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
                     std::format(L"MftDataBytes = " NUM_FMT ", MftBitmapBytes = " NUM_FMT,
-                                mft_data_bytes, mft_bitmap_bytes));
+                                mft_layout.data_bytes_, mft_layout.bitmap_bytes_));
     return true;
 }
@@ -17,16 +17,125 @@
 
 #include "precompiled_header.h"
 
+// Find the byte offset on disk of a record of the MFT. Return false if the Inode is outside the MFT.
+bool ScanNTFS::mft_record_offset(const NtfsDiskInfoStruct *disk_info,
+                                 const std::list<FileFragment> &mft_data_fragments, const uint64_t inode,
+                                 PARAM_OUT uint64_t &offset) {
+    uint64_t vcn = 0;
+    uint64_t real_vcn = 0;
+    const uint64_t bytes_per_cluster = disk_info->bytes_per_sector_ * disk_info->sectors_per_cluster_;
+    const uint64_t inode_vcn = inode * disk_info->bytes_per_mft_record_ / bytes_per_cluster;
+
+    for (auto &fragment: mft_data_fragments) {
+        if (!fragment.is_virtual()) {
+            if (inode_vcn >= real_vcn && inode_vcn < real_vcn + fragment.next_vcn_ - vcn) {
+                offset = (fragment.lcn_ - real_vcn) * bytes_per_cluster + inode * disk_info->bytes_per_mft_record_;
+                return true;
+            }
+
+            real_vcn = real_vcn + fragment.next_vcn_ - vcn;
+        }
+
+        vcn = fragment.next_vcn_;
+    }
+
+    return false;
+}
+
+void ScanNTFS::read_extension_records(DefragState &data, NtfsDiskInfoStruct *disk_info,
+                                      const std::list<FileFragment> &mft_data_fragments,
+                                      std::vector<uint64_t> &inodes) {
+    // Records that are next to each other in the MFT and on disk
+    struct RecordRun {
+        uint64_t first_inode_;
+        uint64_t count_;
+        uint64_t offset_;
+        std::unique_ptr<BYTE[]> buffer_;
+        bool started_;
+    };
+
+    DefragGui *gui = DefragGui::get_instance();
+    const uint64_t record_size = disk_info->bytes_per_mft_record_;
+
+    std::sort(inodes.begin(), inodes.end());
+    inodes.erase(std::unique(inodes.begin(), inodes.end()), inodes.end());
+
+    std::vector<RecordRun> runs;
+
+    for (auto inode: inodes) {
+        uint64_t offset;
+
+        if (record_cache_.contains(inode) || !mft_record_offset(disk_info, mft_data_fragments, inode, offset)) {
+            continue;
+        }
+
+        if (!runs.empty() &&
+            runs.back().first_inode_ + runs.back().count_ == inode &&
+            runs.back().offset_ + runs.back().count_ * record_size == offset &&
+            (runs.back().count_ + 1) * record_size <= MFT_BUFFER_SIZE) {
+            runs.back().count_++;
+        } else {
+            runs.push_back({.first_inode_ = inode, .count_ = 1, .offset_ = offset});
+        }
+    }
+
+    // Start a read for every run, with at most slot_count() of them in flight. The reads finish in the order
+    // they were started, so the slot of a run is its index modulo the number of slots.
+    const size_t slots = reader_->slot_count();
+    size_t started = 0;
+    std::vector<uint64_t> valid;
+
+    for (size_t finished = 0; finished < runs.size(); finished++) {
+        for (; started < runs.size() && started < finished + slots; started++) {
+            RecordRun &run = runs[started];
+
+            run.buffer_ = std::make_unique<BYTE[]>(run.count_ * record_size);
+            run.started_ = reader_->begin_read(started % slots, run.offset_, run.buffer_.get(),
+                                               run.count_ * record_size);
+            record_cache_.reads_++;
+        }
+
+        RecordRun &run = runs[finished];
+
+        if (!run.started_ || !reader_->finish_read(finished % slots)) {
+            gui->show_debug(DebugLevel::Progress, nullptr,
+                            std::format(L"      Error while reading Inode " NUM_FMT ": reason {}", run.first_inode_,
+                                        Str::system_error(GetLastError())));
+            continue;
+        }
+
+        // Fixup the raw data of the whole run
+        fixup_mft_block(*disk_info, run.buffer_.get(), run.count_, PARAM_OUT valid);
+
+        for (uint64_t i = 0; i < run.count_; i++) {
+            BYTE *record = run.buffer_.get() + i * record_size;
+
+            if ((valid[i / 64] & (1ULL << (i % 64))) == 0) {
+                gui->show_debug(DebugLevel::Progress, nullptr,
+                                std::format(L"Inode " NUM_FMT " is not a valid MFT record, or its USA fixup failed, "
+                                            "the MFT may be corrupt.", run.first_inode_ + i));
+                continue;
+            }
+
+            record_cache_.insert(run.first_inode_ + i, std::vector<BYTE>(record, record + record_size));
+            record_cache_.records_read_++;
+        }
+    }
+}
+
+// Extract the referenced Inode of an entry in an AttributeList
+static uint64_t attribute_list_inode(const ATTRIBUTE_LIST *attribute) {
+    return (uint64_t) attribute->file_reference_number_.inode_number_low_part_ +
+           ((uint64_t) attribute->file_reference_number_.inode_number_high_part_ << 32);
+}
+
 /**
  * \brief Process a list of attributes and store the gathered information in the Item struct. Return FALSE if an error occurred.
  */
 void
 ScanNTFS::process_attribute_list(DefragState &data, NtfsDiskInfoStruct *disk_info, InodeDataStruct *inode_data,
                                  BYTE *buffer, const uint64_t buf_length, const int depth) {
-    std::unique_ptr<BYTE[]> buffer_2;
     ATTRIBUTE_LIST *attribute;
-    OVERLAPPED g_overlapped;
-    DWORD bytes_read;
     DefragGui *gui = DefragGui::get_instance();
 
     // Sanity checks
@@ -41,6 +150,27 @@ ScanNTFS::process_attribute_list(DefragState &data, NtfsDiskInfoStruct *disk_inf
                     std::format(L"    Processing AttributeList for Inode " NUM_FMT ", " NUM_FMT " bytes",
                                 inode_data->inode_, buf_length));
 
+    // Collect the referenced Inodes that are not in the record cache, and read them together
+    std::vector<uint64_t> missing;
+
+    for (ULONG attribute_offset = 0;
+         attribute_offset < buf_length; attribute_offset = attribute_offset + attribute->length_) {
+        attribute = (ATTRIBUTE_LIST *) &buffer[attribute_offset];
+
+        if (attribute_offset + 3 > buf_length) break;
+        if (*(ULONG *) attribute == 0xFFFFFFFF) break;
+        if (attribute->length_ < 3) break;
+        if (attribute_offset + attribute->length_ > buf_length) break;
+
+        const uint64_t ref_inode = attribute_list_inode(attribute);
+
+        if (ref_inode != inode_data->inode_ && !record_cache_.contains(ref_inode)) missing.push_back(ref_inode);
+    }
+
+    if (!missing.empty()) {
+        read_extension_records(data, disk_info, inode_data->mft_layout_->data_fragments_, missing);
+    }
+
     // Walk through all the attributes and gather information
     for (ULONG attribute_offset = 0;
          attribute_offset < buf_length; attribute_offset = attribute_offset + attribute->length_) {
@@ -57,8 +187,7 @@ ScanNTFS::process_attribute_list(DefragState &data, NtfsDiskInfoStruct *disk_inf
         // Extract the referenced Inode. If it's the same as the calling Inode then ignore
         // (if we don't ignore then the program will loop forever, because for some
         // reason the info in the calling Inode is duplicated here...).
-        const uint64_t ref_inode = (uint64_t) attribute->file_reference_number_.inode_number_low_part_ +
-                                   ((uint64_t) attribute->file_reference_number_.inode_number_high_part_ << 32);
+        const uint64_t ref_inode = attribute_list_inode(attribute);
 
         if (ref_inode == inode_data->inode_) continue;
 
@@ -85,70 +214,23 @@ ScanNTFS::process_attribute_list(DefragState &data, NtfsDiskInfoStruct *disk_inf
                             std::format(L"      AttributeList name = '{}'", p1.get()));
         }
 
-        // Find the fragment in the MFT that contains the referenced Inode
-        uint64_t vcn = 0;
-        uint64_t real_vcn = 0;
-        const uint64_t ref_inode_vcn = ref_inode * disk_info->bytes_per_mft_record_ /
-                                       (disk_info->bytes_per_sector_ * disk_info->sectors_per_cluster_);
-
-        auto fragment = inode_data->mft_data_fragments_.begin();
+        // Fetch the fixed-up record of the referenced Inode from the record cache
+        record_cache_.lookups_++;
 
-        for (; fragment != inode_data->mft_data_fragments_.end(); fragment++) {
-            if (!fragment->is_virtual()) {
-                if (ref_inode_vcn >= real_vcn && ref_inode_vcn < real_vcn + fragment->next_vcn_ - vcn) {
-                    break;
-                }
-
-                real_vcn = real_vcn + fragment->next_vcn_ - vcn;
-            }
-
-            vcn = fragment->next_vcn_;
-        }
+        BYTE *buffer_2 = record_cache_.find(ref_inode);
 
-        if (fragment == inode_data->mft_data_fragments_.end()) {
+        if (buffer_2 == nullptr) {
             gui->show_debug(
                     DebugLevel::DetailedGapFinding, nullptr,
                     std::format(
-                            L"      Error: Inode " NUM_FMT " is an extension of Inode " NUM_FMT ", but does not exist (outside the MFT).",
+                            L"      Error: Inode " NUM_FMT " is an extension of Inode " NUM_FMT ", but could not be read.",
                             ref_inode, inode_data->inode_));
 
             continue;
         }
 
-        // Fetch the record of the referenced Inode from disk
-        buffer_2 = std::make_unique<BYTE[]>((size_t) disk_info->bytes_per_mft_record_);
-
-        ULARGE_INTEGER trans;
-        trans.QuadPart = ((fragment->lcn_ - real_vcn)
-                          * disk_info->bytes_per_sector_
-                          * disk_info->sectors_per_cluster_)
-                         + ref_inode * disk_info->bytes_per_mft_record_;
-
-        g_overlapped.Offset = trans.LowPart;
-        g_overlapped.OffsetHigh = trans.HighPart;
-        g_overlapped.hEvent = nullptr;
-
-        int result = ReadFile(data.disk_.volume_handle_, buffer_2.get(), (uint32_t) disk_info->bytes_per_mft_record_,
-                              &bytes_read,
-                              &g_overlapped);
-
-        if (result == 0 || bytes_read != disk_info->bytes_per_mft_record_) {
-            gui->show_debug(DebugLevel::Progress, nullptr,
-                            std::format(L"      Error while reading Inode " NUM_FMT ": reason {}", ref_inode,
-                                        Str::system_error(GetLastError())));
-            return;
-        }
-
-        // Fixup the raw data
-        if (fixup_raw_mftdata(data, disk_info, buffer_2.get(), disk_info->bytes_per_mft_record_) == FALSE) {
-            gui->show_debug(DebugLevel::Progress, nullptr,
-                            std::format(L"The error occurred while processing Inode " NUM_FMT, ref_inode));
-
-            continue;
-        }
-
         // If the Inode is not in use then skip.
-        const auto file_record_header = (FILE_RECORD_HEADER *) buffer_2.get();
+        const auto file_record_header = (FILE_RECORD_HEADER *) buffer_2;
 
         if ((file_record_header->flags_ & 1) != 1) {
             gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
@@ -174,10 +256,10 @@ ScanNTFS::process_attribute_list(DefragState &data, NtfsDiskInfoStruct *disk_inf
                         std::format(L"      Processing Inode " NUM_FMT " Instance {}", ref_inode,
                                     attribute->instance_));
 
-        result = process_attributes(data, disk_info, inode_data,
-                                    &buffer_2[file_record_header->attribute_offset_],
-                                    disk_info->bytes_per_mft_record_ - file_record_header->attribute_offset_,
-                                    attribute->instance_, depth + 1);
+        process_attributes(data, disk_info, inode_data,
+                           &buffer_2[file_record_header->attribute_offset_],
+                           disk_info->bytes_per_mft_record_ - file_record_header->attribute_offset_,
+                           attribute->instance_, depth + 1);
 
         gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
                         std::format(L"      Finished processing Inode " NUM_FMT " Instance {}",
@@ -332,17 +414,19 @@ bool ScanNTFS::process_attributes(DefragState &data, NtfsDiskInfoStruct *disk_in
 
             // Special case: If this is the $MFT (intent: to save data,
             // but for real with STL data structures, there's not much saving now)
-            if (inode_data->inode_ == 0) {
+            MftLayout *builder = inode_data->mft_layout_builder_;
+
+            if (inode_data->inode_ == 0 && builder != nullptr) {
                 if (attribute->attribute_type_ == ATTRIBUTE_TYPE::AttributeData
-                    && inode_data->mft_data_fragments_.empty()) {
-                    inode_data->mft_data_fragments_ = inode_data->streams_.begin()->fragments_;
-                    inode_data->mft_data_bytes_ = nonresident_attribute->data_size_;
+                    && builder->data_fragments_.empty()) {
+                    builder->data_fragments_ = inode_data->streams_.begin()->fragments_;
+                    builder->data_bytes_ = nonresident_attribute->data_size_;
                 }
 
                 if (attribute->attribute_type_ == ATTRIBUTE_TYPE::AttributeBitmap
-                    && inode_data->mft_bitmap_fragments_.empty()) {
-                    inode_data->mft_bitmap_fragments_ = inode_data->streams_.begin()->fragments_;
-                    inode_data->mft_bitmap_bytes_ = nonresident_attribute->data_size_;
+                    && builder->bitmap_fragments_.empty()) {
+                    builder->bitmap_fragments_ = inode_data->streams_.begin()->fragments_;
+                    builder->bitmap_bytes_ = nonresident_attribute->data_size_;
                 }
             }
         }
@@ -18,14 +18,14 @@
 #include "precompiled_header.h"
 
 bool ScanNTFS::interpret_mft_record(
-        DefragState &data, NtfsDiskInfoStruct *disk_info, FileNode **inode_array,
-        const uint64_t inode_number, const uint64_t max_inode,
-        PARAM_OUT std::list<FileFragment> &mft_data_fragments, PARAM_OUT uint64_t &mft_data_bytes,
-        PARAM_OUT std::list<FileFragment> &mft_bitmap_fragments, PARAM_OUT uint64_t &mft_bitmap_bytes,
-        BYTE *buffer, const uint64_t buf_length
+        DefragState &data, NtfsDiskInfoStruct *disk_info, const uint64_t inode_number, const MftLayout &mft_layout,
+        BYTE *buffer, const uint64_t buf_length, PARAM_OUT InodeItems &inode_items,
+        PARAM_OUT MftLayout *mft_layout_builder
 ) {
     DefragGui *gui = DefragGui::get_instance();
 
+    inode_items = {.inode_ = inode_number};
+
     // If the record is not in use then quietly exit
     const FILE_RECORD_HEADER *file_record_header = (FILE_RECORD_HEADER *) buffer;
 
@@ -99,10 +99,8 @@ bool ScanNTFS::interpret_mft_record(
             .creation_time_ = {},
             .mft_change_time_ = {},
             .last_access_time_ = {},
-            .mft_data_fragments_ = mft_data_fragments,
-            .mft_data_bytes_ = mft_data_bytes,
-            .mft_bitmap_fragments_ = mft_bitmap_fragments,
-            .mft_bitmap_bytes_ = 0,
+            .mft_layout_ = &mft_layout,
+            .mft_layout_builder_ = mft_layout_builder,
     };
 
     // Make sure that directories are always created
@@ -117,14 +115,6 @@ bool ScanNTFS::interpret_mft_record(
                                                      &buffer[file_record_header->attribute_offset_],
                                                      buf_length - file_record_header->attribute_offset_, 65535, 0);
 
-    // Save the mft_data_fragments, mft_data_bytes, mft_bitmap_fragments, and MftBitmapBytes
-    if (inode_number == 0) {
-        mft_data_fragments = inode_data.mft_data_fragments_;
-        mft_data_bytes = inode_data.mft_data_bytes_;
-        mft_bitmap_fragments = inode_data.mft_bitmap_fragments_;
-        mft_bitmap_bytes = inode_data.mft_bitmap_bytes_;
-    }
-
     // Create an item in the data.ItemTree for every stream
     auto stream_iter = inode_data.streams_.begin();
 
@@ -137,7 +127,7 @@ bool ScanNTFS::interpret_mft_record(
         auto short_fn_constructed = construct_stream_name(inode_data.short_filename_.get(),
                                                           inode_data.long_filename_.get(),
                                                           &*stream_iter);
-        item->set_names(L"", long_fn_constructed.c_str(), nullptr, short_fn_constructed.c_str());
+        item->set_filenames(std::move(long_fn_constructed), std::move(short_fn_constructed));
 
         item->bytes_ = inode_data.bytes_;
 
@@ -152,8 +142,10 @@ bool ScanNTFS::interpret_mft_record(
         item->last_access_time_ = inode_data.last_access_time_;
         item->fragments_.clear();
 
-        if (stream_iter != inode_data.streams_.end()) item->fragments_ = stream_iter->fragments_;
+        // The stream is not used after this, its fragments are moved into the item
+        if (stream_iter != inode_data.streams_.end()) item->fragments_ = std::move(stream_iter->fragments_);
 
+        item->inode_ = inode_number;
         item->parent_inode_ = inode_data.parent_inode_;
         item->is_dir_ = inode_data.is_directory_;
         item->is_unmovable_ = false;
@@ -162,29 +154,59 @@ bool ScanNTFS::interpret_mft_record(
 
         // Increment counters
         if (item->is_dir_) {
-            data.count_directories_ += 1;
+            inode_items.count_directories_ += 1;
         }
 
-        data.count_all_files_ += 1;
+        inode_items.count_all_files_ += 1;
 
         if (stream_iter != inode_data.streams_.end() && stream_iter->stream_type_ == ATTRIBUTE_TYPE::AttributeData) {
-            data.count_all_bytes_ += inode_data.bytes_;
+            inode_items.count_all_bytes_ += inode_data.bytes_;
         }
 
-        if (stream_iter != inode_data.streams_.end()) data.count_all_clusters_ += stream_iter->clusters_;
+        if (stream_iter != inode_data.streams_.end()) inode_items.count_all_clusters_ += stream_iter->clusters_;
 
         if (DefragRunner::get_fragment_count(item.get()) > 1) {
-            data.count_fragmented_items_ += 1;
-            data.count_fragmented_bytes_ += inode_data.bytes_;
+            inode_items.count_fragmented_items_ += 1;
+            inode_items.count_fragmented_bytes_ += inode_data.bytes_;
 
             if (stream_iter != inode_data.streams_.end()) {
-                data.count_fragmented_clusters_ += stream_iter->clusters_;
+                inode_items.count_fragmented_clusters_ += stream_iter->clusters_;
             }
         }
 
+        // The item is added to the tree later, by add_inode_items()
+        inode_items.items_.push_back(std::move(item));
+
+        stream_iter++;
+    };
+
+    // Cleanup and return TRUE
+    inode_data.long_filename_.reset();
+    inode_data.short_filename_.reset();
+
+    // cleanup_streams(&inode_data);
+    inode_data.streams_.clear();
+
+    return true;
+}
+
+void ScanNTFS::add_inode_items(DefragState &data, FileNode **inode_array, const uint64_t max_inode,
+                               InodeItems &inode_items) const {
+    DefragGui *gui = DefragGui::get_instance();
+    const uint64_t inode_number = inode_items.inode_;
+
+    data.count_directories_ += inode_items.count_directories_;
+    data.count_all_files_ += inode_items.count_all_files_;
+    data.count_all_bytes_ += inode_items.count_all_bytes_;
+    data.count_all_clusters_ += inode_items.count_all_clusters_;
+    data.count_fragmented_items_ += inode_items.count_fragmented_items_;
+    data.count_fragmented_bytes_ += inode_items.count_fragmented_bytes_;
+    data.count_fragmented_clusters_ += inode_items.count_fragmented_clusters_;
+
+    for (auto &item: inode_items.items_) {
         // Add the item record to the sorted item tree in memory
         auto last_created_item = item.release();
-        Tree::insert(data.item_tree_, data.balance_count_, last_created_item);
+        Tree::insert(data.item_tree_, data.tree_statistics_, last_created_item);
 
         // Also add the item to the array that is used to construct the full pathnames.
         // Note: if the array already contains an entry, and the new item has a shorter
@@ -203,18 +225,34 @@ bool ScanNTFS::interpret_mft_record(
         // Draw the item on the screen.
         gui->show_analyze(data, last_created_item);
         defrag_lib_->colorize_disk_item(data, last_created_item, 0, 0, false);
+    }
 
-        stream_iter++;
-    };
+    inode_items.items_.clear();
+}
 
-    // Cleanup and return TRUE
-    inode_data.long_filename_.reset();
-    inode_data.short_filename_.reset();
+// Return true if the record is a base record in use, and has an AttributeList. Some of its attributes are then
+// stored in other records of the MFT, which have to be read separately.
+bool ScanNTFS::has_attribute_list(const BYTE *buffer, const uint64_t buf_length) {
+    const auto file_record_header = (const FILE_RECORD_HEADER *) buffer;
 
-    // cleanup_streams(&inode_data);
-    inode_data.streams_.clear();
+    if ((file_record_header->flags_ & 1) != 1) return false;
+    if (file_record_header->base_file_record_.inode_number_low_part_ != 0 ||
+        file_record_header->base_file_record_.inode_number_high_part_ != 0) {
+        return false;
+    }
 
-    return true;
+    for (uint64_t attribute_offset = file_record_header->attribute_offset_;
+         attribute_offset + sizeof(ATTRIBUTE) <= buf_length;) {
+        const auto attribute = (const ATTRIBUTE *) &buffer[attribute_offset];
+
+        if (*(const ULONG *) attribute == 0xFFFFFFFF) break;
+        if (attribute->attribute_type_ == ATTRIBUTE_TYPE::AttributeAttributeList) return true;
+        if (attribute->length_ < 3) break;
+
+        attribute_offset = attribute_offset + attribute->length_;
+    }
+
+    return false;
 }
 
 /*
@@ -266,7 +304,9 @@ bool ScanNTFS::fixup_raw_mftdata(DefragState &data, const NtfsDiskInfoStruct *di
         // Check if we are inside the buffer
         if (index * sizeof(WORD) >= buf_length) {
             gui->show_debug(DebugLevel::Progress, nullptr,
-                            L"Warning: USA data indicates that data is missing, the MFT may be corrupt.");
+                            L"Error: USA data indicates that data is missing, the MFT may be corrupt.");
+
+            return false;
         }
 
         /* Check if the last 2 bytes of the sector contain the Update Sequence Number.
@@ -286,3 +326,56 @@ bool ScanNTFS::fixup_raw_mftdata(DefragState &data, const NtfsDiskInfoStruct *di
 
     return true;
 }
+
+/**
+ * \brief Fixup all the records in a block in one pass, without the messages of fixup_raw_mftdata().
+ * \param valid Bit i is set if record i starts with FILE, its Update Sequence Array fits in the record, and all
+ * its sector tails hold the Update Sequence Number. Only those records are fixed up, the others are untouched.
+ */
+void ScanNTFS::fixup_mft_block(const NtfsDiskInfoStruct &disk_info, BYTE *buffer, const uint64_t record_count,
+                               PARAM_OUT std::vector<uint64_t> &valid) {
+    const uint64_t record_size = disk_info.bytes_per_mft_record_;
+    const uint64_t sector_words = disk_info.bytes_per_sector_ / sizeof(WORD);
+    const uint64_t max_sectors = record_size / disk_info.bytes_per_sector_;
+    uint32_t file_magic;
+
+    memcpy(&file_magic, "FILE", sizeof file_magic);
+    valid.assign((record_count + 63) / 64, 0);
+
+    // Check all the records first. The sector tails are compared without a branch, a record is valid if none of
+    // them differ from its Update Sequence Number.
+    for (uint64_t r = 0; r < record_count; r++) {
+        const BYTE *record = buffer + r * record_size;
+        const auto record_header = (const NTFS_RECORD_HEADER *) record;
+        const uint64_t sectors = record_header->usa_count_ > 0 ? record_header->usa_count_ - 1 : 0;
+
+        if (record_header->type_ != file_magic || sectors > max_sectors ||
+            record_header->usa_offset_ + record_header->usa_count_ * sizeof(WORD) > record_size) {
+            continue;
+        }
+
+        const auto record_w = (const WORD *) record;
+        const WORD sequence_number = *(const WORD *) &record[record_header->usa_offset_];
+        WORD mismatch = 0;
+
+        for (uint64_t s = 1; s <= sectors; s++) {
+            mismatch |= record_w[s * sector_words - 1] ^ sequence_number;
+        }
+
+        valid[r / 64] |= (uint64_t) (mismatch == 0) << (r % 64);
+    }
+
+    // Then restore the sector tails of the valid records from their Update Sequence Array
+    for (uint64_t w = 0; w < valid.size(); w++) {
+        for (uint64_t bits = valid[w]; bits != 0; bits &= bits - 1) {
+            BYTE *record = buffer + (w * 64 + std::countr_zero(bits)) * record_size;
+            const auto record_header = (const NTFS_RECORD_HEADER *) record;
+            const auto record_w = (WORD *) record;
+            const auto update_sequence_array = (const WORD *) &record[record_header->usa_offset_];
+
+            for (USHORT s = 1; s < record_header->usa_count_; s++) {
+                record_w[s * sector_words - 1] = update_sequence_array[s];
+            }
+        }
+    }
+}
@@ -0,0 +1,395 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+// Upper limit for the number of threads that interpret MFT records
+constexpr size_t MFT_MAX_THREADS = 8;
+// Number of blocks that can wait in a queue for every worker thread
+constexpr size_t MFT_QUEUE_BLOCKS_PER_THREAD = 2;
+// The block size is doubled when a read takes less than half of this, and halved when it takes more than double
+constexpr auto MFT_TARGET_READ_TIME = std::chrono::milliseconds(20);
+
+// A block of raw MFT records, as read from disk
+struct MftBlock {
+    uint64_t sequence_;
+    uint64_t first_inode_;
+    uint64_t inode_count_;
+    std::unique_ptr<BYTE[]> buffer_;
+};
+
+// A block that is being read from disk
+struct MftRead {
+    MftBlock block_;
+    size_t slot_;
+    Clock::time_point started_;
+};
+
+uint64_t ScanNTFS::find_mft_ranges(const BYTE *mft_bitmap, const uint64_t max_inode, const uint64_t max_gap,
+                                   PARAM_OUT std::vector<MftRange> &ranges) {
+    uint64_t in_use = 0;
+
+    ranges.clear();
+
+    for (uint64_t word_start = 0; word_start < max_inode; word_start += 64) {
+        // The bitmap is not a multiple of 8 bytes long, the last word is read partially
+        uint64_t word = 0;
+        std::memcpy(&word, &mft_bitmap[word_start / 8], std::min<uint64_t>(8, (max_inode - word_start + 7) / 8));
+
+        if (max_inode - word_start < 64) word &= (1ULL << (max_inode - word_start)) - 1;
+
+        // Inode 0 is the $MFT itself, it was processed before
+        if (word_start == 0) word &= ~1ULL;
+
+        in_use += std::popcount(word);
+
+        // Turn every run of 1 bits into a range, or extend the previous range
+        while (word != 0) {
+            const int first = std::countr_zero(word);
+            const int run = std::countr_one(word >> first);
+            const uint64_t begin = word_start + first;
+            const uint64_t end = begin + run;
+
+            if (!ranges.empty() && begin - ranges.back().end_inode_ <= max_gap) {
+                ranges.back().end_inode_ = end;
+            } else {
+                ranges.push_back({.first_inode_ = begin, .end_inode_ = end});
+            }
+
+            if (first + run == 64) break;
+
+            word &= ~((1ULL << (first + run)) - 1);
+        }
+    }
+
+    return in_use;
+}
+
+// Fixup the whole block and interpret all the records in it that are in use. Records with an AttributeList are not
+// interpreted but copied into batch.deferred_, they need more reads from disk. Extension records are copied
+// into batch.extensions_, so the records with an AttributeList do not have to read them again.
+void ScanNTFS::interpret_mft_block(
+        DefragState &data, NtfsDiskInfoStruct &disk_info, const BYTE *mft_bitmap, const uint64_t max_inode,
+        const MftLayout &mft_layout, const uint64_t first_inode, const uint64_t inode_count, BYTE *buffer,
+        PARAM_OUT MftBatch &batch) {
+    DefragGui *gui = DefragGui::get_instance();
+    std::vector<uint64_t> valid;
+
+    fixup_mft_block(disk_info, buffer, inode_count, PARAM_OUT valid);
+
+    for (uint64_t i = 0; i < inode_count; i++) {
+        const uint64_t inode_number = first_inode + i;
+
+        if (inode_number >= max_inode) break;
+
+        // Ignore the Inode if the bitmap says it's not in use
+        if ((mft_bitmap[inode_number >> 3] & (1 << (inode_number % 8))) == 0) {
+            gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
+                            std::format(L"Inode " NUM_FMT " is not in use.", inode_number));
+            continue;
+        }
+
+        batch.records_in_use_++;
+
+        // The raw data of this Inode was fixed up with the rest of the block
+        BYTE *record = buffer + i * disk_info.bytes_per_mft_record_;
+
+        if ((valid[i / 64] & (1ULL << (i % 64))) == 0) {
+            gui->show_debug(
+                    DebugLevel::Progress, nullptr,
+                    std::format(L"Inode " NUM_FMT " (max " NUM_FMT ") is not a valid MFT record, or its USA fixup "
+                                "failed, the MFT may be corrupt.", inode_number, max_inode));
+            continue;
+        }
+
+        if (has_attribute_list(record, disk_info.bytes_per_mft_record_)) {
+            batch.deferred_.push_back({.inode_ = inode_number,
+                                       .record_ = std::vector<BYTE>(record, record + disk_info.bytes_per_mft_record_)});
+            continue;
+        }
+
+        const auto file_record_header = (const FILE_RECORD_HEADER *) record;
+
+        if ((file_record_header->flags_ & 1) == 1 &&
+            (file_record_header->base_file_record_.inode_number_low_part_ != 0 ||
+             file_record_header->base_file_record_.inode_number_high_part_ != 0)) {
+            batch.extensions_.push_back({.inode_ = inode_number,
+                                         .record_ = std::vector<BYTE>(record, record + disk_info.bytes_per_mft_record_)});
+            continue;
+        }
+
+        // Interpret the Inode's attributes
+        InodeItems inode_items;
+
+        if (interpret_mft_record(data, &disk_info, inode_number, mft_layout, record, disk_info.bytes_per_mft_record_,
+                                 PARAM_OUT inode_items)
+            && !inode_items.items_.empty()) {
+            batch.inodes_.push_back(std::move(inode_items));
+        }
+    }
+}
+
+bool ScanNTFS::read_mft_records(
+        DefragState &data, VolumeReader &reader, NtfsDiskInfoStruct &disk_info, const BYTE *mft_bitmap,
+        const std::vector<MftRange> &ranges, FileNode **inode_array, const uint64_t max_inode,
+        const MftLayout &mft_layout) {
+    DefragGui *gui = DefragGui::get_instance();
+
+    const size_t thread_count = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, MFT_MAX_THREADS);
+    WorkQueue<MftBlock> blocks(thread_count * MFT_QUEUE_BLOCKS_PER_THREAD);
+    WorkQueue<MftBatch> batches(thread_count * MFT_QUEUE_BLOCKS_PER_THREAD);
+    std::vector<MftRecordCopy> deferred;
+
+    // The workers turn blocks into batches of items. They do not touch the tree or the counters.
+    auto worker = [&]() {
+        while (auto block = blocks.pop()) {
+            MftBatch batch{.sequence_ = block->sequence_};
+
+            interpret_mft_block(data, disk_info, mft_bitmap, max_inode, mft_layout, block->first_inode_,
+                                block->inode_count_, block->buffer_.get(), PARAM_OUT batch);
+
+            if (!batches.push(std::move(batch))) break;
+        }
+    };
+
+    // The merger adds the batches to the tree in the order they were read, so the result does not depend on
+    // which worker finished first.
+    auto merger = [&]() {
+        std::map<uint64_t, MftBatch> pending;
+        uint64_t next_sequence = 0;
+
+        while (auto batch = batches.pop()) {
+            pending.emplace(batch->sequence_, std::move(*batch));
+
+            for (auto it = pending.find(next_sequence); it != pending.end(); it = pending.find(next_sequence)) {
+                for (auto &inode_items: it->second.inodes_) {
+                    add_inode_items(data, inode_array, max_inode, inode_items);
+                }
+
+                std::move(it->second.deferred_.begin(), it->second.deferred_.end(), std::back_inserter(deferred));
+
+                for (auto &extension: it->second.extensions_) {
+                    record_cache_.insert(extension.inode_, std::move(extension.record_));
+                }
+
+                // Update the progress counter
+                data.clusters_done_ += it->second.records_in_use_;
+
+                pending.erase(it);
+                next_sequence++;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+
+    for (size_t i = 0; i < thread_count; i++) {
+        workers.emplace_back(worker);
+    }
+
+    std::thread merge_thread(merger);
+
+    // Read the MFT block by block on this thread and hand the blocks to the workers. A number of reads are kept
+    // in flight, so the disk is busy with the next blocks while this thread waits for the oldest one.
+    auto fragment = mft_layout.data_fragments_.begin();
+    uint64_t vcn = 0;
+    uint64_t real_vcn = 0;
+    uint64_t sequence = 0;
+    bool result = true;
+
+    std::deque<MftRead> in_flight;
+    size_t block_size = MFT_BUFFER_SIZE;
+    Clock::time_point last_completion = Clock::now();
+
+    // Wait for the oldest read and hand its block to the workers. The block size is adapted to the time the disk
+    // needed for this read, which is the time since it was started or since the previous read completed.
+    auto finish_oldest_read = [&]() -> bool {
+        MftRead read = std::move(in_flight.front());
+        in_flight.pop_front();
+
+        if (!reader.finish_read(read.slot_)) {
+            gui->show_debug(DebugLevel::Progress, nullptr,
+                            std::format(L"Error while reading Inodes " NUM_FMT " to " NUM_FMT ": reason {}",
+                                        read.block_.first_inode_,
+                                        read.block_.first_inode_ + read.block_.inode_count_ - 1,
+                                        Str::system_error(GetLastError())));
+            return false;
+        }
+
+        const Clock::time_point now = Clock::now();
+        const auto read_time = now - (read.started_ > last_completion ? read.started_ : last_completion);
+        last_completion = now;
+
+        if (read_time < MFT_TARGET_READ_TIME / 2 && block_size < MFT_MAX_BLOCK_SIZE) {
+            block_size *= 2;
+        } else if (read_time > MFT_TARGET_READ_TIME * 2 && block_size > MFT_BUFFER_SIZE) {
+            block_size /= 2;
+        }
+
+        blocks.push(std::move(read.block_));
+        return true;
+    };
+
+    // Only the ranges that are in use are read, a range is cut into blocks
+    size_t range_index = 0;
+    uint64_t inode_number = ranges.empty() ? 0 : ranges[0].first_inode_;
+
+    while (range_index < ranges.size()) {
+        if (*data.running_ != RunningState::RUNNING) break;
+
+        if (inode_number >= ranges[range_index].end_inode_) {
+            range_index++;
+
+            if (range_index < ranges.size()) inode_number = ranges[range_index].first_inode_;
+
+            continue;
+        }
+
+        // Slow the program down to the percentage that was specified on the command line
+        DefragRunner::slow_down(data);
+
+        const uint64_t block_start = inode_number;
+        uint64_t block_end = block_start + block_size / disk_info.bytes_per_mft_record_;
+
+        if (block_end > ranges[range_index].end_inode_) block_end = ranges[range_index].end_inode_;
+
+        uint64_t u1 = 0;
+
+        while (fragment != mft_layout.data_fragments_.end()) {
+            // Calculate Inode at the end of the fragment
+            u1 = (real_vcn + fragment->next_vcn_ - vcn) * disk_info.bytes_per_sector_ *
+                 disk_info.sectors_per_cluster_ / disk_info.bytes_per_mft_record_;
+
+            if (u1 > inode_number) break;
+
+            do {
+                gui->show_debug(DebugLevel::DetailedGapFinding, nullptr, L"Skipping to next extent");
+
+                if (!fragment->is_virtual()) {
+                    real_vcn = real_vcn + fragment->next_vcn_ - vcn;
+                }
+
+                vcn = fragment->next_vcn_;
+                fragment++;
+
+                if (fragment == mft_layout.data_fragments_.end()) break;
+            } while (fragment->is_virtual());
+
+            if (fragment != mft_layout.data_fragments_.end()) {
+                gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
+                                std::format(L"  Extent Lcn=" NUM_FMT ", RealVcn=" NUM_FMT ", Size=" NUM_FMT,
+                                            fragment->lcn_, real_vcn, fragment->next_vcn_ - vcn));
+            }
+        }
+
+        if (fragment == mft_layout.data_fragments_.end()) break;
+        if (block_end >= u1) block_end = u1;
+
+        const uint64_t offset =
+                (fragment->lcn_ - real_vcn) * disk_info.bytes_per_sector_ * disk_info.sectors_per_cluster_ +
+                block_start * disk_info.bytes_per_mft_record_;
+        const uint64_t block_bytes = (block_end - block_start) * disk_info.bytes_per_mft_record_;
+
+        gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
+                        std::format(L"Reading block of " NUM_FMT " Inodes from MFT into memory, " NUM_FMT
+                                    " bytes from LCN=" NUM_FMT,
+                                    block_end - block_start, block_bytes,
+                                    offset / (disk_info.bytes_per_sector_ * disk_info.sectors_per_cluster_)));
+
+        // All the slots are busy, wait for the oldest read. The reads finish in the order they were started, so
+        // the slot of the oldest read is the one to use next.
+        if (in_flight.size() == reader.slot_count() && !finish_oldest_read()) {
+            result = false;
+            break;
+        }
+
+        MftRead read{.block_ = {.sequence_ = sequence,
+                                .first_inode_ = block_start,
+                                .inode_count_ = block_end - block_start,
+                                .buffer_ = std::make_unique<BYTE[]>(block_bytes)},
+                     .slot_ = sequence % reader.slot_count(),
+                     .started_ = Clock::now()};
+
+        if (!reader.begin_read(read.slot_, offset, read.block_.buffer_.get(), block_bytes)) {
+            gui->show_debug(DebugLevel::Progress, nullptr,
+                            std::format(L"Error while reading Inodes " NUM_FMT " to " NUM_FMT ": reason {}",
+                                        block_start, block_end - 1, Str::system_error(GetLastError())));
+            result = false;
+            break;
+        }
+
+        in_flight.push_back(std::move(read));
+        sequence++;
+        inode_number = block_end;
+    }
+
+    // Wait for the reads that are still in flight. After an error their data is not used, but the buffers have
+    // to stay valid until the reads are done.
+    while (!in_flight.empty()) {
+        if (result) {
+            result = finish_oldest_read();
+        } else {
+            reader.finish_read(in_flight.front().slot_);
+            in_flight.pop_front();
+        }
+    }
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"  Read the MFT in " NUM_FMT " blocks, last block size " NUM_FMT " bytes",
+                                sequence, block_size));
+
+    // Let the workers finish the blocks in the queue, then let the merger finish the batches
+    blocks.close();
+
+    for (auto &each_worker: workers) {
+        each_worker.join();
+    }
+
+    batches.close();
+    merge_thread.join();
+
+    if (!result || *data.running_ != RunningState::RUNNING) {
+        record_cache_.clear();
+        return result;
+    }
+
+    // Interpret the records with an AttributeList. Most of their extension records are in the record cache by
+    // now, the others are read from disk, so this is done on this thread after all the blocks are done.
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"  Interpreted the MFT on {} threads, " NUM_FMT " Inodes with an AttributeList",
+                                thread_count, deferred.size()));
+
+    for (auto &record: deferred) {
+        if (*data.running_ != RunningState::RUNNING) break;
+
+        InodeItems inode_items;
+
+        if (interpret_mft_record(data, &disk_info, record.inode_, mft_layout, record.record_.data(),
+                                 record.record_.size(), PARAM_OUT inode_items)) {
+            add_inode_items(data, inode_array, max_inode, inode_items);
+        }
+    }
+
+    gui->show_debug(DebugLevel::DetailedProgress, nullptr,
+                    std::format(L"  AttributeLists: " NUM_FMT " extension records used, " NUM_FMT
+                                " of them read from disk with " NUM_FMT " reads",
+                                record_cache_.lookups_, record_cache_.records_read_,
+                                record_cache_.reads_));
+
+    record_cache_.clear();
+    return true;
+}
@@ -0,0 +1,107 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+#include <array>
+
+// The fields are copied straight into an integer, which only gives the right value on a little-endian machine
+static_assert(std::endian::native == std::endian::little);
+
+struct RunHeader {
+    uint8_t length_size_;
+    uint8_t offset_size_;
+    bool valid_;
+};
+
+// Field sizes for every possible header byte. Fields larger than 8 bytes do not fit in 64 bits.
+constexpr std::array<RunHeader, 256> RUN_HEADERS = [] {
+    std::array<RunHeader, 256> table{};
+
+    for (size_t i = 0; i < table.size(); i++) {
+        const auto length_size = (uint8_t) (i & 0x0F);
+        const auto offset_size = (uint8_t) (i >> 4);
+
+        table[i] = {length_size, offset_size, length_size <= 8 && offset_size <= 8};
+    }
+
+    return table;
+}();
+
+// Mask to cut an 8-byte load down to a field of 0 to 8 bytes
+constexpr uint64_t FIELD_MASKS[9] = {
+        0, 0xFF, 0xFFFF, 0xFFFFFF, 0xFFFFFFFF, 0xFFFFFFFFFF, 0xFFFFFFFFFFFF, 0xFFFFFFFFFFFFFF,
+        0xFFFFFFFFFFFFFFFF,
+};
+
+// Shift that moves the top byte of a field into the sign bit and back, to sign-extend it. A field of 0 bytes
+// is already 0 after the mask.
+constexpr int FIELD_SHIFTS[9] = {0, 56, 48, 40, 32, 24, 16, 8, 0};
+
+// Load 8 bytes from an unaligned position, the bytes past the end of the buffer are zero
+static uint64_t load_field(const BYTE *position, const size_t available) {
+    uint64_t value = 0;
+
+    if (available >= sizeof value) {
+        memcpy(&value, position, sizeof value);
+    } else {
+        memcpy(&value, position, available);
+    }
+
+    return value;
+}
+
+NtfsRunDecoder::NtfsRunDecoder(const BYTE *run_data, const uint32_t run_data_length, const vcn64_t starting_vcn)
+        : run_data_(run_data), run_data_length_(run_data != nullptr ? run_data_length : 0), vcn_(starting_vcn) {
+}
+
+size_t NtfsRunDecoder::decode(const std::span<NtfsRun> runs) {
+    size_t count = 0;
+
+    while (count < runs.size() && !corrupt_ && index_ < run_data_length_ && run_data_[index_] != 0) {
+        const RunHeader header = RUN_HEADERS[run_data_[index_]];
+        const uint32_t length_field = index_ + 1;
+        const uint32_t offset_field = length_field + header.length_size_;
+        const uint32_t next_index = offset_field + header.offset_size_;
+
+        // The pair must be followed by at least one byte, the header of the next pair or the terminating zero
+        if (!header.valid_ || next_index >= run_data_length_) {
+            corrupt_ = true;
+            break;
+        }
+
+        const uint64_t length = load_field(&run_data_[length_field], run_data_length_ - length_field) &
+                                FIELD_MASKS[header.length_size_];
+        const uint64_t offset = load_field(&run_data_[offset_field], run_data_length_ - offset_field) &
+                                FIELD_MASKS[header.offset_size_];
+        const int shift = FIELD_SHIFTS[header.offset_size_];
+        const auto lcn_delta = (int64_t) (offset << shift) >> shift;
+
+        // A corrupt list can hold any value, the sums wrap instead of overflowing
+        lcn_ = (lcn64_t) ((uint64_t) lcn_ + (uint64_t) lcn_delta);
+        runs[count++] = {
+                .vcn_ = vcn_,
+                .lcn_ = lcn_,
+                .length_ = (cluster_count64_t) length,
+                .is_virtual_ = lcn_delta == 0,
+        };
+        vcn_ = (vcn64_t) ((uint64_t) vcn_ + length);
+        index_ = next_index;
+    }
+
+    return count;
+}
@@ -20,7 +20,9 @@
 
 #include <memory>
 
-ScanNTFS::ScanNTFS() = default;
+ScanNTFS::ScanNTFS() {
+    defrag_lib_ = DefragRunner::get_instance();
+}
 
 ScanNTFS::~ScanNTFS() = default;
 
@@ -36,23 +38,11 @@ ScanNTFS *ScanNTFS::get_instance() {
  * \brief Read the data that is specified in a RunData list from disk into memory, skipping the first Offset bytes.
  * \param offset Bytes to skip from set_begin of data
  * \return Return a malloc'ed buffer with the data, or nullptr if error. Note: The caller owns the returned buffer.
+ * Reads through reader_, so it must not be called while the reader has reads in flight.
  */
 BYTE *ScanNTFS::read_non_resident_data(const DefragState &data, const NtfsDiskInfoStruct *disk_info,
                                        const BYTE *run_data, const uint32_t run_data_length,
-                                       const uint64_t offset, uint64_t wanted_length) {
-    union UlongBytes {
-        struct {
-            BYTE bytes_[8];
-        };
-
-        int64_t value;
-    };
-
-    UlongBytes run_offset{};
-    UlongBytes run_length{};
-    OVERLAPPED g_overlapped;
-    DWORD bytes_read;
-    int i;
+                                       const uint64_t offset, uint64_t wanted_length) const {
     DefragGui *gui = DefragGui::get_instance();
 
     gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
@@ -78,109 +68,65 @@ BYTE *ScanNTFS::read_non_resident_data(const DefragState &data, const NtfsDiskIn
     auto buffer = std::make_unique<BYTE[]>(wanted_length);
 
     // Walk through the RunData and read the requested data from disk
-    uint32_t index = 0;
-    int64_t lcn = 0;
-    int64_t vcn = 0;
+    const uint64_t cluster_size = disk_info->bytes_per_sector_ * disk_info->sectors_per_cluster_;
+    NtfsRunDecoder decoder(run_data, run_data_length, 0);
+    NtfsRun runs[NTFS_RUN_BATCH];
+    size_t run_count;
 
-    while (run_data[index] != 0) {
-        // Decode the RunData and calculate the next Lcn.
-        const int run_length_size = run_data[index] & 0x0F;
-        const int run_offset_size = (run_data[index] & 0xF0) >> 4;
+    while ((run_count = decoder.decode(runs)) > 0) {
+        for (size_t r = 0; r < run_count; r++) {
+            const NtfsRun &run = runs[r];
 
-        index++;
+            // Ignore virtual extents
+            if (run.is_virtual_) continue;
 
-        if (index >= run_data_length) {
-            gui->show_debug(DebugLevel::Progress, nullptr,
-                            L"Error: datarun is longer than buffer, the MFT may be corrupt.");
+            // I don't think the RunLength can ever be zero, but just in case
+            if (run.length_ == 0) continue;
 
-            return nullptr;
-        }
+            /* Determine how many and which bytes we want to read. If we don't need
+            any bytes from this extent then loop. */
 
-        run_length.value = 0;
+            uint64_t extent_vcn = run.vcn_ * cluster_size;
+            uint64_t extent_lcn = run.lcn_ * cluster_size;
+            uint64_t extent_length = run.length_ * cluster_size;
 
-        for (i = 0; i < run_length_size; i++) {
-            run_length.bytes_[i] = run_data[index];
+            if (offset >= extent_vcn + extent_length) continue;
 
-            index++;
+            if (offset > extent_vcn) {
+                extent_lcn = extent_lcn + offset - extent_vcn;
+                extent_length = extent_length - (offset - extent_vcn);
+                extent_vcn = offset;
+            }
 
-            if (index >= run_data_length) {
-                gui->show_debug(DebugLevel::Progress, nullptr,
-                                L"Error: datarun is longer than buffer, the MFT may be corrupt.");
+            if (offset + wanted_length <= extent_vcn) continue;
 
-                return nullptr;
+            if (offset + wanted_length < extent_vcn + extent_length) {
+                extent_length = offset + wanted_length - extent_vcn;
             }
-        }
 
-        run_offset.value = 0;
+            if (extent_length == 0) continue;
 
-        for (i = 0; i < run_offset_size; i++) {
-            run_offset.bytes_[i] = run_data[index];
-
-            index++;
+            // Read the data from the disk. If error then return FALSE
+            gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
+                            std::format(L"    Reading " NUM_FMT " bytes from LCN=" NUM_FMT " into offset=" NUM_FMT,
+                                        extent_length,
+                                        extent_lcn / cluster_size,
+                                        extent_vcn - offset));
 
-            if (index >= run_data_length) {
+            if (!reader_->read(extent_lcn, &buffer[extent_vcn - offset], (size_t) extent_length)) {
                 gui->show_debug(DebugLevel::Progress, nullptr,
-                                L"Error: datarun is longer than buffer, the MFT may be corrupt.");
-
+                                std::format(L"Error while reading disk: {}",
+                                            Str::system_error(GetLastError())));
                 return nullptr;
             }
         }
+    }
 
-        if (run_offset.bytes_[i - 1] >= 0x80) while (i < 8) run_offset.bytes_[i++] = 0xFF;
-
-        lcn = lcn + run_offset.value;
-        vcn = vcn + run_length.value;
-
-        // Ignore virtual extents
-        if (run_offset.value == 0) continue;
-
-        // I don't think the RunLength can ever be zero, but just in case
-        if (run_length.value == 0) continue;
-
-        /* Determine how many and which bytes we want to read. If we don't need
-        any bytes from this extent then loop. */
-
-        uint64_t extent_vcn = (vcn - run_length.value) * disk_info->bytes_per_sector_ * disk_info->sectors_per_cluster_;
-        uint64_t extent_lcn = lcn * disk_info->bytes_per_sector_ * disk_info->sectors_per_cluster_;
-        uint64_t extent_length = run_length.value * disk_info->bytes_per_sector_ * disk_info->sectors_per_cluster_;
-
-        if (offset >= extent_vcn + extent_length) continue;
-
-        if (offset > extent_vcn) {
-            extent_lcn = extent_lcn + offset - extent_vcn;
-            extent_length = extent_length - (offset - extent_vcn);
-            extent_vcn = offset;
-        }
-
-        if (offset + wanted_length <= extent_vcn) continue;
-
-        if (offset + wanted_length < extent_vcn + extent_length) {
-            extent_length = offset + wanted_length - extent_vcn;
-        }
-
-        if (extent_length == 0) continue;
+    if (decoder.is_corrupt()) {
+        gui->show_debug(DebugLevel::Progress, nullptr,
+                        L"Error: datarun is longer than buffer, the MFT may be corrupt.");
 
-        // Read the data from the disk. If error then return FALSE
-        gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
-                        std::format(L"    Reading " NUM_FMT " bytes from LCN=" NUM_FMT " into offset=" NUM_FMT,
-                                    extent_length,
-                                    extent_lcn / (disk_info->bytes_per_sector_ * disk_info->sectors_per_cluster_),
-                                    extent_vcn - offset));
-
-        ULARGE_INTEGER trans;
-        trans.QuadPart = extent_lcn;
-
-        g_overlapped.Offset = trans.LowPart;
-        g_overlapped.OffsetHigh = trans.HighPart;
-        g_overlapped.hEvent = nullptr;
-
-        if (const errno_t result = ReadFile(data.disk_.volume_handle_, &buffer[extent_vcn - offset],
-                                            (uint32_t) extent_length, &bytes_read, &g_overlapped); result == 0) {
-            gui->show_debug(DebugLevel::Progress, nullptr,
-                            std::format(L"Error while reading disk: {}",
-                                        Str::system_error(GetLastError())));
-            return nullptr;
-        }
+        return nullptr;
     }
 
     return buffer.release();
@@ -191,18 +137,6 @@ bool ScanNTFS::translate_rundata_to_fragmentlist(
         const DefragState &data, InodeDataStruct *inode_data, const wchar_t *stream_name,
         ATTRIBUTE_TYPE stream_type, const BYTE *run_data, const uint32_t run_data_length, const vcn64_t starting_vcn,
         const uint64_t bytes) {
-    union UlongBytes {
-        struct {
-            BYTE bytes_[8];
-        };
-
-        int64_t value;
-    };
-    UlongBytes run_offset{};
-    UlongBytes run_length{};
-
-    int i;
-
     DefragGui *gui = DefragGui::get_instance();
 
     // Sanity check
@@ -236,7 +170,7 @@ bool ScanNTFS::translate_rundata_to_fragmentlist(
                 .clusters_ = 0,
                 .bytes_ = bytes,
         };
-        inode_data->streams_.push_back(new_stream);
+        inode_data->streams_.push_back(std::move(new_stream));
 
         // Step back one from end
         stream_iter = inode_data->streams_.end();
@@ -268,73 +202,23 @@ bool ScanNTFS::translate_rundata_to_fragmentlist(
     }
 
     // Walk through the RunData and add the extents
-    uint32_t index = 0;
-    lcn64_t lcn = 0;
-    auto vcn = starting_vcn;
-
-    if (run_data != nullptr)
-        while (run_data[index] != 0) {
-            // Decode the RunData and calculate the next Lcn
-            const int run_length_size = run_data[index] & 0x0F;
-            const int run_offset_size = (run_data[index] & 0xF0) >> 4;
-
-            index++;
+    NtfsRunDecoder decoder(run_data, run_data_length, starting_vcn);
+    NtfsRun runs[NTFS_RUN_BATCH];
+    size_t run_count;
 
-            if (index >= run_data_length) {
-                gui->show_debug(DebugLevel::Progress, nullptr,
-                                std::format(L"Error: datarun is longer than buffer, the MFT may be corrupt. inode={}",
-                                            inode_data->inode_));
-                return false;
-            }
-
-            run_length.value = 0;
-
-            for (i = 0; i < run_length_size; i++) {
-                run_length.bytes_[i] = run_data[index];
-
-                index++;
-
-                if (index >= run_data_length) {
-                    gui->show_debug(DebugLevel::Progress, nullptr,
-                                    std::format(
-                                            L"Error: datarun is longer than buffer, the MFT may be corrupt. inode={}",
-                                            inode_data->inode_));
-
-                    return false;
-                }
-            }
-
-            run_offset.value = 0;
-
-            for (i = 0; i < run_offset_size; i++) {
-                run_offset.bytes_[i] = run_data[index];
-
-                index++;
-
-                if (index >= run_data_length) {
-                    gui->show_debug(DebugLevel::Progress, nullptr,
-                                    std::format(
-                                            L"Error: datarun is longer than buffer, the MFT may be corrupt. inode={}",
-                                            inode_data->inode_));
-
-                    return false;
-                }
-            }
-
-            if (run_offset.bytes_[i - 1] >= 0x80) while (i < 8) run_offset.bytes_[i++] = 0xFF;
-
-            lcn = lcn + run_offset.value;
-            vcn = vcn + run_length.value;
+    while ((run_count = decoder.decode(runs)) > 0) {
+        for (size_t r = 0; r < run_count; r++) {
+            const NtfsRun &run = runs[r];
 
             // Show debug message
-            if (run_offset.value != 0) {
+            if (!run.is_virtual_) {
                 gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
-                                std::format(L"    Extent: Lcn=" NUM_FMT ", Vcn=" NUM_FMT ", NextVcn=" NUM_FMT, lcn,
-                                            vcn - run_length.value, vcn));
+                                std::format(L"    Extent: Lcn=" NUM_FMT ", Vcn=" NUM_FMT ", NextVcn=" NUM_FMT,
+                                            run.lcn_, run.vcn_, run.vcn_ + run.length_));
             } else {
                 gui->show_debug(DebugLevel::DetailedGapFinding, nullptr,
                                 std::format(L"    Extent (virtual): Vcn=" NUM_FMT ", NextVcn=" NUM_FMT,
-                                            vcn - run_length.value, vcn));
+                                            run.vcn_, run.vcn_ + run.length_));
             }
 
             /* Add the size of the fragment to the total number of clusters.
@@ -342,20 +226,28 @@ bool ScanNTFS::translate_rundata_to_fragmentlist(
             occupy clusters on disk, but are information used by compressed
             and sparse files. */
 
-            if (run_offset.value != 0) {
-                stream_iter->clusters_ = stream_iter->clusters_ + run_length.value;
+            if (!run.is_virtual_) {
+                stream_iter->clusters_ = stream_iter->clusters_ + run.length_;
             }
 
             // Add the extent to the Fragments
             FileFragment new_fragment = {
-                    .lcn_ = lcn,
-                    .next_vcn_ = vcn,
+                    .lcn_ = run.lcn_,
+                    .next_vcn_ = run.vcn_ + run.length_,
             };
 
-            if (run_offset.value == 0) new_fragment.set_virtual();
+            if (run.is_virtual_) new_fragment.set_virtual();
 
             stream_iter->fragments_.push_back(new_fragment);
         }
+    }
+
+    if (decoder.is_corrupt()) {
+        gui->show_debug(DebugLevel::Progress, nullptr,
+                        std::format(L"Error: datarun is longer than buffer, the MFT may be corrupt. inode={}",
+                                    inode_data->inode_));
+        return false;
+    }
 
     return true;
 }
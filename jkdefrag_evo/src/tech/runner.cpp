@@ -25,6 +25,15 @@
 #include <optional>
 #include <algorithm>
 
+// Number of extents that FSCTL_GET_RETRIEVAL_POINTERS returns per call at first, and at most
+constexpr size_t RETRIEVAL_INITIAL_EXTENTS = 1024;
+constexpr size_t RETRIEVAL_MAX_EXTENTS = 65536;
+
+// Size of a RETRIEVAL_POINTERS_BUFFER with room for the extents
+static constexpr size_t retrieval_buffer_size(const size_t extents) {
+    return offsetof(RETRIEVAL_POINTERS_BUFFER, Extents) + extents * sizeof(RETRIEVAL_POINTERS_BUFFER::Extents[0]);
+}
+
 DefragRunner::DefragRunner() = default;
 
 DefragRunner::~DefragRunner() = default;
@@ -213,22 +222,19 @@ clusters (zero) and no fragments (nullptr).
 
 */
 bool DefragRunner::get_fragments(const DefragState &data, FileNode *item, HANDLE file_handle) {
-    STARTING_VCN_INPUT_BUFFER RetrieveParam;
-
-    struct {
-        uint32_t extent_count_;
-        uint64_t starting_vcn_;
-
-        // TODO: Use std::array or vector, and modify the loading code to allocate only as needed
-        FileFragment extents_[1000];
-    } extent_data{};
-
+    STARTING_VCN_INPUT_BUFFER retrieve_param;
     BY_HANDLE_FILE_INFORMATION file_information;
-    FileFragment *last_fragment;
     uint32_t error_code;
     DWORD w;
     DefragGui *gui = DefragGui::get_instance();
 
+    // Every thread keeps its buffer for the clustermap, it only grows for files with many extents
+    thread_local std::vector<BYTE> extent_buffer;
+
+    if (extent_buffer.size() < retrieval_buffer_size(RETRIEVAL_INITIAL_EXTENTS)) {
+        extent_buffer.resize(retrieval_buffer_size(RETRIEVAL_INITIAL_EXTENTS));
+    }
+
     // Initialize. If the item has an old list of fragments then delete it
     item->clusters_count_ = 0;
     item->fragments_.clear();
@@ -249,34 +255,20 @@ bool DefragRunner::get_fragments(const DefragState &data, FileNode *item, HANDLE
                     std::format(L"Getting cluster bitmap: {}", item->get_long_path()));
 
     /* Ask Windows for the clustermap of the item and save it in memory.
-    The buffer that is used to ask Windows for the clustermap has a
-    fixed size, so we may have to loop a couple of times. */
+    If the buffer is too small we loop, and the buffer is made bigger for the
+    next call, so a file with many fragments takes only a few calls. */
     uint64_t vcn = 0;
-    int max_loop = 1000;
-    last_fragment = nullptr;
 
     do {
-        /* I strongly suspect that the FSCTL_GET_RETRIEVAL_POINTERS system call
-        can sometimes return an empty bitmap and ERROR_MORE_DATA. That's not
-        very nice of Microsoft, because it causes an infinite loop. I've
-        therefore added a loop counter that will limit the loop to 1000
-        iterations. This means the defragger cannot handle files with more
-        than 100000 fragments, though. */
-        if (max_loop <= 0) {
-            gui->show_debug(DebugLevel::Progress, nullptr, L"FSCTL_GET_RETRIEVAL_POINTERS error: Infinite loop");
-
-            return false;
-        }
-
-        max_loop = max_loop - 1;
-
         /* Ask Windows for the (next segment of the) clustermap of this file. If error
         then leave the loop. */
-        RetrieveParam.StartingVcn.QuadPart = vcn;
+        retrieve_param.StartingVcn.QuadPart = (LONGLONG) vcn;
+
+        const auto extent_data = (RETRIEVAL_POINTERS_BUFFER *) extent_buffer.data();
 
         error_code = DeviceIoControl(file_handle, FSCTL_GET_RETRIEVAL_POINTERS,
-                                     &RetrieveParam, sizeof RetrieveParam,
-                                     &extent_data, sizeof extent_data, &w, nullptr);
+                                     &retrieve_param, sizeof retrieve_param,
+                                     extent_data, (DWORD) extent_buffer.size(), &w, nullptr);
 
         if (error_code != 0) {
             error_code = NO_ERROR;
@@ -286,40 +278,53 @@ bool DefragRunner::get_fragments(const DefragState &data, FileNode *item, HANDLE
 
         if (error_code != NO_ERROR && error_code != ERROR_MORE_DATA) break;
 
+        /* I strongly suspect that the FSCTL_GET_RETRIEVAL_POINTERS system call
+        can sometimes return an empty bitmap and ERROR_MORE_DATA. That's not
+        very nice of Microsoft, because it causes an infinite loop. */
+        if (error_code == ERROR_MORE_DATA && extent_data->ExtentCount == 0) {
+            gui->show_debug(DebugLevel::Progress, nullptr, L"FSCTL_GET_RETRIEVAL_POINTERS error: Infinite loop");
+
+            return false;
+        }
+
         /* Walk through the clustermap, count the total number of clusters, and
         save all fragments in memory. */
-        for (uint32_t i = 0; i < extent_data.extent_count_; i++) {
+        for (DWORD i = 0; i < extent_data->ExtentCount; i++) {
+            const FileFragment new_fragment = {
+                    .lcn_ = (lcn64_t) extent_data->Extents[i].Lcn.QuadPart,
+                    .next_vcn_ = (vcn64_t) extent_data->Extents[i].NextVcn.QuadPart,
+            };
+
             // Show debug message
-            if (!extent_data.extents_[i].is_virtual()) {
+            if (!new_fragment.is_virtual()) {
                 // "Extent: Lcn=%I64u, Vcn=%I64u, NextVcn=%I64u"
-                gui->show_debug(
-                        DebugLevel::DetailedFileInfo, nullptr,
-                        std::format(EXTENT_FMT, extent_data.extents_[i].lcn_, vcn, extent_data.extents_[i].next_vcn_));
+                gui->show_debug(DebugLevel::DetailedFileInfo, nullptr,
+                                std::format(EXTENT_FMT, new_fragment.lcn_, vcn, new_fragment.next_vcn_));
             } else {
                 // "Extent (virtual): Vcn=%I64u, NextVcn=%I64u"
-                gui->show_debug(
-                        DebugLevel::DetailedFileInfo, nullptr,
-                        std::format(VEXTENT_FMT, vcn, extent_data.extents_[i].next_vcn_));
+                gui->show_debug(DebugLevel::DetailedFileInfo, nullptr,
+                                std::format(VEXTENT_FMT, vcn, new_fragment.next_vcn_));
             }
 
             /* Add the size of the fragment to the total number of clusters.
             There are two kinds of fragments: real and virtual. The latter do not
             occupy clusters on disk, but are information used by compressed
             and sparse files. */
-            if (!extent_data.extents_[i].is_virtual()) {
-                item->clusters_count_ = item->clusters_count_ + extent_data.extents_[i].next_vcn_ - vcn;
+            if (!new_fragment.is_virtual()) {
+                item->clusters_count_ = item->clusters_count_ + new_fragment.next_vcn_ - vcn;
             }
 
             // Add the fragment to the Fragments
-            FileFragment new_fragment = {
-                    .lcn_ = extent_data.extents_[i].lcn_,
-                    .next_vcn_ = extent_data.extents_[i].next_vcn_,
-            };
-
             item->fragments_.push_back(new_fragment);
 
             // The Vcn of the next fragment is the NextVcn field in this record
-            vcn = extent_data.extents_[i].next_vcn_;
+            vcn = new_fragment.next_vcn_;
+        }
+
+        // The file has more extents than fit in the buffer, ask for more at a time from now on
+        if (error_code == ERROR_MORE_DATA && extent_buffer.size() < retrieval_buffer_size(RETRIEVAL_MAX_EXTENTS)) {
+            extent_buffer.resize(
+                    std::min<size_t>(extent_buffer.size() * 2, retrieval_buffer_size(RETRIEVAL_MAX_EXTENTS)));
         }
 
         // Loop until we have processed the entire clustermap of the file
@@ -512,6 +517,9 @@ void DefragRunner::call_show_status(DefragState &defrag_state, const DefragPhase
     DWORD error_code;
     DefragGui *gui = DefragGui::get_instance();
 
+    // A new phase starts, the item handles of the phase before are not needed any more
+    defrag_state.move_executor_->release_handles();
+
     // Count the number of free gaps on the disk
     defrag_state.count_gaps_ = 0;
     defrag_state.count_free_clusters_ = 0;
@@ -709,7 +717,9 @@ void DefragRunner::defrag_all_drives_sync(DefragState &data, OptimizeMode mode)
 
 // Run the defragger/optimizer. See the .h file for a full explanation
 void DefragRunner::start_defrag_sync(const wchar_t *path, OptimizeMode optimize_mode, int speed, double free_space,
-                                     const Wstrings &excludes, const Wstrings &space_hogs, RunningState *run_state) {
+                                     const Wstrings &excludes, const Wstrings &space_hogs,
+                                     const std::wstring &snapshot_dir, const std::wstring &journal_file,
+                                     RunningState *run_state) {
     DefragGui *gui = DefragGui::get_instance();
 
     gui->log_detailed_progress(L"Defrag starting…");
@@ -719,6 +729,8 @@ void DefragRunner::start_defrag_sync(const wchar_t *path, OptimizeMode optimize_
     data.speed_ = speed;
     data.free_space_ = free_space;
     data.excludes_ = excludes;
+    data.snapshot_dir_ = snapshot_dir;
+    data.journal_file_ = journal_file;
 
     RunningState default_running;
     if (run_state == nullptr) {
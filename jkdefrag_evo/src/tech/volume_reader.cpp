@@ -0,0 +1,176 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+#include "precompiled_header.h"
+
+std::unique_ptr<VolumeReader> VolumeReader::create(const wchar_t *path, const bool is_image, const size_t slots) {
+    if (is_image) {
+        auto reader = std::make_unique<MappedImageReader>(slots);
+
+        if (reader->open(path)) return reader;
+    }
+
+    // A volume, or an image that cannot be mapped in one piece
+    auto reader = std::make_unique<Win32VolumeReader>(slots);
+
+    if (!reader->open(path)) return nullptr;
+
+    return reader;
+}
+
+Win32VolumeReader::Win32VolumeReader(const size_t slots) : slots_(std::max<size_t>(slots, 1)) {
+}
+
+Win32VolumeReader::~Win32VolumeReader() {
+    for (auto &slot: slots_) {
+        if (slot.overlapped_.hEvent != nullptr) CloseHandle(slot.overlapped_.hEvent);
+    }
+
+    if (handle_ != INVALID_HANDLE_VALUE) CloseHandle(handle_);
+}
+
+// Open the volume or image file for overlapped reading. This is a second handle next to
+// data.disk_.volume_handle_, which is opened for synchronous access.
+bool Win32VolumeReader::open(const wchar_t *path) {
+    handle_ = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                          OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+
+    if (handle_ == INVALID_HANDLE_VALUE) return false;
+
+    for (auto &slot: slots_) {
+        slot = {};
+        slot.overlapped_.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+        if (slot.overlapped_.hEvent == nullptr) return false;
+    }
+
+    return true;
+}
+
+bool Win32VolumeReader::begin_read(const size_t slot, const uint64_t offset, BYTE *buffer, const size_t length) {
+    Slot &s = slots_[slot];
+    ULARGE_INTEGER trans;
+    trans.QuadPart = offset;
+
+    s.overlapped_.Internal = 0;
+    s.overlapped_.InternalHigh = 0;
+    s.overlapped_.Offset = trans.LowPart;
+    s.overlapped_.OffsetHigh = trans.HighPart;
+    s.length_ = (DWORD) length;
+
+    ResetEvent(s.overlapped_.hEvent);
+
+    if (ReadFile(handle_, buffer, s.length_, nullptr, &s.overlapped_) == FALSE
+        && GetLastError() != ERROR_IO_PENDING) {
+        return false;
+    }
+
+    return true;
+}
+
+bool Win32VolumeReader::finish_read(const size_t slot) {
+    Slot &s = slots_[slot];
+    DWORD bytes_read;
+
+    if (GetOverlappedResult(handle_, &s.overlapped_, &bytes_read, TRUE) == FALSE) return false;
+
+    if (bytes_read != s.length_) {
+        SetLastError(ERROR_HANDLE_EOF);
+        return false;
+    }
+
+    bytes_read_ += bytes_read;
+    read_count_++;
+    return true;
+}
+
+MappedImageReader::MappedImageReader(const size_t slots) : slots_(std::max<size_t>(slots, 1)) {
+}
+
+MappedImageReader::~MappedImageReader() {
+    if (view_ != nullptr) UnmapViewOfFile(view_);
+    if (mapping_ != nullptr) CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+}
+
+// Map the whole image file. Fails for volumes, which have no file size, and for images that do not fit in the
+// address space.
+bool MappedImageReader::open(const wchar_t *path) {
+    file_ = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS,
+                        nullptr);
+
+    if (file_ == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER file_size;
+
+    if (GetFileSizeEx(file_, &file_size) == FALSE || file_size.QuadPart == 0) return false;
+
+    size_ = (uint64_t) file_size.QuadPart;
+
+    if (size_ > SIZE_MAX) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+    if (mapping_ == nullptr) return false;
+
+    view_ = (const BYTE *) MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+
+    return view_ != nullptr;
+}
+
+// Copy out of the mapping. A page of the image that cannot be read raises an exception instead of returning an
+// error, it is turned into ERROR_READ_FAULT.
+static DWORD copy_from_view(BYTE *buffer, const BYTE *source, const size_t length) {
+    __try {
+        memcpy(buffer, source, length);
+    } __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER
+                                                               : EXCEPTION_CONTINUE_SEARCH) {
+        return ERROR_READ_FAULT;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+bool MappedImageReader::begin_read(const size_t slot, const uint64_t offset, BYTE *buffer, const size_t length) {
+    Slot &s = slots_[slot];
+
+    s.length_ = length;
+
+    if (offset > size_ || length > size_ - offset) {
+        s.error_ = ERROR_HANDLE_EOF;
+        return true;
+    }
+
+    s.error_ = copy_from_view(buffer, view_ + offset, length);
+    return true;
+}
+
+bool MappedImageReader::finish_read(const size_t slot) {
+    const Slot &s = slots_[slot];
+
+    if (s.error_ != ERROR_SUCCESS) {
+        SetLastError(s.error_);
+        return false;
+    }
+
+    bytes_read_ += s.length_;
+    read_count_++;
+    return true;
+}
@@ -88,3 +88,49 @@ bool Str::match_mask(const wchar_t *string, const wchar_t *mask) {
 
     return false;
 }
+
+// Compare the beginning of a string with a mask, case-insensitive, using the same rules as match_mask().
+// Return Always if every string that starts with the prefix matches the mask, Never if none of them can
+// match, and Depends if the outcome depends on the characters after the prefix.
+Str::MaskVerdict Str::match_mask_prefix(const wchar_t *prefix, const wchar_t *mask) {
+    if (prefix == nullptr) return MaskVerdict::Never;
+    if (mask == nullptr) return MaskVerdict::Never;
+    if (wcscmp(mask, L"*") == 0) return MaskVerdict::Always;
+
+    auto m = mask;
+    auto s = prefix;
+
+    while (*m != L'\0' && *s != L'\0') {
+        if (std::towlower(*m) != std::towlower(*s) && *m != '?') {
+            if (*m != L'*') return MaskVerdict::Never;
+
+            m++;
+
+            if (*m == L'\0') return MaskVerdict::Always;
+
+            // The '*' can swallow part of the prefix, or all of it and continue into the rest of the name
+            auto verdict = MaskVerdict::Never;
+
+            while (verdict != MaskVerdict::Always) {
+                if (auto v = match_mask_prefix(s, m); v > verdict) verdict = v;
+                if (*s == L'\0') break;
+                s++;
+            }
+
+            return verdict;
+        }
+
+        m++;
+        s++;
+    }
+
+    // The mask is used up, only the prefix itself can match
+    if (*m == L'\0') return *s == L'\0' ? MaskVerdict::Depends : MaskVerdict::Never;
+
+    // The prefix is used up, only wildcards left in the mask
+    while (*m == L'*') m++;
+
+    if (*m == L'\0') return MaskVerdict::Always;
+
+    return MaskVerdict::Depends;
+}
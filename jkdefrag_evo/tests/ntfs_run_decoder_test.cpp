@@ -0,0 +1,224 @@
+/*
+ JkDefrag  --  Defragment and optimize all harddisks.
+
+ This program is free software; you can redistribute it and/or modify it under the terms of the GNU General
+ Public License as published by the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+ the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ For the full text of the license see the "License gpl.txt" file.
+
+ Jeroen C. Kessels, Internet Engineer
+ http://www.kessels.com/
+ */
+
+// Regression and fuzz test of NtfsRunDecoder. Known run lists are decoded and compared with their runs, random run
+// lists are encoded and decoded again, and random bytes must decode without reading past the buffer. Returns 0 if
+// all checks pass.
+
+#include <Windows.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "ntfs_run_decoder.h"
+
+// Number of random run lists of the round trip and of the random bytes
+constexpr int FUZZ_ITERATIONS = 100000;
+
+static int failures = 0;
+
+static void check(const bool condition, const char *what, const int iteration) {
+    if (condition) return;
+
+    failures++;
+    printf("FAILED: %s (iteration %d)\n", what, iteration);
+}
+
+// Decode a whole run list. The buffer is copied to the heap with exactly its own size, so a read past the end is
+// caught by the debug heap or a sanitizer.
+static std::vector<NtfsRun> decode_all(const std::vector<BYTE> &run_data, const vcn64_t starting_vcn,
+                                       bool &corrupt) {
+    const auto copy = std::make_unique<BYTE[]>(std::max<size_t>(run_data.size(), 1));
+    std::copy(run_data.begin(), run_data.end(), copy.get());
+
+    std::vector<NtfsRun> result;
+    std::array<NtfsRun, NTFS_RUN_BATCH> runs{};
+    NtfsRunDecoder decoder(copy.get(), (uint32_t) run_data.size(), starting_vcn);
+
+    while (const size_t count = decoder.decode(runs)) {
+        result.insert(result.end(), runs.begin(), runs.begin() + (ptrdiff_t) count);
+    }
+
+    corrupt = decoder.is_corrupt();
+
+    return result;
+}
+
+// Encode runs as mapping pairs, every field as small as its value allows. A virtual run has no offset field.
+static std::vector<BYTE> encode(const std::vector<NtfsRun> &runs) {
+    std::vector<BYTE> run_data;
+    lcn64_t lcn = 0;
+
+    for (auto &run: runs) {
+        const auto length = (uint64_t) run.length_;
+        const int64_t delta = run.is_virtual_ ? 0 : run.lcn_ - lcn;
+
+        uint8_t length_size = 1;
+
+        while (length_size < 8 && (length >> (length_size * 8)) != 0) length_size++;
+
+        uint8_t offset_size = 0;
+
+        if (!run.is_virtual_) {
+            offset_size = 1;
+
+            while (offset_size < 8 && (delta < -(1LL << (offset_size * 8 - 1)) ||
+                                       delta >= (1LL << (offset_size * 8 - 1)))) {
+                offset_size++;
+            }
+
+            lcn = run.lcn_;
+        }
+
+        run_data.push_back((BYTE) (length_size | offset_size << 4));
+
+        for (uint8_t i = 0; i < length_size; i++) run_data.push_back((BYTE) (length >> (i * 8)));
+        for (uint8_t i = 0; i < offset_size; i++) run_data.push_back((BYTE) ((uint64_t) delta >> (i * 8)));
+    }
+
+    run_data.push_back(0);
+
+    return run_data;
+}
+
+static bool same_runs(const std::vector<NtfsRun> &a, const std::vector<NtfsRun> &b) {
+    if (a.size() != b.size()) return false;
+
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].vcn_ != b[i].vcn_ || a[i].length_ != b[i].length_ || a[i].is_virtual_ != b[i].is_virtual_) {
+            return false;
+        }
+
+        if (!a[i].is_virtual_ && a[i].lcn_ != b[i].lcn_) return false;
+    }
+
+    return true;
+}
+
+// Run lists with a known result
+static void test_known_lists() {
+    bool corrupt;
+
+    // 0x18 clusters at 0x5634, then 0x10 clusters 0x20 back, then a hole of 0x8 clusters
+    auto runs = decode_all({0x21, 0x18, 0x34, 0x56, 0x11, 0x10, 0xE0, 0x01, 0x08, 0x00}, 0, corrupt);
+
+    check(!corrupt && runs.size() == 3, "known list: number of runs", 0);
+
+    if (runs.size() == 3) {
+        check(runs[0].vcn_ == 0 && runs[0].lcn_ == 0x5634 && runs[0].length_ == 0x18 && !runs[0].is_virtual_,
+              "known list: first run", 0);
+        check(runs[1].vcn_ == 0x18 && runs[1].lcn_ == 0x5614 && runs[1].length_ == 0x10 && !runs[1].is_virtual_,
+              "known list: negative delta", 0);
+        check(runs[2].vcn_ == 0x28 && runs[2].length_ == 0x08 && runs[2].is_virtual_,
+              "known list: virtual run", 0);
+    }
+
+    // The starting vcn of an attribute that is continued in another record
+    runs = decode_all({0x11, 0x04, 0x10, 0x00}, 100, corrupt);
+    check(!corrupt && runs.size() == 1 && runs[0].vcn_ == 100, "starting vcn", 0);
+
+    // A field of more than 8 bytes
+    decode_all({0x19, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00}, 0, corrupt);
+    check(corrupt, "length field of 9 bytes is corrupt", 0);
+
+    // A pair that is cut off by the end of the buffer, and a pair without the terminating zero
+    decode_all({0x21, 0x18, 0x34}, 0, corrupt);
+    check(corrupt, "truncated pair is corrupt", 0);
+    decode_all({0x11, 0x04, 0x10}, 0, corrupt);
+    check(corrupt, "pair without terminator is corrupt", 0);
+
+    // An empty list
+    runs = decode_all({0x00}, 0, corrupt);
+    check(!corrupt && runs.empty(), "empty list", 0);
+    runs = decode_all({}, 0, corrupt);
+    check(!corrupt && runs.empty(), "empty buffer", 0);
+}
+
+// Random run lists decode to the runs they were encoded from
+static void test_round_trip(std::mt19937_64 &random) {
+    for (int iteration = 0; iteration < FUZZ_ITERATIONS; iteration++) {
+        std::vector<NtfsRun> runs(1 + random() % 100);
+        vcn64_t vcn = 0;
+        lcn64_t lcn = 0;
+
+        for (auto &run: runs) {
+            run.vcn_ = vcn;
+            run.length_ = 1 + (cluster_count64_t) (random() % (random() % 4 == 0 ? 1ULL << 40 : 1000));
+            run.is_virtual_ = random() % 5 == 0;
+
+            if (!run.is_virtual_) {
+                // A real run never starts where the run before it started, the delta would be 0
+                do {
+                    run.lcn_ = (lcn64_t) (random() % (1ULL << (1 + random() % 48)));
+                } while (run.lcn_ == lcn);
+
+                lcn = run.lcn_;
+            }
+
+            vcn += run.length_;
+        }
+
+        bool corrupt;
+        const auto decoded = decode_all(encode(runs), 0, corrupt);
+
+        check(!corrupt && same_runs(runs, decoded), "round trip", iteration);
+    }
+}
+
+// Random bytes decode without reading past the buffer, and the runs follow each other
+static void test_random_bytes(std::mt19937_64 &random) {
+    for (int iteration = 0; iteration < FUZZ_ITERATIONS; iteration++) {
+        std::vector<BYTE> run_data(random() % 64);
+
+        for (auto &byte: run_data) byte = (BYTE) random();
+
+        bool corrupt;
+        const auto runs = decode_all(run_data, 0, corrupt);
+
+        // Every pair has at least a header byte and a length byte
+        check(runs.size() <= run_data.size() / 2, "number of runs", iteration);
+
+        vcn64_t vcn = 0;
+
+        for (auto &run: runs) {
+            check(run.vcn_ == vcn, "runs follow each other", iteration);
+            vcn = (vcn64_t) ((uint64_t) vcn + (uint64_t) run.length_);
+        }
+    }
+}
+
+int main() {
+    std::mt19937_64 random(20061018);
+
+    test_known_lists();
+    test_round_trip(random);
+    test_random_bytes(random);
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}